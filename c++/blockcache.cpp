@@ -0,0 +1,108 @@
+#include "blockcache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+namespace ZFecFS {
+
+bool BlockCache::ShareSet::Identify(const std::vector<boost::shared_ptr<AbstractFile> >& files,
+                                    ShareSet& shareSet)
+{
+    // the decoded contents do not depend on the order the shares were found in
+    std::vector<std::pair<std::pair<dev_t, ino_t>, std::pair<off_t, long long> > > stats;
+    BOOST_FOREACH(const boost::shared_ptr<AbstractFile>& file, files) {
+        struct stat statBuf;
+        if (!file->Stat(statBuf))
+            return false;
+        const long long mtime = (long long)statBuf.st_mtim.tv_sec * 1000000000LL
+                                + statBuf.st_mtim.tv_nsec;
+        stats.push_back(std::make_pair(std::make_pair(statBuf.st_dev, statBuf.st_ino),
+                                       std::make_pair(statBuf.st_size, mtime)));
+    }
+    std::sort(stats.begin(), stats.end());
+
+    std::ostringstream id;
+    std::ostringstream version;
+    for (unsigned int i = 0; i < stats.size(); ++i) {
+        id << stats[i].first.first << ':' << stats[i].first.second << '/';
+        version << stats[i].second.first << ':' << stats[i].second.second << '/';
+    }
+    shareSet.id = id.str();
+    shareSet.version = version.str();
+    return true;
+}
+
+BlockCache::Block BlockCache::Lookup(const ShareSet& shareSet, off_t blockIndex)
+{
+    const std::string key = MakeKey(shareSet, blockIndex);
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<std::string, EntryList::iterator>::iterator it = index.find(key);
+    if (it == index.end()) {
+        ++statistics.misses;
+        return Block();
+    }
+    if (it->second->version != shareSet.version) {
+        // one of the share files was modified since the block was decoded
+        ++statistics.invalidations;
+        ++statistics.misses;
+        Erase(it->second);
+        return Block();
+    }
+    ++statistics.hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->block;
+}
+
+void BlockCache::Insert(const ShareSet& shareSet, off_t blockIndex, const Block& block)
+{
+    if (block->size() > byteBudget)
+        return;
+
+    Entry entry;
+    entry.key = MakeKey(shareSet, blockIndex);
+    entry.version = shareSet.version;
+    entry.block = block;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<std::string, EntryList::iterator>::iterator it = index.find(entry.key);
+    if (it != index.end())
+        Erase(it->second);
+
+    while (!entries.empty() && statistics.bytes + block->size() > byteBudget) {
+        ++statistics.evictions;
+        Erase(--entries.end());
+    }
+
+    entries.push_front(entry);
+    index[entries.front().key] = entries.begin();
+    statistics.bytes += block->size();
+}
+
+BlockCache::Statistics BlockCache::GetStatistics() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return statistics;
+}
+
+std::string BlockCache::MakeKey(const ShareSet& shareSet, off_t blockIndex)
+{
+    std::ostringstream key;
+    key << shareSet.id << '#' << blockIndex;
+    return key.str();
+}
+
+void BlockCache::Erase(EntryList::iterator entry)
+{
+    statistics.bytes -= entry->block->size();
+    index.erase(entry->key);
+    entries.erase(entry);
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,84 @@
+#ifndef ZFECFS_BLOCKCACHE_H
+#define ZFECFS_BLOCKCACHE_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <tr1/unordered_map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// Process-wide LRU cache of decoded data, shared by all FileDecoders.
+/// Blocks are keyed by the identity of the share files they were decoded
+/// from and by their index inside the decoded file.
+class BlockCache : boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<const std::vector<char> > Block;
+
+    /// Identity (device and inode of each share file) and version (size and
+    /// modification time of each share file) of a set of shares.
+    class ShareSet {
+    public:
+        std::string id;
+        std::string version;
+
+        /// Returns false if not all files are backed by the filesystem.
+        static bool Identify(const std::vector<boost::shared_ptr<AbstractFile> >& files,
+                             ShareSet& shareSet);
+    };
+
+    class Statistics {
+    public:
+        Statistics() : hits(0), misses(0), invalidations(0), evictions(0), bytes(0) {}
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long invalidations;
+        unsigned long long evictions;
+        size_t bytes;
+    };
+
+    explicit BlockCache(size_t byteBudget)
+        : byteBudget(byteBudget)
+    {}
+
+    bool Enabled() const { return byteBudget > 0; }
+
+    /// Returns an empty pointer if the block is not cached or was decoded
+    /// from a different version of the shares.
+    Block Lookup(const ShareSet& shareSet, off_t blockIndex);
+    void Insert(const ShareSet& shareSet, off_t blockIndex, const Block& block);
+
+    Statistics GetStatistics() const;
+
+private:
+    class Entry {
+    public:
+        std::string key;
+        std::string version;
+        Block block;
+    };
+    typedef std::list<Entry> EntryList;
+
+    static std::string MakeKey(const ShareSet& shareSet, off_t blockIndex);
+    void Erase(EntryList::iterator entry);
+
+    const size_t byteBudget;
+
+    mutable boost::mutex mutex;
+    EntryList entries; // most recently used first
+    std::tr1::unordered_map<std::string, EntryList::iterator> index;
+    Statistics statistics;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_BLOCKCACHE_H
@@ -0,0 +1,109 @@
+#include "blocksums.h"
+
+#include <openssl/evp.h>
+
+#include <sstream>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const unsigned int sumSize = 32;
+
+} // anonymous namespace
+
+const char* const BlockSums::fileSuffix = ".zfecfs-sums";
+
+off_t BlockSums::FileSize(off_t shareSize) const
+{
+    const off_t blocks = (shareSize + blockSize - 1) / blockSize;
+    return Header(shareSize).size() + blocks * (2 * sumSize + 1);
+}
+
+std::string BlockSums::Get(const struct stat& sourceStat, unsigned int shareIndex,
+                           off_t shareSize, const ShareReader& read)
+{
+    const Key key(std::make_pair(sourceStat.st_dev, sourceStat.st_ino), shareIndex);
+    const std::string stamp = Stamp(sourceStat);
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::map<Key, EntryList::iterator>::iterator it = index.find(key);
+        if (it != index.end()) {
+            if (it->second->stamp == stamp) {
+                entries.splice(entries.begin(), entries, it->second);
+                return *it->second->sums;
+            }
+            bytes -= it->second->sums->size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.stamp = stamp;
+    entry.sums = boost::make_shared<std::string>(Compute(shareSize, read));
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (index.find(key) == index.end() && entry.sums->size() <= byteBudget) {
+        entries.push_front(entry);
+        index[key] = entries.begin();
+        bytes += entry.sums->size();
+        while (bytes > byteBudget) {
+            bytes -= entries.back().sums->size();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+    return *entry.sums;
+}
+
+std::string BlockSums::Header(off_t shareSize) const
+{
+    std::ostringstream header;
+    header << "zfecfs-sums sha256 " << blockSize << ' ' << shareSize << '\n';
+    return header.str();
+}
+
+std::string BlockSums::Compute(off_t shareSize, const ShareReader& read) const
+{
+    std::string sums = Header(shareSize);
+    std::vector<char> block(blockSize);
+    for (off_t offset = 0; offset < shareSize; offset += blockSize) {
+        size_t sizeRead = 0;
+        const size_t size = std::min(off_t(blockSize), shareSize - offset);
+        while (sizeRead < size) {
+            const int result = read(&block[sizeRead], size - sizeRead, offset + sizeRead);
+            if (result <= 0)
+                throw SimpleException("Share changed while computing its sums.");
+            sizeRead += result;
+        }
+
+        unsigned char sum[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        if (EVP_Digest(&block[0], size, sum, &length, EVP_sha256(), NULL) != 1 || length != sumSize)
+            throw SimpleException("Unable to compute sum.");
+        for (unsigned int i = 0; i < length; ++i) {
+            sums.push_back(Hex::EncodeDigit(sum[i] >> 4));
+            sums.push_back(Hex::EncodeDigit(sum[i] & 0xf));
+        }
+        sums.push_back('\n');
+    }
+    return sums;
+}
+
+std::string BlockSums::Stamp(const struct stat& sourceStat)
+{
+    std::ostringstream stamp;
+    stamp << sourceStat.st_size << ':' << sourceStat.st_mtim.tv_sec << '.' << sourceStat.st_mtim.tv_nsec
+          << ':' << sourceStat.st_ctim.tv_sec << '.' << sourceStat.st_ctim.tv_nsec;
+    return stamp.str();
+}
+
+} // namespace ZFecFS
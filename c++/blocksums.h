@@ -0,0 +1,78 @@
+#ifndef ZFECFS_BLOCKSUMS_H
+#define ZFECFS_BLOCKSUMS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <list>
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// SHA-256 sums of the fixed-size blocks of shares, so that a share can be
+/// compared with a remote copy without reading it through the encoder.
+///
+/// The encoder serves them as a generated file next to each share file,
+/// which starts with a line "zfecfs-sums sha256 <block size> <share size>"
+/// followed by the hex sum of each block on its own line. Sums are kept in
+/// a bounded in-memory cache keyed by the source file and share index and
+/// are only used while size, mtime and ctime of the source are unchanged.
+class BlockSums : boost::noncopyable
+{
+public:
+    /// Suffix appended to the name of a share file to get its sums.
+    static const char* const fileSuffix;
+
+    /// Reads size bytes of the share at offset, like FileEncoder::Read.
+    typedef boost::function<int (char* buffer, size_t size, off_t offset)> ShareReader;
+
+    BlockSums(size_t blockSize, size_t byteBudget)
+        : blockSize(blockSize)
+        , byteBudget(byteBudget)
+        , bytes(0)
+    {}
+
+    bool Enabled() const { return blockSize > 0; }
+
+    /// Size of the sums file of a share of shareSize bytes.
+    off_t FileSize(off_t shareSize) const;
+
+    /// Returns the sums file of the share shareIndex of the source file
+    /// described by sourceStat, reading the share through read if the sums
+    /// are not cached.
+    std::string Get(const struct stat& sourceStat, unsigned int shareIndex,
+                    off_t shareSize, const ShareReader& read);
+
+private:
+    typedef std::pair<std::pair<dev_t, ino_t>, unsigned int> Key;
+
+    class Entry {
+    public:
+        Key key;
+        std::string stamp;
+        boost::shared_ptr<const std::string> sums;
+    };
+    typedef std::list<Entry> EntryList;
+
+    std::string Header(off_t shareSize) const;
+    std::string Compute(off_t shareSize, const ShareReader& read) const;
+    static std::string Stamp(const struct stat& sourceStat);
+
+    const size_t blockSize;
+    const size_t byteBudget;
+
+    boost::mutex mutex;
+    EntryList entries; // most recently used first
+    std::map<Key, EntryList::iterator> index;
+    size_t bytes;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_BLOCKSUMS_H
@@ -0,0 +1,23 @@
+#ifndef ZFECFS_CACHEINVALIDATOR_H
+#define ZFECFS_CACHEINVALIDATOR_H
+
+#include <string>
+
+namespace ZFecFS {
+
+/// Tells the kernel that what it cached about a path in the mount is stale,
+/// so that long attribute, entry and page cache timeouts can be used.
+class CacheInvalidator
+{
+public:
+    virtual ~CacheInvalidator() {}
+
+    /// Drops the cached attributes and contents of the file at path.
+    virtual void InvalidateContents(const std::string& path) = 0;
+    /// Drops the cached lookup of name in the directory parent.
+    virtual void InvalidateEntry(const std::string& parent, const std::string& name) = 0;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_CACHEINVALIDATOR_H
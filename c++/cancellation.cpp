@@ -0,0 +1,49 @@
+#include "cancellation.h"
+
+namespace ZFecFS {
+
+namespace {
+
+__thread Cancellation::Check threadCheck = NULL;
+__thread void* threadData = NULL;
+
+} // anonymous namespace
+
+Cancellation::Scope::Scope(const Context& context)
+    : previous(Current())
+{
+    threadCheck = context.check;
+    threadData = context.data;
+}
+
+Cancellation::Scope::~Scope()
+{
+    threadCheck = previous.check;
+    threadData = previous.data;
+}
+
+Cancellation::ThreadCheck::ThreadCheck(int (*check)())
+    : check(check)
+    , owner(pthread_self())
+    , requested(false)
+{}
+
+bool Cancellation::ThreadCheck::Check(void* data)
+{
+    ThreadCheck* self = static_cast<ThreadCheck*>(data);
+    if (!self->requested && pthread_equal(pthread_self(), self->owner))
+        self->requested = self->check() != 0;
+    return self->requested;
+}
+
+Cancellation::Context Cancellation::Current()
+{
+    return Context(threadCheck, threadData);
+}
+
+bool Cancellation::Requested()
+{
+    return threadCheck != NULL && threadCheck(threadData);
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,78 @@
+#ifndef ZFECFS_CANCELLATION_H
+#define ZFECFS_CANCELLATION_H
+
+#include <pthread.h>
+
+#include <boost/utility.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+/// Thrown by Cancellation::ThrowIfRequested.
+class Cancelled : public SimpleException {
+public:
+    Cancelled() : SimpleException("Request was interrupted.")
+    {}
+};
+
+/// Tells the code serving a fuse request whether the request was
+/// interrupted (the reading process was killed or gave up), so that it can
+/// stop reading and encoding data nobody waits for anymore.
+///
+/// The front end sets a check for the request on the thread serving it,
+/// threads working for the request (like the compute pool) take over the
+/// context of the thread they work for.
+class Cancellation
+{
+public:
+    typedef bool (*Check)(void* data);
+
+    class Context {
+    public:
+        Context() : check(NULL), data(NULL) {}
+        Context(Check check, void* data) : check(check), data(data) {}
+        Check check;
+        void* data;
+    };
+
+    /// Sets the context of the calling thread while it exists.
+    class Scope : boost::noncopyable {
+    public:
+        explicit Scope(const Context& context);
+        ~Scope();
+    private:
+        const Context previous;
+    };
+
+    /// Context for a check that may only be called on the thread serving
+    /// the request, like fuse_interrupted of the high-level fuse API, which
+    /// crashes on threads outside fuse. Other threads working for the
+    /// request get the result of the last check on that thread.
+    class ThreadCheck : boost::noncopyable {
+    public:
+        /// check returns nonzero if the request of the calling thread was
+        /// interrupted.
+        explicit ThreadCheck(int (*check)());
+        Context GetContext() { return Context(Check, this); }
+    private:
+        static bool Check(void* data);
+
+        int (*const check)();
+        const pthread_t owner;
+        volatile bool requested;
+    };
+
+    static Context Current();
+    static bool Requested();
+    /// @throws Cancelled if the request of the calling thread was interrupted
+    static void ThrowIfRequested()
+    {
+        if (Requested())
+            throw Cancelled();
+    }
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_CANCELLATION_H
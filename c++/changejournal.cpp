@@ -0,0 +1,149 @@
+#include "changejournal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <set>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+const char* const ChangeJournal::cursorFileName = ".zfecfs-journal";
+const char* const ChangeJournal::changesFilePrefix = ".zfecfs-changes-";
+
+ChangeJournal::ChangeJournal(const std::string& path)
+    : path(path)
+    , incomplete(false)
+    , records(0)
+    , size(0)
+{
+    handle = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (handle == -1)
+        throw SimpleException("Unable to open change journal.");
+
+    // count the records of earlier runs
+    char buffer[1 << 16];
+    char last = '\n';
+    checkpoints.push_back(0);
+    while (true) {
+        const ssize_t sizeRead = pread(handle, buffer, sizeof(buffer), size);
+        if (sizeRead == -1) {
+            close(handle);
+            throw SimpleException("Unable to read change journal.");
+        }
+        if (sizeRead == 0)
+            break;
+        for (ssize_t i = 0; i < sizeRead; ++i) {
+            if (buffer[i] == '\n' && ++records % checkpointInterval == 0)
+                checkpoints.push_back(size + i + 1);
+        }
+        size += sizeRead;
+        last = buffer[sizeRead - 1];
+    }
+    // a record cut short by a crash still counts, terminate it
+    if (last != '\n')
+        Record("");
+}
+
+ChangeJournal::~ChangeJournal()
+{
+    close(handle);
+}
+
+void ChangeJournal::Record(const std::string& changedPath)
+{
+    const std::string line = LineEscape::Escape(changedPath) + "\n";
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (write(handle, line.data(), line.size()) != ssize_t(line.size())) {
+        // disk full, drop the partial record so that line numbers stay right
+        if (ftruncate(handle, size) == -1)
+            throw SimpleException("Unable to write change journal.");
+        return;
+    }
+    size += line.size();
+    if (++records % checkpointInterval == 0)
+        checkpoints.push_back(size);
+}
+
+uint64_t ChangeJournal::Cursor() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return records;
+}
+
+void ChangeJournal::MarkIncomplete()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (incomplete)
+            return;
+        incomplete = true;
+    }
+    Record("");
+}
+
+bool ChangeJournal::Changes(uint64_t cursor, std::string& listing) const
+{
+    off_t offset;
+    off_t end;
+    uint64_t skip;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (cursor > records)
+            return false;
+        if (incomplete) {
+            listing = ".\n";
+            return true;
+        }
+        offset = checkpoints[cursor / checkpointInterval];
+        skip = cursor % checkpointInterval;
+        end = size;
+    }
+
+    std::set<std::string> changed;
+    std::string data(end - offset, 0);
+    off_t sizeRead = 0;
+    while (sizeRead < off_t(data.size())) {
+        const ssize_t result = pread(handle, &data[sizeRead], data.size() - sizeRead, offset + sizeRead);
+        if (result <= 0)
+            throw SimpleException("Unable to read change journal.");
+        sizeRead += result;
+    }
+
+    std::string::size_type lineStart = 0;
+    while (lineStart < data.size()) {
+        const std::string::size_type lineEnd = data.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+            break;
+        if (skip > 0) {
+            --skip;
+        } else {
+            std::string changedPath;
+            try {
+                changedPath = LineEscape::Unescape(data.substr(lineStart, lineEnd - lineStart));
+            } catch (const std::exception& exc) {
+                // cut short by a crash, consider everything changed
+            }
+            // --files-from cannot express names with newlines, use their parent
+            std::string::size_type newline;
+            while ((newline = changedPath.find('\n')) != std::string::npos)
+                changedPath.erase(changedPath.rfind('/', newline));
+            changed.insert(changedPath.size() <= 1 ? "." : changedPath.substr(1));
+        }
+        lineStart = lineEnd + 1;
+    }
+
+    listing.clear();
+    BOOST_FOREACH(const std::string& changedPath, changed)
+        listing.append(changedPath).append("\n");
+    return true;
+}
+
+} // namespace ZFecFS
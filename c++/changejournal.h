@@ -0,0 +1,65 @@
+#ifndef ZFECFS_CHANGEJOURNAL_H
+#define ZFECFS_CHANGEJOURNAL_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Persistent log of the paths changed in the source of the encoder.
+///
+/// Every record gets the next sequence number, a cursor is the sequence
+/// number of the last record a reader has seen. The log is a text file with
+/// one (escaped) path per line, so the sequence number of a record is its
+/// line number. An empty path means that changes were lost (the journal was
+/// not running or the watcher missed events) and everything has to be
+/// considered changed.
+class ChangeJournal : boost::noncopyable
+{
+public:
+    /// Name of the virtual file in each share that contains the current cursor.
+    static const char* const cursorFileName;
+    /// Prefix of the virtual files that list the changes since the cursor
+    /// following the prefix.
+    static const char* const changesFilePrefix;
+
+    explicit ChangeJournal(const std::string& path);
+    ~ChangeJournal();
+
+    const std::string& GetPath() const { return path; }
+
+    /// @param path relative to the source, starting with '/', or empty
+    void Record(const std::string& path);
+    uint64_t Cursor() const;
+    /// Called when changes can be missed from now on (e.g. the watcher
+    /// could not watch all directories), records everything as changed and
+    /// lists everything as changed for any cursor afterwards.
+    void MarkIncomplete();
+
+    /// Returns false if cursor lies in the future. Otherwise fills listing
+    /// with the paths changed after cursor, relative to the source and
+    /// sorted, one per line, as understood by rsync --files-from.
+    bool Changes(uint64_t cursor, std::string& listing) const;
+
+private:
+    const static uint64_t checkpointInterval = 4096;
+
+    const std::string path;
+    int handle;
+
+    mutable boost::mutex mutex;
+    bool incomplete;
+    uint64_t records;
+    off_t size;
+    std::vector<off_t> checkpoints; // offset of record i * checkpointInterval + 1
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_CHANGEJOURNAL_H
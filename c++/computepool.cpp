@@ -0,0 +1,183 @@
+#include "computepool.h"
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+ComputePool::ComputePool(unsigned int numThreads)
+    : pending(0)
+    , nextQueue(0)
+    , stopping(false)
+{
+    if (numThreads < 2)
+        return;
+    for (unsigned int i = 0; i < numThreads; ++i)
+        queues.push_back(new Queue());
+}
+
+ComputePool::~ComputePool()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+        available.notify_all();
+    }
+    threads.join_all();
+}
+
+void ComputePool::Start()
+{
+    for (size_t i = 0; i < queues.size(); ++i)
+        threads.create_thread(boost::bind(&ComputePool::Work, this, i));
+}
+
+void ComputePool::Run(const std::vector<Task>& tasks)
+{
+    Batch batch(tasks.size());
+    if (!Enabled()) {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            Cancellation::ThrowIfRequested();
+            tasks[i]();
+        }
+        return;
+    }
+    // on the calling thread first, checks that only work there tell the
+    // pool threads what they found
+    Cancellation::ThrowIfRequested();
+    batch.cancellation = Cancellation::Current();
+
+    size_t first;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        first = nextQueue;
+        nextQueue = (nextQueue + tasks.size()) % queues.size();
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        Job job;
+        job.task = tasks[i];
+        job.batch = &batch;
+        Queue& queue = queues[(first + i) % queues.size()];
+        boost::lock_guard<boost::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pending += tasks.size();
+        available.notify_all();
+    }
+
+    // help instead of only waiting, stealing from the queue we started with
+    Job job;
+    while (Take(first, job))
+        Execute(job);
+
+    boost::unique_lock<boost::mutex> lock(batch.mutex);
+    while (batch.remaining > 0)
+        batch.done.wait(lock);
+    if (batch.cancelled)
+        throw Cancelled();
+    if (batch.failed)
+        throw SimpleException("Parallel task failed.");
+}
+
+int ComputePool::Read(char* outBuffer, size_t size, off_t offset, size_t pieceSize, const Reader& read)
+{
+    const off_t firstPiece = offset / pieceSize;
+    const off_t lastPiece = size == 0 ? firstPiece : (offset + size - 1) / pieceSize;
+    if (!Enabled() || firstPiece == lastPiece)
+        return read(outBuffer, size, offset);
+
+    std::vector<Task> tasks;
+    std::vector<size_t> sizes;
+    std::vector<int> results(lastPiece - firstPiece + 1);
+    for (off_t piece = firstPiece; piece <= lastPiece; ++piece) {
+        const off_t start = std::max<off_t>(offset, piece * pieceSize);
+        const off_t end = std::min<off_t>(offset + size, (piece + 1) * pieceSize);
+        sizes.push_back(end - start);
+        tasks.push_back(boost::bind(&ComputePool::ReadPiece, boost::cref(read), outBuffer + (start - offset),
+                                    sizes.back(), start, &results[piece - firstPiece]));
+    }
+    Run(tasks);
+
+    // the read ends at the first short piece
+    size_t sizeRead = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i] < 0)
+            return sizeRead > 0 ? int(sizeRead) : results[i];
+        sizeRead += results[i];
+        if (size_t(results[i]) < sizes[i])
+            break;
+    }
+    return sizeRead;
+}
+
+bool ComputePool::Take(size_t queue, Job& job)
+{
+    for (size_t i = 0; i < queues.size(); ++i) {
+        Queue& victim = queues[(queue + i) % queues.size()];
+        {
+            boost::lock_guard<boost::mutex> lock(victim.mutex);
+            if (victim.jobs.empty())
+                continue;
+            if (i == 0) {
+                job = victim.jobs.back();
+                victim.jobs.pop_back();
+            } else {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+            }
+        }
+        boost::lock_guard<boost::mutex> lock(mutex);
+        --pending;
+        return true;
+    }
+    return false;
+}
+
+void ComputePool::Execute(const Job& job)
+{
+    Batch& batch = *job.batch;
+    bool failed = false;
+    bool cancelled = false;
+    try {
+        Cancellation::Scope scope(batch.cancellation);
+        Cancellation::ThrowIfRequested();
+        job.task();
+    } catch (const Cancelled&) {
+        cancelled = true;
+    } catch (...) {
+        failed = true;
+    }
+    boost::lock_guard<boost::mutex> lock(batch.mutex);
+    batch.failed = batch.failed || failed;
+    batch.cancelled = batch.cancelled || cancelled;
+    if (--batch.remaining == 0)
+        batch.done.notify_all();
+}
+
+void ComputePool::Work(size_t queue)
+{
+    for (;;) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (pending == 0 && !stopping)
+                available.wait(lock);
+            if (pending == 0)
+                return;
+        }
+        Job job;
+        if (Take(queue, job))
+            Execute(job);
+    }
+}
+
+void ComputePool::ReadPiece(const Reader& read, char* outBuffer, size_t size, off_t offset, int* result)
+{
+    *result = read(outBuffer, size, offset);
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,98 @@
+#ifndef ZFECFS_COMPUTEPOOL_H
+#define ZFECFS_COMPUTEPOOL_H
+
+#include <sys/types.h>
+
+#include <vector>
+#include <deque>
+
+#include <boost/function.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+#include "cancellation.h"
+
+namespace ZFecFS {
+
+/// Threads that large reads are split across, so that a single read does
+/// not encode or decode on one core only.
+///
+/// Every thread has its own queue, which it works on from the back while
+/// idle threads steal from the front of the other queues. The thread that
+/// submits tasks works on them as well until they are done.
+class ComputePool : boost::noncopyable
+{
+public:
+    typedef boost::function<void ()> Task;
+    /// Has the semantics of pread, but returns a negative errno on errors.
+    typedef boost::function<int (char*, size_t, off_t)> Reader;
+
+    /// No threads are used for numThreads < 2, tasks then run inline.
+    explicit ComputePool(unsigned int numThreads);
+    ~ComputePool();
+
+    bool Enabled() const { return !queues.empty(); }
+
+    /// Starts the threads. Before, the threads submitting tasks run them
+    /// all themselves.
+    void Start();
+
+    /// Runs all tasks, in the cancellation context of the calling thread,
+    /// and returns when they are done. Tasks that did not start before the
+    /// request was interrupted are skipped.
+    /// @throws Cancelled if the request of the calling thread was interrupted
+    /// @throws SimpleException if one of the tasks threw
+    void Run(const std::vector<Task>& tasks);
+
+    /// Reads like read would, but reads that span more than one piece of
+    /// pieceSize (aligned to multiples of pieceSize) are read piece by
+    /// piece in parallel.
+    int Read(char* outBuffer, size_t size, off_t offset, size_t pieceSize, const Reader& read);
+
+private:
+    class Batch {
+    public:
+        explicit Batch(size_t remaining) : remaining(remaining), failed(false), cancelled(false) {}
+        boost::mutex mutex;
+        boost::condition_variable done;
+        size_t remaining;
+        bool failed;
+        bool cancelled;
+        Cancellation::Context cancellation;
+    };
+
+    class Job {
+    public:
+        Task task;
+        Batch* batch;
+    };
+
+    class Queue {
+    public:
+        boost::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    /// Takes a job from the back of the queue or steals one from the front
+    /// of any other queue.
+    bool Take(size_t queue, Job& job);
+    void Execute(const Job& job);
+    void Work(size_t queue);
+    static void ReadPiece(const Reader& read, char* outBuffer, size_t size, off_t offset, int* result);
+
+    boost::ptr_vector<Queue> queues;
+
+    boost::mutex mutex;
+    boost::condition_variable available;
+    size_t pending; // jobs in all queues
+    size_t nextQueue;
+    bool stopping;
+    boost::thread_group threads;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_COMPUTEPOOL_H
@@ -0,0 +1,57 @@
+#ifndef ZFECFS_DEFERREDFILE_H
+#define ZFECFS_DEFERREDFILE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// A file that is only opened when it is used for the first time, for
+/// spare shares that are usually never read.
+class DeferredFile : public AbstractFile, boost::noncopyable
+{
+public:
+    typedef boost::function<boost::shared_ptr<AbstractFile> ()> Open;
+
+    explicit DeferredFile(const Open& open)
+        : open(open)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        return Opened().Read(buffer, size, offset);
+    }
+    virtual off_t Size() const { return Opened().Size(); }
+    virtual bool Stat(struct stat& statBuf) const { return Opened().Stat(statBuf); }
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const
+    {
+        return Opened().View(size, offset);
+    }
+    virtual off_t NextData(off_t offset) const { return Opened().NextData(offset); }
+
+private:
+    /// @throws SimpleException if the file cannot be opened
+    const AbstractFile& Opened() const
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (!file)
+            file = open();
+        return *file;
+    }
+
+    const Open open;
+    mutable boost::mutex mutex;
+    mutable boost::shared_ptr<AbstractFile> file;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_DEFERREDFILE_H
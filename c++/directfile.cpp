@@ -0,0 +1,118 @@
+#include "directfile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <boost/make_shared.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+class DirectFile::AlignedView : public FileView
+{
+public:
+    AlignedView(char* buffer, size_t offset, size_t size)
+        : FileView(buffer + offset, size)
+        , buffer(buffer)
+    {}
+
+    ~AlignedView()
+    {
+        free(buffer);
+    }
+
+private:
+    char* const buffer;
+};
+
+DirectFile::DirectFile(const std::string& path)
+{
+    handle = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (handle == -1 && errno == EINVAL)
+        handle = open(path.c_str(), O_RDONLY);
+    if (handle == -1)
+        throw SimpleException("Error opening file.");
+}
+
+DirectFile::~DirectFile()
+{
+    close(handle);
+}
+
+ssize_t DirectFile::Read(char* buffer, size_t size, off_t offset) const
+{
+    if (reinterpret_cast<uintptr_t>(buffer) % alignment == 0
+            && size % alignment == 0 && offset % alignment == 0)
+        return ReadFully(buffer, size, offset);
+
+    boost::shared_ptr<const FileView> view = View(size, offset);
+    memcpy(buffer, view->Data(), view->Size());
+    return view->Size();
+}
+
+off_t DirectFile::Size() const
+{
+    off_t size = lseek(handle, 0, SEEK_END);
+    if (size == off_t(-1))
+        throw SimpleException("File size could not be determined.");
+    return size;
+}
+
+bool DirectFile::Stat(struct stat& statBuf) const
+{
+    if (fstat(handle, &statBuf) == -1)
+        throw SimpleException("Error reading file status.");
+    return true;
+}
+
+off_t DirectFile::NextData(off_t offset) const
+{
+    return SeekData(handle, offset);
+}
+
+boost::shared_ptr<const FileView> DirectFile::View(size_t size, off_t offset) const
+{
+    const off_t alignedOffset = offset - offset % alignment;
+    const size_t alignedSize = (offset - alignedOffset + size + alignment - 1) / alignment * alignment;
+
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, alignment, alignedSize) != 0)
+        throw SimpleException("Out of memory.");
+    boost::shared_ptr<AlignedView> view;
+    try {
+        const size_t sizeRead = ReadFully(static_cast<char*>(buffer), alignedSize, alignedOffset);
+        const size_t skipped = offset - alignedOffset;
+        view = boost::make_shared<AlignedView>(static_cast<char*>(buffer), skipped,
+                                               sizeRead > skipped ? std::min(size, sizeRead - skipped) : 0);
+    } catch (...) {
+        free(buffer);
+        throw;
+    }
+    return view;
+}
+
+size_t DirectFile::ReadFully(char* buffer, size_t size, off_t offset) const
+{
+    size_t sizeRead = 0;
+    while (sizeRead < size) {
+        const ssize_t result = pread(handle, buffer + sizeRead, size - sizeRead, offset + sizeRead);
+        if (result == -1)
+            throw SimpleException("Error reading file.");
+        if (result == 0)
+            break;
+        sizeRead += result;
+        // O_DIRECT reads only end short at the end of the file
+        if (sizeRead % alignment != 0)
+            break;
+    }
+    return sizeRead;
+}
+
+} // namespace ZFecFS
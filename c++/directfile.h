@@ -0,0 +1,45 @@
+#ifndef ZFECFS_DIRECTFILE_H
+#define ZFECFS_DIRECTFILE_H
+
+#include <sys/types.h>
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// File that is read with O_DIRECT, bypassing the page cache.
+///
+/// Reads are widened to the alignment O_DIRECT requires and go to aligned
+/// buffers; views point into these buffers, so data read through View is
+/// not copied again. Falls back to normal reads if the filesystem does not
+/// support O_DIRECT.
+class DirectFile : public AbstractFile, boost::noncopyable
+{
+public:
+    explicit DirectFile(const std::string& path);
+    ~DirectFile();
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const;
+    virtual off_t Size() const;
+    virtual bool Stat(struct stat& statBuf) const;
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const;
+    virtual off_t NextData(off_t offset) const;
+
+private:
+    class AlignedView;
+
+    /// Reads until size bytes are read or the end of the file is reached.
+    size_t ReadFully(char* buffer, size_t size, off_t offset) const;
+
+    const static size_t alignment = 4096;
+
+    int handle;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_DIRECTFILE_H
@@ -0,0 +1,41 @@
+#include "directorysnapshot.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+namespace {
+
+/// Record returned by getdents64, not declared by the C library.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+} // anonymous namespace
+
+void DirectorySnapshot::AddAll(int directoryHandle)
+{
+    std::vector<char> buffer(readBatchSize);
+    while (true) {
+        const long sizeRead = syscall(SYS_getdents64, directoryHandle, &buffer[0], buffer.size());
+        if (sizeRead == -1)
+            throw SimpleException("Error reading directory.");
+        if (sizeRead == 0)
+            break;
+        for (long position = 0; position < sizeRead;) {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(&buffer[position]);
+            Add(entry->d_name, entry->d_ino, entry->d_type);
+            position += entry->d_reclen;
+        }
+    }
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,91 @@
+#ifndef ZFECFS_DIRECTORYSNAPSHOT_H
+#define ZFECFS_DIRECTORYSNAPSHOT_H
+
+#include <sys/types.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Listing of a directory taken when it is opened, so that it can be
+/// returned in several readdir calls that continue at a given offset.
+///
+/// All names are stored in a single string to keep large directories
+/// compact.
+class DirectorySnapshot : boost::noncopyable
+{
+public:
+    void Add(const char* name, ino_t inode, unsigned char type)
+    {
+        Entry entry;
+        entry.nameOffset = names.size();
+        entry.inode = inode;
+        entry.type = type;
+        entries.push_back(entry);
+        names.append(name, strlen(name) + 1);
+    }
+
+    /// Adds all entries of the open directory, reading them in large
+    /// getdents64 batches.
+    /// @throws SimpleException if the directory cannot be read
+    void AddAll(int directoryHandle);
+
+    /// Sorts the entries by name and removes all but the first entry added
+    /// under each name.
+    void RemoveDuplicates()
+    {
+        const NameLess less(names.data());
+        std::stable_sort(entries.begin(), entries.end(), less);
+        entries.erase(std::unique(entries.begin(), entries.end(), NameEqual(names.data())),
+                      entries.end());
+    }
+
+    size_t Size() const { return entries.size(); }
+    const char* Name(size_t i) const { return names.data() + entries[i].nameOffset; }
+    ino_t Inode(size_t i) const { return entries[i].inode; }
+    unsigned char Type(size_t i) const { return entries[i].type; }
+
+private:
+    class Entry {
+    public:
+        size_t nameOffset;
+        ino_t inode;
+        unsigned char type;
+    };
+
+    class NameLess {
+    public:
+        explicit NameLess(const char* names) : names(names) {}
+        bool operator()(const Entry& a, const Entry& b) const
+        {
+            return strcmp(names + a.nameOffset, names + b.nameOffset) < 0;
+        }
+    private:
+        const char* names;
+    };
+
+    class NameEqual {
+    public:
+        explicit NameEqual(const char* names) : names(names) {}
+        bool operator()(const Entry& a, const Entry& b) const
+        {
+            return strcmp(names + a.nameOffset, names + b.nameOffset) == 0;
+        }
+    private:
+        const char* names;
+    };
+
+    const static size_t readBatchSize = 1 << 16;
+
+    std::string names; // null-terminated names of all entries
+    std::vector<Entry> entries;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_DIRECTORYSNAPSHOT_H
@@ -505,10 +505,15 @@ build_decode_matrix_into_space(const fec_t*const code, const unsigned*const inde
 void
 fec_decode(const fec_t* code, const gf*const*const inpkts, gf*const*const outpkts, const unsigned*const index, size_t sz) {
     gf* m_dec = (gf*)alloca(code->k * code->k);
+    build_decode_matrix_into_space(code, index, code->k, m_dec);
+    fec_decode_with_matrix(code, m_dec, inpkts, outpkts, index, sz);
+}
+
+void
+fec_decode_with_matrix(const fec_t* code, const gf*const m_dec, const gf*const*const inpkts, gf*const*const outpkts, const unsigned*const index, size_t sz) {
     unsigned char outix=0;
     unsigned char row=0;
     unsigned char col=0;
-    build_decode_matrix_into_space(code, index, code->k, m_dec);
 
     for (row=0; row<code->k; row++) {
         assert ((index[row] >= code->k) || (index[row] == row)); /* If the block whose number is i is present, then it is required to be in the i'th element. */
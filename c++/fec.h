@@ -44,6 +44,20 @@ void fec_encode(const fec_t* code, const gf*const*const src, gf*const*const fecs
  */
 void fec_decode(const fec_t* code, const gf*const*const inpkts, gf*const*const outpkts, const unsigned*const index, size_t sz);
 
+/**
+ * Build decode matrix into some memory space.
+ *
+ * @param matrix a space allocated for a k by k matrix
+ */
+void build_decode_matrix_into_space(const fec_t*const code, const unsigned*const index, const unsigned k, gf*const matrix);
+
+/**
+ * Same as fec_decode(), but uses a decode matrix that was built for index by build_decode_matrix_into_space().
+ *
+ * @param matrix the k by k decode matrix
+ */
+void fec_decode_with_matrix(const fec_t* code, const gf*const matrix, const gf*const*const inpkts, gf*const*const outpkts, const unsigned*const index, size_t sz);
+
 #if defined(_MSC_VER)
 #define alloca _alloca
 #else
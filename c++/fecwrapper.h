@@ -39,6 +39,17 @@ public:
                    length);
     }
 
+    //! Encodes the count shares in indices from the same input in one pass.
+    void Encode(char*const* outBuffers, char** fecInput, const unsigned int* indices, unsigned int count,
+                unsigned int length) const
+    {
+        fec_encode(fecData,
+                   reinterpret_cast<gf* const*>(fecInput),
+                   reinterpret_cast<gf* const*>(outBuffers),
+                   indices, count,
+                   length);
+    }
+
     //! @note that indices[i] == i must hold whenever indices[i] < required
     void Decode(char*const* fecOutput, const char** fecInput, unsigned int* indices, unsigned int length) const
     {
@@ -48,6 +59,23 @@ public:
                    indices,
                    length);
     }
+
+    //! Builds the matrix to pass to Decode for the given indices (same restrictions apply).
+    void BuildDecodeMatrix(const unsigned int* indices, std::vector<unsigned char>& matrix) const
+    {
+        matrix.resize(sharesRequired * sharesRequired);
+        build_decode_matrix_into_space(fecData, indices, sharesRequired, matrix.data());
+    }
+
+    void Decode(char*const* fecOutput, const char** fecInput, const unsigned int* indices,
+                const std::vector<unsigned char>& matrix, unsigned int length) const
+    {
+        fec_decode_with_matrix(fecData, matrix.data(),
+                               reinterpret_cast<const gf* const*>(fecInput),
+                               reinterpret_cast<gf* const*>(fecOutput),
+                               indices,
+                               length);
+    }
 };
 
 }
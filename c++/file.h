@@ -6,23 +6,74 @@
 #include <sys/fcntl.h>
 #include <unistd.h>
 
+#include <string.h>
+#include <errno.h>
+
 #include <string>
+#include <algorithm>
 
 #include <boost/utility.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include "utils.h"
 
 namespace ZFecFS {
 
+/// Part of a file that can be read directly from memory.
+class FileView : boost::noncopyable
+{
+public:
+    FileView(const char* data, size_t size)
+        : data(data)
+        , size(size)
+    {}
+    virtual ~FileView() {}
+
+    const char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+    /// Returns false if the file shrank while the view was in use, in which
+    /// case the data read through it must not be trusted.
+    virtual bool Intact() const { return true; }
+
+private:
+    const char* const data;
+    const size_t size;
+};
+
 class AbstractFile
 {
 public:
     virtual ~AbstractFile() {}
     virtual ssize_t Read(char* buffer, size_t size, off_t offset) const = 0;
     virtual off_t Size() const = 0;
+    /// Fills statBuf and returns true if the file is backed by the filesystem.
+    virtual bool Stat(struct stat& /*statBuf*/) const { return false; }
+    /// Returns a view of at most size bytes at offset, which can be shorter
+    /// than requested even before the end of the file. Returns an empty
+    /// pointer if the file cannot be viewed, use Read in that case.
+    virtual boost::shared_ptr<const FileView> View(size_t /*size*/, off_t /*offset*/) const
+    {
+        return boost::shared_ptr<const FileView>();
+    }
+    /// Returns the offset of the first byte at or after offset that is not
+    /// in a hole of the file, offset if the file cannot tell.
+    virtual off_t NextData(off_t offset) const { return offset; }
 };
 
+/// NextData for a file descriptor, with SEEK_DATA where the filesystem supports it.
+inline off_t SeekData(int handle, off_t offset)
+{
+    const off_t data = lseek(handle, offset, SEEK_DATA);
+    if (data != off_t(-1))
+        return data;
+    struct stat statBuf;
+    if (errno == ENXIO && fstat(handle, &statBuf) == 0)
+        return std::max(offset, statBuf.st_size); // only a hole up to the end
+    return offset;
+}
+
 class File : public AbstractFile, boost::noncopyable
 {
 public:
@@ -53,10 +104,61 @@ public:
             throw SimpleException("File size could not be determined.");
         return size;
     }
+
+    virtual bool Stat(struct stat& statBuf) const
+    {
+        if (fstat(handle, &statBuf) == -1)
+            throw SimpleException("Error reading file status.");
+        return true;
+    }
+
+    virtual off_t NextData(off_t offset) const
+    {
+        return SeekData(handle, offset);
+    }
+
+    int GetHandle() const
+    {
+        return handle;
+    }
 private:
     int handle;
 };
 
+/// File whose contents are generated and kept in memory.
+class MemoryFile : public AbstractFile, boost::noncopyable
+{
+public:
+    explicit MemoryFile(const std::string& contents)
+        : contents(contents)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        if (offset >= off_t(contents.size()))
+            return 0;
+        const size_t sizeRead = std::min(size, size_t(contents.size() - offset));
+        memcpy(buffer, contents.data() + offset, sizeRead);
+        return sizeRead;
+    }
+
+    virtual off_t Size() const
+    {
+        return contents.size();
+    }
+
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const
+    {
+        if (offset >= off_t(contents.size()))
+            return boost::make_shared<FileView>(contents.data(), 0);
+        return boost::make_shared<FileView>(contents.data() + offset,
+                                            std::min(size, size_t(contents.size() - offset)));
+    }
+
+private:
+    const std::string contents;
+};
+
 } // namespace ZFecFS
 
 #endif // FILE_H
@@ -4,11 +4,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include <boost/make_shared.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/lock_guard.hpp>
 
 #include "utils.h"
 #include "unistd.h"
 
 #include "metadata.h"
+#include "cancellation.h"
 
 
 namespace ZFecFS {
@@ -51,49 +60,351 @@ FileDecoder* FileDecoder::Open(const std::vector<boost::shared_ptr<AbstractFile>
     return new FileDecoder(encodedFiles, fileIndices, firstMeta, encodedSize, fecWrapper);
 }
 
+void FileDecoder::UseSpares(const std::vector<boost::shared_ptr<AbstractFile> >& files)
+{
+    boost::lock_guard<boost::mutex> lock(selectionMutex);
+    for (size_t i = 0; i < files.size(); ++i)
+        spares.push_back(Spare(files[i]));
+}
+
+void FileDecoder::UseBlockCache(BlockCache& cache)
+{
+    BlockCache::ShareSet shareSet;
+    if (cache.Enabled() && BlockCache::ShareSet::Identify(CurrentSelection()->files, shareSet))
+        blockCache = &cache;
+}
+
+FileDecoder::SelectionPtr FileDecoder::CurrentSelection() const
+{
+    boost::lock_guard<boost::mutex> lock(selectionMutex);
+    return selection;
+}
+
+std::vector<FileDecoder::Spare> FileDecoder::Spares(const Selection& current, size_t count)
+{
+    std::vector<Spare> found;
+    boost::lock_guard<boost::mutex> lock(selectionMutex);
+    for (size_t i = 0; i < spares.size() && found.size() < count;) {
+        if (!CheckSpare(i))
+            continue;
+        if (std::find(current.fileIndices.begin(), current.fileIndices.end(), spares[i].index)
+                == current.fileIndices.end())
+            found.push_back(spares[i]);
+        ++i;
+    }
+    return found;
+}
+
+bool FileDecoder::Failover(const boost::shared_ptr<AbstractFile>& failed)
+{
+    boost::lock_guard<boost::mutex> lock(selectionMutex);
+    const std::vector<boost::shared_ptr<AbstractFile> >& files = selection->files;
+    const size_t share = std::find(files.begin(), files.end(), failed) - files.begin();
+    if (share == files.size())
+        return true; // replaced by another read already
+
+    for (size_t i = 0; i < spares.size();) {
+        if (!CheckSpare(i))
+            continue;
+        if (std::find(selection->fileIndices.begin(), selection->fileIndices.end(), spares[i].index)
+                != selection->fileIndices.end()) {
+            ++i;
+            continue;
+        }
+        // the failed share is dropped for good
+        Selection* replaced = new Selection(*selection);
+        replaced->files[share] = spares[i].file;
+        replaced->fileIndices[share] = spares[i].index;
+        PrepareDecoding(*replaced);
+        selection.reset(replaced);
+        spares.erase(spares.begin() + i);
+        return true;
+    }
+    return false;
+}
+
+bool FileDecoder::CheckSpare(size_t i)
+{
+    Spare& spare = spares[i];
+    if (spare.checked)
+        return true;
+    try {
+        const Metadata meta = ReadMetadata(*spare.file);
+        if (meta.required == metadata.required && meta.excessBytes == metadata.excessBytes
+                && spare.file->Size() == off_t(encodedFileSize)) {
+            spare.index = meta.index;
+            spare.checked = true;
+            return true;
+        }
+    } catch (const std::exception& exc) {
+        // a broken spare is no spare
+    }
+    spares.erase(spares.begin() + i);
+    return false;
+}
+
+int FileDecoder::ExpectedBytes(int bytesToRead, off_t shareOffset) const
+{
+    return std::max<off_t>(0, std::min<off_t>(bytesToRead, off_t(encodedFileSize) - shareOffset));
+}
+
+int FileDecoder::ReadShare(const AbstractFile& file, char* buffer, size_t size, off_t offset)
+{
+    try {
+        return file.Read(buffer, size, offset);
+    } catch (const Cancelled&) {
+        throw;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
 int FileDecoder::Read(char *outBuffer, size_t size, off_t offset)
 {
+    if (blockCache == NULL)
+        return ReadCoalesced(outBuffer, size, offset);
+    else
+        return ReadCached(outBuffer, size, offset);
+}
+
+int FileDecoder::ReadCoalesced(char* outBuffer, size_t size, off_t offset)
+{
+    return coalescer.Read(outBuffer, size, offset,
+                          boost::bind(&FileDecoder::ReadParallel, this, boost::placeholders::_1,
+                                      boost::placeholders::_2, boost::placeholders::_3));
+}
+
+int FileDecoder::ReadCached(char* outBuffer, size_t size, off_t offset)
+{
+    const off_t fileSize = Size();
+    if (offset >= fileSize || size == 0)
+        return 0;
+
+    // shares that were modified in place since the last read have a new
+    // version, replaced shares (after a failover) a new identity
+    BlockCache::ShareSet shareSet;
+    if (!BlockCache::ShareSet::Identify(CurrentSelection()->files, shareSet))
+        return ReadCoalesced(outBuffer, size, offset);
+
+    // decode the missing blocks first, in parallel if there is a pool
+    const off_t blockSize = cacheBlockShareSize * fecWrapper.GetSharesRequired();
+    const off_t firstBlock = offset / blockSize;
+    const off_t lastBlock = (std::min<off_t>(offset + size, fileSize) - 1) / blockSize;
+    std::vector<BlockCache::Block> blocks(lastBlock - firstBlock + 1);
+    std::vector<ComputePool::Task> decodes;
+    for (off_t blockIndex = firstBlock; blockIndex <= lastBlock; ++blockIndex) {
+        BlockCache::Block& block = blocks[blockIndex - firstBlock];
+        block = blockCache->Lookup(shareSet, blockIndex);
+        if (!block)
+            decodes.push_back(boost::bind(&FileDecoder::DecodeBlock, this, blockIndex, &shareSet, &block));
+    }
+    if (computePool != NULL) {
+        computePool->Run(decodes);
+    } else {
+        for (size_t i = 0; i < decodes.size(); ++i)
+            decodes[i]();
+    }
+
+    size_t sizeRead = 0;
+    for (size_t i = 0; i < blocks.size() && sizeRead < size; ++i) {
+        const BlockCache::Block& block = blocks[i];
+        if (!block)
+            return sizeRead > 0 ? int(sizeRead) : -EIO;
+        const off_t position = offset + sizeRead;
+        const size_t offsetInBlock = position - (firstBlock + off_t(i)) * blockSize;
+        if (offsetInBlock >= block->size())
+            break;
+        const size_t sizeToCopy = std::min(size - sizeRead, block->size() - offsetInBlock);
+        memcpy(outBuffer + sizeRead, block->data() + offsetInBlock, sizeToCopy);
+        sizeRead += sizeToCopy;
+        if (off_t(block->size()) < blockSize)
+            break;
+    }
+    return sizeRead;
+}
+
+void FileDecoder::DecodeBlock(off_t blockIndex, const BlockCache::ShareSet* shareSet,
+                              BlockCache::Block* block)
+{
+    const off_t blockSize = cacheBlockShareSize * fecWrapper.GetSharesRequired();
+    const off_t blockStart = blockIndex * blockSize;
+    boost::shared_ptr<std::vector<char> > decoded
+            = boost::make_shared<std::vector<char> >(blockSize);
+    // concurrent misses of the same block only decode it once
+    const int decodedSize = coalescer.Read(decoded->data(), blockSize, blockStart,
+                                           boost::bind(&FileDecoder::ReadUncached, this,
+                                                       boost::placeholders::_1,
+                                                       boost::placeholders::_2,
+                                                       boost::placeholders::_3));
+    if (decodedSize < 0)
+        return;
+    decoded->resize(decodedSize);
+    // do not cache blocks that are short because of a truncated share
+    if (decodedSize == std::min(blockSize, Size() - blockStart))
+        blockCache->Insert(*shareSet, blockIndex, decoded);
+    *block = decoded;
+}
+
+int FileDecoder::ReadParallel(char* outBuffer, size_t size, off_t offset)
+{
+    if (computePool == NULL)
+        return ReadUncached(outBuffer, size, offset);
+    return computePool->Read(outBuffer, size, offset,
+                             parallelShareSize * fecWrapper.GetSharesRequired(),
+                             boost::bind(&FileDecoder::ReadUncached, this, boost::placeholders::_1,
+                                         boost::placeholders::_2, boost::placeholders::_3));
+}
+
+int FileDecoder::ReadUncached(char *outBuffer, size_t size, off_t offset)
+{
+    int sizeRead = Decode(outBuffer, size, offset, true);
+    if (sizeRead == -1) {
+        // a share shrank while it was viewed
+        sizeRead = Decode(outBuffer, size, offset, false);
+    }
+    return sizeRead;
+}
+
+int FileDecoder::Decode(char *outBuffer, size_t size, off_t offset, bool viewShares)
+{
+    if (shareReader != NULL)
+        return DecodeHedged(outBuffer, size, offset);
     if (offset >= Size())
         return 0;
 
+    const SelectionPtr selection = CurrentSelection();
     unsigned int sharesRequired = fecWrapper.GetSharesRequired();
     // read some more in case size is not a multiple of required
     int bytesToRead = (size + sharesRequired - 1) / sharesRequired + 1;
     int minBytesRead = bytesToRead;
+    const off_t shareOffset = offset / sharesRequired + Metadata::size;
+    const int bytesExpected = ExpectedBytes(bytesToRead, shareOffset);
 
     // TODO better to have only one vector? - avoid re-allocating the vectors
     std::vector<std::vector<char> >& readBuffers(threadLocalData.Get().readBuffers);
     readBuffers.resize(sharesRequired);
+    std::vector<boost::shared_ptr<const FileView> > views(sharesRequired);
+    std::vector<const char*> fecInputPtrs(sharesRequired);
     for (unsigned int i = 0; i < sharesRequired; ++i) {
-        readBuffers[i].resize(bytesToRead);
-        int bytesRead = encodedFiles[i]->Read(readBuffers[i].data(), bytesToRead,
-                                             offset / sharesRequired + Metadata::size);
-        minBytesRead = std::min(minBytesRead, bytesRead);
+        Cancellation::ThrowIfRequested();
+        if (viewShares)
+            views[i] = selection->files[i]->View(bytesToRead, shareOffset);
+        if (views[i] && views[i]->Size() == size_t(bytesToRead)) {
+            fecInputPtrs[i] = views[i]->Data();
+        } else {
+            views[i].reset();
+            readBuffers[i].resize(bytesToRead);
+            const int bytesRead = ReadShare(*selection->files[i], readBuffers[i].data(), bytesToRead, shareOffset);
+            // a share that fails or ends early is replaced and the read started over
+            if (bytesRead < bytesExpected && Failover(selection->files[i]))
+                return Decode(outBuffer, size, offset, viewShares);
+            if (bytesRead < 0)
+                throw SimpleException("Error reading share.");
+            minBytesRead = std::min(minBytesRead, bytesRead);
+            fecInputPtrs[i] = readBuffers[i].data();
+        }
     }
     if (minBytesRead == 0)
         return 0;
 
-    std::vector<const char*> fecInputPtrs(sharesRequired);
-    std::vector<unsigned int> fecInputIndices(fileIndices.begin(), fileIndices.end());
+    std::vector<const char*> orderedInputPtrs(sharesRequired);
+    for (unsigned int i = 0; i < sharesRequired; ++i)
+        orderedInputPtrs[i] = fecInputPtrs[selection->shareOrder[i]];
+
+    size = Combine(outBuffer, size, offset, minBytesRead, orderedInputPtrs, selection->decodeIndices,
+                   selection->decodeMatrix);
+    for (unsigned int i = 0; i < sharesRequired; ++i) {
+        if (views[i] && !views[i]->Intact())
+            return -1;
+    }
+    return size;
+}
+
+int FileDecoder::DecodeHedged(char* outBuffer, size_t size, off_t offset)
+{
+    if (offset >= Size())
+        return 0;
+
+    const SelectionPtr selection = CurrentSelection();
+    const unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    const off_t shareOffset = offset / sharesRequired + Metadata::size;
+    // only read what intact shares have, so that short reads count as failed
+    const int bytesToRead = ExpectedBytes((size + sharesRequired - 1) / sharesRequired + 1, shareOffset);
+    if (bytesToRead == 0)
+        return 0;
+
+    // reads[i] reads selection->files[i] for i < sharesRequired and hedges[i - sharesRequired] after that
+    std::vector<ShareReader::RequestPtr> reads;
+    for (unsigned int i = 0; i < sharesRequired; ++i)
+        reads.push_back(shareReader->Start(selection->files[i], bytesToRead, shareOffset));
+    size_t succeeded = shareReader->Wait(reads, sharesRequired, hedgeDelay);
+    std::vector<Spare> hedges;
+    if (succeeded < sharesRequired) {
+        // one spare for each share we are still waiting for
+        hedges = Spares(*selection, sharesRequired - succeeded);
+        for (size_t i = 0; i < hedges.size(); ++i)
+            reads.push_back(shareReader->Start(hedges[i].file, bytesToRead, shareOffset));
+        succeeded = shareReader->Wait(reads, sharesRequired, -1);
+    }
+
+    // later reads do not use the shares that failed
+    bool failedOver = false;
+    for (unsigned int i = 0; i < sharesRequired; ++i) {
+        if (shareReader->Done(reads[i]) && reads[i]->result != bytesToRead)
+            failedOver = Failover(selection->files[i]) || failedOver;
+    }
+    if (succeeded < sharesRequired)
+        return failedOver ? DecodeHedged(outBuffer, size, offset) : -EIO;
+
+    // decode from the first shares that arrived, the others are left to finish on their own
+    std::vector<unsigned int> order;
+    std::vector<unsigned int> indices;
+    for (size_t i = 0; i < reads.size() && order.size() < sharesRequired; ++i) {
+        if (!shareReader->Done(reads[i]) || reads[i]->result != bytesToRead)
+            continue;
+        order.push_back(i);
+        indices.push_back(i < sharesRequired ? selection->fileIndices[i] : hedges[i - sharesRequired].index);
+    }
+
+    std::vector<unsigned char> matrix;
+    const bool hedged = order.back() >= sharesRequired;
+    if (hedged) {
+        NormalizeIndices(order, indices);
+        fecWrapper.BuildDecodeMatrix(indices.data(), matrix);
+    } else {
+        order = selection->shareOrder;
+        indices = selection->decodeIndices;
+    }
+    std::vector<const char*> orderedInputPtrs(sharesRequired);
     for (unsigned int i = 0; i < sharesRequired; ++i)
-        fecInputPtrs[i] = readBuffers[i].data();
+        orderedInputPtrs[i] = reads[order[i]]->buffer.data();
 
-    NormalizeIndices(fecInputPtrs, fecInputIndices);
+    return Combine(outBuffer, size, offset, bytesToRead, orderedInputPtrs, indices,
+                   hedged ? matrix : selection->decodeMatrix);
+}
 
+int FileDecoder::Combine(char* outBuffer, size_t size, off_t offset, int bytesRead,
+                         const std::vector<const char*>& inputs,
+                         const std::vector<unsigned int>& indices,
+                         const std::vector<unsigned char>& matrix)
+{
+    const unsigned int sharesRequired = fecWrapper.GetSharesRequired();
     std::vector<char>& workBuffer(threadLocalData.Get().workBuffer);
-    workBuffer.resize(minBytesRead * sharesRequired);
+    workBuffer.resize(bytesRead * sharesRequired);
     std::vector<char*> fecOutputPtrs(sharesRequired);
     for (unsigned int i = 0; i < sharesRequired; ++i)
-        fecOutputPtrs[i] = workBuffer.data() + i * minBytesRead;
+        fecOutputPtrs[i] = workBuffer.data() + i * bytesRead;
 
-    fecWrapper.Decode(fecOutputPtrs.data(), fecInputPtrs.data(),
-                      fecInputIndices.data(), minBytesRead);
+    std::vector<const char*> fecInputPtrs(inputs);
+    fecWrapper.Decode(fecOutputPtrs.data(), fecInputPtrs.data(), indices.data(), matrix, bytesRead);
 
     unsigned int offsetCorrection = offset % sharesRequired;
 
-    size = std::min<size_t>(std::min<size_t>(size, minBytesRead * sharesRequired - offsetCorrection), Size() - offset);
+    size = std::min<size_t>(std::min<size_t>(size, bytesRead * sharesRequired - offsetCorrection), Size() - offset);
+    // the decoder only outputs the missing shares, one after the other
+    unsigned int output = 0;
     for (unsigned int i = 0; i < sharesRequired; ++i) {
-        const char* decoded = fecInputIndices[i] < sharesRequired ? fecInputPtrs[i] : fecOutputPtrs[i];
+        const char* decoded = indices[i] < sharesRequired ? inputs[i] : fecOutputPtrs[output++];
         char* out = outBuffer + i - offsetCorrection;
         if (i < offsetCorrection) {
             out += sharesRequired;
@@ -107,7 +418,11 @@ int FileDecoder::Read(char *outBuffer, size_t size, off_t offset)
 off_t FileDecoder::Size(const std::string& encodedFilePath)
 {
     File file(encodedFilePath);
+    return Size(file);
+}
 
+off_t FileDecoder::Size(const AbstractFile& file)
+{
     char buffer[Metadata::size];
     ssize_t sizeRead = file.Read(buffer, Metadata::size, 0);
     if (sizeRead != ssize_t(Metadata::size))
@@ -116,8 +431,21 @@ off_t FileDecoder::Size(const std::string& encodedFilePath)
     return Size(Metadata(buffer), file.Size());
 }
 
-void FileDecoder::NormalizeIndices(std::vector<const char*>& fecInputPtrs,
-                                   std::vector<unsigned int>& indices)
+void FileDecoder::PrepareDecoding(Selection& selection) const
+{
+    unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    selection.shareOrder.resize(sharesRequired);
+    selection.decodeIndices.resize(sharesRequired);
+    for (unsigned int i = 0; i < sharesRequired; ++i) {
+        selection.shareOrder[i] = i;
+        selection.decodeIndices[i] = selection.fileIndices[i];
+    }
+    NormalizeIndices(selection.shareOrder, selection.decodeIndices);
+    fecWrapper.BuildDecodeMatrix(selection.decodeIndices.data(), selection.decodeMatrix);
+}
+
+void FileDecoder::NormalizeIndices(std::vector<unsigned int>& order,
+                                   std::vector<unsigned int>& indices) const
 {
     unsigned int sharesRequired = fecWrapper.GetSharesRequired();
     for (unsigned int i = 0; i < sharesRequired;) {
@@ -125,7 +453,7 @@ void FileDecoder::NormalizeIndices(std::vector<const char*>& fecInputPtrs,
         if (index < sharesRequired && index != i) {
             if (indices[index] != index) { // otherwise we would get an infinite loop, but we are probably screwed anyway...
                 std::swap(indices[i], indices[index]);
-                std::swap(fecInputPtrs[i], fecInputPtrs[index]);
+                std::swap(order[i], order[index]);
             }
         } else {
             ++i;
@@ -7,11 +7,16 @@
 #include <string>
 #include <map>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include "blockcache.h"
 #include "fecwrapper.h"
 #include "metadata.h"
 #include "file.h"
 #include "threadlocalizer.h"
+#include "readcoalescer.h"
+#include "computepool.h"
+#include "sharereader.h"
 
 namespace ZFecFS {
 
@@ -23,12 +28,21 @@ public:
                 Metadata metadata,
                 size_t encodedFileSize,
                 const FecWrapper& fecWrapper)
-        : encodedFiles(encodedFiles)
-        , fileIndices(fileIndices)
-        , metadata(metadata)
+        : metadata(metadata)
         , encodedFileSize(encodedFileSize)
         , fecWrapper(fecWrapper)
-    { }
+        , blockCache(NULL)
+        , coalescer(coalesceShareSize * fecWrapper.GetSharesRequired())
+        , computePool(NULL)
+        , shareReader(NULL)
+        , hedgeDelay(0)
+    {
+        Selection* initial = new Selection();
+        initial->files = encodedFiles;
+        initial->fileIndices = fileIndices;
+        PrepareDecoding(*initial);
+        selection.reset(initial);
+    }
 
     static FileDecoder* Open(const std::vector<boost::shared_ptr<AbstractFile> >& encodedFiles,
                              const FecWrapper& fecWrapper);
@@ -39,9 +53,31 @@ public:
     }
 
     static off_t Size(const std::string& encodedFilePath);
+    static off_t Size(const AbstractFile& encodedFile);
 
+    /// Concurrent reads of the same data are only decoded once.
     int Read(char* outBuffer, size_t size, off_t offset);
 
+    /// Serve reads through the given cache, if the share files can be
+    /// identified. Their version is checked on every read, so that a decoder
+    /// that stays open does not serve blocks of shares that changed since.
+    void UseBlockCache(BlockCache& cache);
+    /// Decode large reads on the threads of pool.
+    void UseComputePool(ComputePool& pool) { computePool = &pool; }
+    /// Shares of the same file to use if the ones the decoder was opened
+    /// with fail, are truncated or (when hedging) slow. The metadata of a
+    /// spare is only read when it is needed, inconsistent ones are skipped.
+    void UseSpares(const std::vector<boost::shared_ptr<AbstractFile> >& spares);
+    /// Read the shares on the threads of reader and, if a read takes longer
+    /// than delay seconds, read a spare share as well and decode from the
+    /// shares that arrive first. A read fails over to a spare right away
+    /// when a share fails.
+    void UseHedging(ShareReader& reader, double delay)
+    {
+        shareReader = &reader;
+        hedgeDelay = delay;
+    }
+
 private:
     class ThreadLocalData {
     public:
@@ -52,7 +88,62 @@ private:
 
     ThreadLocalizer<ThreadLocalData> threadLocalData;
 
-    void NormalizeIndices(std::vector<const char*>& fecInputPtrs, std::vector<unsigned int>& indices);
+    /// The shares decoded from. When one of them fails it is replaced by a
+    /// spare in a new selection, reads that use the old one finish with it.
+    class Selection {
+    public:
+        std::vector<boost::shared_ptr<AbstractFile> > files;
+        std::vector<unsigned char> fileIndices;
+        /// The i-th input of the fec decoder is files[shareOrder[i]],
+        /// which holds the share decodeIndices[i].
+        std::vector<unsigned int> shareOrder;
+        std::vector<unsigned int> decodeIndices;
+        std::vector<unsigned char> decodeMatrix;
+    };
+    typedef boost::shared_ptr<const Selection> SelectionPtr;
+
+    class Spare {
+    public:
+        explicit Spare(const boost::shared_ptr<AbstractFile>& file) : file(file), index(0), checked(false) {}
+        boost::shared_ptr<AbstractFile> file;
+        unsigned char index;
+        bool checked; // metadata was read and is consistent
+    };
+
+    SelectionPtr CurrentSelection() const;
+    /// Returns up to count spares with consistent metadata that are not in selection.
+    std::vector<Spare> Spares(const Selection& selection, size_t count);
+    /// Replaces the share file failed by a spare for all later reads. Returns
+    /// false if failed is still used because there is no spare left.
+    bool Failover(const boost::shared_ptr<AbstractFile>& failed);
+    /// Reads the metadata of spares[i] if that was not done yet, removes it
+    /// and returns false if it does not belong to this file.
+    bool CheckSpare(size_t i);
+    /// Bytes a read of bytesToRead at shareOffset returns from an intact share.
+    int ExpectedBytes(int bytesToRead, off_t shareOffset) const;
+    /// Returns -1 if the share cannot be read.
+    static int ReadShare(const AbstractFile& file, char* buffer, size_t size, off_t offset);
+
+    int ReadUncached(char* outBuffer, size_t size, off_t offset);
+    /// Returns -1 if viewShares is set and one of the views turned out not to be intact.
+    int Decode(char* outBuffer, size_t size, off_t offset, bool viewShares);
+    int DecodeHedged(char* outBuffer, size_t size, off_t offset);
+    /// Decodes the required shares at inputs, in the order of decodeIndices
+    /// and matrix, of which bytesRead bytes each were read for the read at offset.
+    /// Returns the number of bytes put into outBuffer.
+    int Combine(char* outBuffer, size_t size, off_t offset, int bytesRead,
+                const std::vector<const char*>& inputs, const std::vector<unsigned int>& decodeIndices,
+                const std::vector<unsigned char>& matrix);
+    int ReadCached(char* outBuffer, size_t size, off_t offset);
+    /// Leaves block empty if it cannot be decoded.
+    void DecodeBlock(off_t blockIndex, const BlockCache::ShareSet* shareSet, BlockCache::Block* block);
+    /// Reads without the block cache.
+    int ReadCoalesced(char* outBuffer, size_t size, off_t offset);
+    int ReadParallel(char* outBuffer, size_t size, off_t offset);
+
+    /// Sets the decoding order and matrix of selection.
+    void PrepareDecoding(Selection& selection) const;
+    void NormalizeIndices(std::vector<unsigned int>& order, std::vector<unsigned int>& indices) const;
     template <class TOutIter, class TInIter>
     TOutIter CopyToNthElement(TOutIter out, TOutIter outEnd, TInIter in, unsigned int stride) const;
     static off_t Size(const Metadata& metadata, off_t encodedSize)
@@ -63,11 +154,29 @@ private:
         return (encodedSize - extraSize) * metadata.required + metadata.excessBytes;
     }
 
-    const std::vector<boost::shared_ptr<AbstractFile> > encodedFiles;
-    const std::vector<unsigned char> fileIndices;
     const Metadata metadata;
     const size_t encodedFileSize;
     const FecWrapper& fecWrapper;
+
+    mutable boost::mutex selectionMutex;
+    SelectionPtr selection;
+    std::vector<Spare> spares;
+
+    /// Amount of data per share that makes up one cached block.
+    const static size_t cacheBlockShareSize = 16384;
+
+    BlockCache* blockCache;
+
+    /// Amount of data per share that concurrent reads share.
+    const static size_t coalesceShareSize = 4096;
+    ReadCoalescer coalescer;
+
+    /// Amount of data per share decoded by one task of the compute pool.
+    const static size_t parallelShareSize = 65536;
+    ComputePool* computePool;
+
+    ShareReader* shareReader;
+    double hedgeDelay;
 };
 
 } // namespace ZFecFS
@@ -6,17 +6,50 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
 
 #include <vector>
 
 #include <boost/thread/lock_guard.hpp>
+#include <boost/bind/bind.hpp>
+
+#include "cancellation.h"
 
 // TODO make everyting large-file-proof
 
 namespace ZFecFS {
 
 
-int FileEncoder::Read(char* const outBuffer, size_t size, off_t offset)
+int FileEncoder::Read(char* outBuffer, size_t size, off_t offset)
+{
+    // the chunks are aligned to the share data after the metadata, which is
+    // filled in here
+    char* outBufferPos = outBuffer;
+    FillMetadata(outBufferPos, size, offset);
+    const size_t metadataSize = outBufferPos - outBuffer;
+    const int result = coalescer.Read(outBufferPos, size - metadataSize, offset + metadataSize - Metadata::size,
+                                      boost::bind(&FileEncoder::ReadData, this, boost::placeholders::_1,
+                                                  boost::placeholders::_2, boost::placeholders::_3));
+    if (result < 0)
+        return metadataSize > 0 ? int(metadataSize) : result;
+    return metadataSize + result;
+}
+
+int FileEncoder::ReadData(char* outBuffer, size_t size, off_t offsetInData)
+{
+    return ReadUncoalesced(outBuffer, size, offsetInData + Metadata::size);
+}
+
+int FileEncoder::ReadUncoalesced(char* outBuffer, size_t size, off_t offset)
+{
+    if (computePool == NULL)
+        return EncodeRange(outBuffer, size, offset);
+    return computePool->Read(outBuffer, size, offset, parallelShareSize,
+                             boost::bind(&FileEncoder::EncodeRange, this, boost::placeholders::_1,
+                                         boost::placeholders::_2, boost::placeholders::_3));
+}
+
+int FileEncoder::EncodeRange(char* const outBuffer, size_t size, off_t offset)
 {
     if (size == 0) return 0;
 
@@ -24,11 +57,13 @@ int FileEncoder::Read(char* const outBuffer, size_t size, off_t offset)
     FillMetadata(outBufferPos, size, offset);
 
     while (outBufferPos < outBuffer + size) {
+        Cancellation::ThrowIfRequested();
         const off_t offsetInData = offset - Metadata::size + (outBufferPos - outBuffer);
         const size_t sizeWanted = outBuffer + size - outBufferPos;
+        // align the batches, so that the source is read in aligned blocks
+        const size_t batchSize = transformBatchSize * fecWrapper.GetSharesRequired();
         if (!FillData(outBufferPos,
-                      std::min<size_t>(sizeWanted,
-                                       transformBatchSize * fecWrapper.GetSharesRequired()),
+                      std::min<size_t>(sizeWanted, batchSize - offsetInData % batchSize),
                       offsetInData))
             break;
     }
@@ -47,6 +82,24 @@ void FileEncoder::FillMetadata(char*& outBuffer, size_t size, off_t offset)
 bool FileEncoder::FillData(char*& outBuffer, size_t size, off_t offset)
 {
     unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    if (FillHole(outBuffer, size, offset))
+        return true;
+
+    boost::shared_ptr<const FileView> view = file->View(size * sharesRequired, offset * sharesRequired);
+    if (view && view->Size() >= sharesRequired) {
+        // encode directly from the view unless we need to pad the end of the file
+        const size_t sizeViewed = std::min(view->Size(), size * sharesRequired);
+        if (sizeViewed % sharesRequired == 0
+                || off_t(offset * sharesRequired + sizeViewed) < OriginalSize()) {
+            char* const outBufferStart = outBuffer;
+            EncodeData(outBuffer, view->Data(), sizeViewed - sizeViewed % sharesRequired);
+            if (view->Intact())
+                return true;
+            // the file shrank while we were reading it
+            outBuffer = outBufferStart;
+        }
+    }
+
     std::vector<char>& readBuffer(threadLocalData.Get().readBuffer);
     readBuffer.resize(size * sharesRequired);
 
@@ -59,19 +112,47 @@ bool FileEncoder::FillData(char*& outBuffer, size_t size, off_t offset)
     assert(sizeRead % sharesRequired == 0);
     assert(sizeRead > 0);
 
+    EncodeData(outBuffer, readBuffer.data(), sizeRead);
+    return true;
+}
+
+bool FileEncoder::FillHole(char*& outBuffer, size_t size, off_t offset)
+{
+    if (!MaybeSparse())
+        return false;
+    unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    const off_t start = offset * sharesRequired;
+    const off_t end = std::min<off_t>(start + size * sharesRequired, OriginalSize());
+    if (start >= end || file->NextData(start) < end)
+        return false;
+
+    // the encoding is linear, so all shares of zeros are zeros
+    const size_t shareSize = (end - start + sharesRequired - 1) / sharesRequired;
+    memset(outBuffer, 0, shareSize);
+    outBuffer += shareSize;
+    return true;
+}
+
+void FileEncoder::EncodeData(char*& outBuffer, const char* data, size_t size)
+{
+    unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    assert(size % sharesRequired == 0);
+
     if (shareIndex < sharesRequired) {
         // TODO can we have compile-time specializations for small required values?
-        outBuffer = CopyNthElement(outBuffer, readBuffer.data() + shareIndex,
-                                   readBuffer.data() + shareIndex + sizeRead, sharesRequired);
+        outBuffer = CopyNthElement(outBuffer, data + shareIndex,
+                                   data + shareIndex + size, sharesRequired);
+    } else if (IsZero(data, size)) {
+        // zeros written into a file instead of leaving a hole, the parity is zero as well
+        memset(outBuffer, 0, size / sharesRequired);
+        outBuffer += size / sharesRequired;
     } else {
         std::vector<char>& workBuffer(threadLocalData.Get().workBuffer);
-        workBuffer.resize(sizeRead);
+        workBuffer.resize(size);
 
-        Distribute(workBuffer.data(),
-                   readBuffer.data(), readBuffer.data() + sizeRead,
-                   sharesRequired);
+        Distribute(workBuffer.data(), data, data + size, sharesRequired);
 
-        int shareSize = sizeRead / sharesRequired;
+        int shareSize = size / sharesRequired;
         std::vector<char*> fecInputPtrs(sharesRequired);
         for (unsigned int i = 0; i < sharesRequired; ++i)
             fecInputPtrs[i] = workBuffer.data() + i * shareSize;
@@ -79,7 +160,6 @@ bool FileEncoder::FillData(char*& outBuffer, size_t size, off_t offset)
         fecWrapper.Encode(outBuffer, fecInputPtrs.data(), shareIndex, shareSize);
         outBuffer += shareSize;
     }
-    return true;
 }
 
 size_t FileEncoder::AdjustDataSize(std::vector<char>& readBuffer, size_t sizeRead, off_t offset)
@@ -112,6 +192,25 @@ off_t FileEncoder::OriginalSize() const
     return originalSize;
 }
 
+bool FileEncoder::MaybeSparse() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+
+    if (!sparseChecked) {
+        struct stat statBuf;
+        sparse = !file->Stat(statBuf) || off_t(statBuf.st_blocks) * 512 < statBuf.st_size;
+        sparseChecked = true;
+    }
+    return sparse;
+}
+
+bool FileEncoder::IsZero(const char* data, size_t size)
+{
+    // memcmp is vectorized, comparing the data with itself shifted by one
+    // byte is the fastest portable check
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
 template <class TOutIter, class TInIter>
 TOutIter FileEncoder::CopyNthElement(TOutIter out, TInIter in, const TInIter end,
                                  unsigned int stride) const
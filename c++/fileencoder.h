@@ -12,6 +12,8 @@
 #include "metadata.h"
 #include "file.h"
 #include "threadlocalizer.h"
+#include "readcoalescer.h"
+#include "computepool.h"
 
 namespace ZFecFS {
 
@@ -26,11 +28,36 @@ public:
         , fecWrapper(fecWrapper)
         , originalSize(0)
         , originalSizeSet(false)
+        , sparseChecked(false)
+        , sparse(false)
+        , coalescer(transformBatchSize)
+        , computePool(NULL)
     {
     }
 
+    /// For a file whose size is already known.
+    FileEncoder(const boost::shared_ptr<AbstractFile>& file,
+                DecodedPath::ShareIndex shareIndex,
+                const FecWrapper& fecWrapper,
+                off_t originalSize)
+        : file(file)
+        , shareIndex(shareIndex)
+        , fecWrapper(fecWrapper)
+        , originalSize(originalSize)
+        , originalSizeSet(true)
+        , sparseChecked(false)
+        , sparse(false)
+        , coalescer(transformBatchSize)
+        , computePool(NULL)
+    {
+    }
+
+    /// Concurrent reads of the same data are only encoded once.
     int Read(char* outBuffer, size_t size, off_t offset);
 
+    /// Split large reads across the threads of pool.
+    void UseComputePool(ComputePool& pool) { computePool = &pool; }
+
     static off_t Size(off_t originalSize, int sharesRequired)
     {
         return (originalSize + sharesRequired - 1) / sharesRequired
@@ -38,8 +65,15 @@ public:
     }
 
 private:
+    /// Reads the share at offsetInData after the metadata.
+    int ReadData(char* outBuffer, size_t size, off_t offsetInData);
+    int ReadUncoalesced(char* outBuffer, size_t size, off_t offset);
+    int EncodeRange(char* outBuffer, size_t size, off_t offset);
     size_t AdjustDataSize(std::vector<char>& readBuffer, size_t sizeRead, off_t offset);
     off_t OriginalSize() const;
+    /// Returns false if the source has all its blocks allocated, so that
+    /// looking for holes is pointless.
+    bool MaybeSparse() const;
 
     template <class TOutIter, class TInIter>
     TOutIter CopyNthElement(TOutIter out, TInIter in, TInIter end, unsigned int stride) const;
@@ -48,8 +82,15 @@ private:
 
     void FillMetadata(char*& outBuffer, size_t size, off_t offset);
     bool FillData(char*& outBuffer, size_t size, off_t offset);
+    /// Fills the share data of a batch that lies in a hole of the source
+    /// with zeros, without reading it. Returns false if it is not in a hole.
+    bool FillHole(char*& outBuffer, size_t size, off_t offset);
+    static bool IsZero(const char* data, size_t size);
+    void EncodeData(char*& outBuffer, const char* data, size_t size);
 
     const static size_t transformBatchSize = 8192;
+    /// Share bytes encoded per task of the compute pool.
+    const static size_t parallelShareSize = 8 * transformBatchSize;
 
     const boost::shared_ptr<AbstractFile> file;
     const DecodedPath::ShareIndex shareIndex;
@@ -68,6 +109,11 @@ private:
     mutable boost::mutex mutex;
     mutable off_t originalSize;
     mutable bool originalSizeSet;
+    mutable bool sparseChecked;
+    mutable bool sparse;
+
+    ReadCoalescer coalescer;
+    ComputePool* computePool;
 };
 
 } // namespace ZFecFS
@@ -0,0 +1,80 @@
+#include "inodetable.h"
+
+#include <boost/thread/lock_guard.hpp>
+
+namespace ZFecFS {
+
+const InodeTable::Id InodeTable::rootId;
+
+InodeTable::InodeTable()
+    : nextId(rootId + 1)
+{
+    Node& root = nodes[rootId];
+    root.path = "/";
+    root.lookups = 1;
+    ids[root.path] = rootId;
+}
+
+std::string InodeTable::ChildPath(const std::string& parent, const std::string& name)
+{
+    if (parent == "/")
+        return parent + name;
+    return parent + "/" + name;
+}
+
+InodeTable::Id InodeTable::Add(const std::string& path)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<std::string, Id>::const_iterator it = ids.find(path);
+    if (it != ids.end()) {
+        nodes[it->second].lookups++;
+        return it->second;
+    }
+    const Id id = nextId++;
+    Node& node = nodes[id];
+    node.path = path;
+    node.lookups = 1;
+    ids[path] = id;
+    return id;
+}
+
+bool InodeTable::Path(Id id, std::string& path) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<Id, Node>::const_iterator it = nodes.find(id);
+    if (it == nodes.end())
+        return false;
+    path = it->second.path;
+    return true;
+}
+
+InodeTable::Id InodeTable::Find(const std::string& path) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<std::string, Id>::const_iterator it = ids.find(path);
+    return it == ids.end() ? 0 : it->second;
+}
+
+void InodeTable::Forget(Id id, uint64_t lookups)
+{
+    if (id == rootId)
+        return;
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<Id, Node>::iterator it = nodes.find(id);
+    if (it == nodes.end())
+        return;
+    if (it->second.lookups > lookups) {
+        it->second.lookups -= lookups;
+        return;
+    }
+    ids.erase(it->second.path);
+    nodes.erase(it);
+}
+
+size_t InodeTable::Size() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return nodes.size();
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,57 @@
+#ifndef ZFECFS_INODETABLE_H
+#define ZFECFS_INODETABLE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <tr1/unordered_map>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Node ids handed out to the kernel by the low-level front end.
+///
+/// Every node remembers its path in the mount, so that operations on a node
+/// id can call the path based backends without rebuilding the path from its
+/// ancestors, and how many lookups the kernel has not forgotten yet. A node
+/// is dropped once all its lookups are forgotten, the root is never dropped.
+class InodeTable : boost::noncopyable
+{
+public:
+    typedef uint64_t Id;
+    static const Id rootId = 1;
+
+    InodeTable();
+
+    /// Returns the path of the child name of the directory path parent.
+    static std::string ChildPath(const std::string& parent, const std::string& name);
+
+    /// Returns the id of path, creating the node if needed, and counts one
+    /// lookup of it.
+    Id Add(const std::string& path);
+    /// Returns false if id is not known.
+    bool Path(Id id, std::string& path) const;
+    /// Returns the id of path or 0 if the kernel does not know path.
+    Id Find(const std::string& path) const;
+    /// Forgets lookups of id.
+    void Forget(Id id, uint64_t lookups);
+    size_t Size() const;
+
+private:
+    class Node {
+    public:
+        std::string path;
+        uint64_t lookups;
+    };
+
+    mutable boost::mutex mutex;
+    Id nextId;
+    std::tr1::unordered_map<Id, Node> nodes;
+    std::tr1::unordered_map<std::string, Id> ids;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_INODETABLE_H
@@ -0,0 +1,124 @@
+#include "ioscheduler.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "cancellation.h"
+
+namespace ZFecFS {
+
+namespace {
+
+__thread int threadClass = IoScheduler::foreground;
+
+} // anonymous namespace
+
+const double IoScheduler::cancellationInterval = 0.01;
+
+IoScheduler::ClassScope::ClassScope(Class ioClass)
+    : previous(Class(threadClass))
+{
+    threadClass = ioClass;
+}
+
+IoScheduler::ClassScope::~ClassScope()
+{
+    threadClass = previous;
+}
+
+IoScheduler::Ticket::Ticket(IoScheduler& scheduler, dev_t device, size_t size)
+    : scheduler(scheduler)
+    , device(device)
+{
+    const Class ioClass = CurrentClass();
+    scheduler.Throttle(ioClass, size);
+    scheduler.Acquire(device, ioClass);
+}
+
+IoScheduler::Ticket::~Ticket()
+{
+    scheduler.Release(device);
+}
+
+IoScheduler::IoScheduler(unsigned int queueDepth, const std::vector<size_t>& rates)
+    : queueDepth(queueDepth)
+{
+    const double now = Now();
+    for (unsigned int i = 0; i < numClasses && i < rates.size(); ++i) {
+        buckets[i].rate = rates[i];
+        buckets[i].tokens = rates[i];
+        buckets[i].refilled = now;
+    }
+}
+
+IoScheduler::Class IoScheduler::CurrentClass()
+{
+    return Class(threadClass);
+}
+
+void IoScheduler::Throttle(Class ioClass, size_t size)
+{
+    double wait;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        Bucket& bucket = buckets[ioClass];
+        if (bucket.rate <= 0)
+            return;
+        // at most one second worth of bytes can be saved up
+        const double now = Now();
+        bucket.tokens = std::min(bucket.rate, bucket.tokens + (now - bucket.refilled) * bucket.rate);
+        bucket.refilled = now;
+        bucket.tokens -= size;
+        wait = bucket.tokens < 0 ? -bucket.tokens / bucket.rate : 0;
+    }
+    // wait in slices, so that an interrupted request does not wait for its bandwidth
+    while (wait > 0) {
+        Cancellation::ThrowIfRequested();
+        usleep(useconds_t(std::min(wait, cancellationInterval) * 1e6));
+        wait -= cancellationInterval;
+    }
+}
+
+void IoScheduler::Acquire(dev_t device, Class ioClass)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    Device& state = devices[device];
+    state.waiting[ioClass]++;
+    for (;;) {
+        bool higherWaiting = false;
+        for (unsigned int i = 0; i < ioClass; ++i)
+            higherWaiting = higherWaiting || state.waiting[i] > 0;
+        if (queueDepth == 0 || (state.inFlight < queueDepth && !higherWaiting))
+            break;
+        released.timed_wait(lock, boost::posix_time::milliseconds(long(cancellationInterval * 1000)));
+        if (Cancellation::Requested()) {
+            state.waiting[ioClass]--;
+            released.notify_all();
+            throw Cancelled();
+        }
+    }
+    state.waiting[ioClass]--;
+    state.inFlight++;
+}
+
+void IoScheduler::Release(dev_t device)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    devices[device].inFlight--;
+    released.notify_all();
+}
+
+double IoScheduler::Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,129 @@
+#ifndef ZFECFS_IOSCHEDULER_H
+#define ZFECFS_IOSCHEDULER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// Coordinates the reads of source and share files, so that prefetching
+/// and background work do not slow down the reads fuse waits for.
+///
+/// Every read belongs to the priority class of the thread issuing it. Reads
+/// of one device are limited to queueDepth at a time, and a read only
+/// starts while no read of a higher class waits for the same device. Each
+/// class can also be limited to a number of bytes per second. Reads of
+/// interrupted requests stop waiting (see Cancellation).
+class IoScheduler : boost::noncopyable
+{
+public:
+    enum Class { foreground, prefetch, background, numClasses };
+
+    /// Sets the class of the reads of the calling thread while it exists.
+    class ClassScope : boost::noncopyable {
+    public:
+        explicit ClassScope(Class ioClass);
+        ~ClassScope();
+    private:
+        const Class previous;
+    };
+
+    /// Admits a read of size bytes from device for as long as it exists.
+    class Ticket : boost::noncopyable {
+    public:
+        Ticket(IoScheduler& scheduler, dev_t device, size_t size);
+        ~Ticket();
+    private:
+        IoScheduler& scheduler;
+        const dev_t device;
+    };
+
+    /// queueDepth 0 does not limit the reads per device, rates has the
+    /// bytes per second of each class, 0 for no limit.
+    IoScheduler(unsigned int queueDepth, const std::vector<size_t>& rates);
+
+    static Class CurrentClass();
+
+private:
+    class Device {
+    public:
+        Device() : inFlight(0)
+        {
+            for (unsigned int i = 0; i < numClasses; ++i)
+                waiting[i] = 0;
+        }
+        unsigned int inFlight;
+        unsigned int waiting[numClasses];
+    };
+
+    class Bucket {
+    public:
+        Bucket() : rate(0), tokens(0), refilled(0) {}
+        double rate;
+        double tokens; // negative while reads wait for their bandwidth
+        double refilled;
+    };
+
+    void Throttle(Class ioClass, size_t size);
+    void Acquire(dev_t device, Class ioClass);
+    void Release(dev_t device);
+    static double Now();
+
+    /// Seconds between checks whether waiting reads were interrupted.
+    static const double cancellationInterval;
+
+    const unsigned int queueDepth;
+
+    boost::mutex mutex;
+    boost::condition_variable released;
+    std::map<dev_t, Device> devices;
+    Bucket buckets[numClasses];
+};
+
+/// File whose reads are admitted by an IoScheduler. Views are not
+/// scheduled, the kernel reads them in when they are accessed.
+class ScheduledFile : public AbstractFile, boost::noncopyable
+{
+public:
+    ScheduledFile(const boost::shared_ptr<AbstractFile>& file, IoScheduler& scheduler)
+        : file(file)
+        , scheduler(scheduler)
+        , device(0)
+    {
+        struct stat statBuf;
+        if (file->Stat(statBuf))
+            device = statBuf.st_dev;
+    }
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        IoScheduler::Ticket ticket(scheduler, device, size);
+        return file->Read(buffer, size, offset);
+    }
+    virtual off_t Size() const { return file->Size(); }
+    virtual bool Stat(struct stat& statBuf) const { return file->Stat(statBuf); }
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const
+    {
+        return file->View(size, offset);
+    }
+    virtual off_t NextData(off_t offset) const { return file->NextData(offset); }
+
+private:
+    const boost::shared_ptr<AbstractFile> file;
+    IoScheduler& scheduler;
+    dev_t device;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_IOSCHEDULER_H
@@ -0,0 +1,261 @@
+#define FUSE_USE_VERSION 26
+
+#include "lowlevelfrontend.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cancellation.h"
+
+namespace ZFecFS {
+
+LowLevelFrontEnd::LowLevelFrontEnd(ZFecFS& backend, double timeout)
+    : backend(backend)
+    , timeout(timeout)
+    , channel(NULL)
+{
+}
+
+int LowLevelFrontEnd::Run(int argc, char* argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char* mountpoint = NULL;
+    int multithreaded = 0;
+    int foreground = 0;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+        return 1;
+
+    const struct fuse_lowlevel_ops operations = Operations();
+    int result = 1;
+    channel = fuse_mount(mountpoint, &args);
+    if (channel != NULL) {
+        struct fuse_session* session = fuse_lowlevel_new(&args, &operations, sizeof(operations), this);
+        if (session != NULL) {
+            if (fuse_set_signal_handlers(session) == 0) {
+                fuse_session_add_chan(session, channel);
+                backend.SetInvalidator(this);
+                fuse_daemonize(foreground);
+                backend.Start();
+                if (multithreaded)
+                    result = fuse_session_loop_mt(session) == 0 ? 0 : 1;
+                else
+                    result = fuse_session_loop(session) == 0 ? 0 : 1;
+                backend.SetInvalidator(NULL);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(channel);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, channel);
+        channel = NULL;
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return result;
+}
+
+struct fuse_lowlevel_ops LowLevelFrontEnd::Operations()
+{
+    struct fuse_lowlevel_ops operations;
+    memset(&operations, 0, sizeof(operations));
+    operations.lookup = Lookup;
+    operations.forget = Forget;
+    operations.forget_multi = ForgetMulti;
+    operations.getattr = Getattr;
+    operations.opendir = Opendir;
+    operations.readdir = Readdir;
+    operations.releasedir = Releasedir;
+    operations.open = Open;
+    operations.read = Read;
+    operations.release = Release;
+    return operations;
+}
+
+void LowLevelFrontEnd::InvalidateContents(const std::string& path)
+{
+    const InodeTable::Id node = inodes.Find(path);
+    if (node != 0 && channel != NULL)
+        fuse_lowlevel_notify_inval_inode(channel, node, 0, 0);
+}
+
+void LowLevelFrontEnd::InvalidateEntry(const std::string& parent, const std::string& name)
+{
+    const InodeTable::Id node = inodes.Find(parent);
+    if (node != 0 && channel != NULL)
+        fuse_lowlevel_notify_inval_entry(channel, node, name.c_str(), name.size());
+}
+
+LowLevelFrontEnd& LowLevelFrontEnd::FromRequest(fuse_req_t request)
+{
+    return *static_cast<LowLevelFrontEnd*>(fuse_req_userdata(request));
+}
+
+bool LowLevelFrontEnd::NodePath(fuse_req_t request, fuse_ino_t node, std::string& path) const
+{
+    if (inodes.Path(node, path))
+        return true;
+    fuse_reply_err(request, ENOENT);
+    return false;
+}
+
+int LowLevelFrontEnd::Fill(void* buffer, const char* name, const struct stat* statBuf, off_t offset)
+{
+    DirectoryBuffer& dir = *static_cast<DirectoryBuffer*>(buffer);
+    if (offset == 0) {
+        // the backend lists the whole directory at once, page through it here
+        if (++dir.position <= dir.offset)
+            return 0;
+        offset = dir.position;
+    }
+    struct stat empty;
+    if (statBuf == NULL) {
+        memset(&empty, 0, sizeof(empty));
+        statBuf = &empty;
+    }
+    const size_t remaining = dir.data.size() - dir.used;
+    const size_t size = fuse_add_direntry(dir.request, &dir.data[0] + dir.used, remaining,
+                                          name, statBuf, offset);
+    if (size > remaining)
+        return 1;
+    dir.used += size;
+    return 0;
+}
+
+void LowLevelFrontEnd::Lookup(fuse_req_t request, fuse_ino_t parent, const char* name)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, parent, path))
+        return;
+    path = InodeTable::ChildPath(path, name);
+
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    const int result = frontEnd.backend.Getattr(path.c_str(), &entry.attr);
+    if (result != 0) {
+        fuse_reply_err(request, -result);
+        return;
+    }
+    entry.ino = frontEnd.inodes.Add(path);
+    entry.attr.st_ino = entry.ino;
+    entry.attr_timeout = frontEnd.timeout;
+    entry.entry_timeout = frontEnd.timeout;
+    if (fuse_reply_entry(request, &entry) != 0)
+        frontEnd.inodes.Forget(entry.ino, 1); // request was interrupted
+}
+
+void LowLevelFrontEnd::Forget(fuse_req_t request, fuse_ino_t node, unsigned long lookups)
+{
+    FromRequest(request).inodes.Forget(node, lookups);
+    fuse_reply_none(request);
+}
+
+void LowLevelFrontEnd::ForgetMulti(fuse_req_t request, size_t count, struct fuse_forget_data* forgets)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    for (size_t i = 0; i < count; ++i)
+        frontEnd.inodes.Forget(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(request);
+}
+
+void LowLevelFrontEnd::Getattr(fuse_req_t request, fuse_ino_t node, struct fuse_file_info*)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, node, path))
+        return;
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    const int result = frontEnd.backend.Getattr(path.c_str(), &statBuf);
+    if (result != 0) {
+        fuse_reply_err(request, -result);
+        return;
+    }
+    statBuf.st_ino = node;
+    fuse_reply_attr(request, &statBuf, frontEnd.timeout);
+}
+
+void LowLevelFrontEnd::Opendir(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, node, path))
+        return;
+    const int result = frontEnd.backend.Opendir(path.c_str(), fileInfo);
+    if (result != 0)
+        fuse_reply_err(request, -result);
+    else if (fuse_reply_open(request, fileInfo) != 0)
+        frontEnd.backend.Releasedir(path.c_str(), fileInfo); // request was interrupted
+}
+
+void LowLevelFrontEnd::Readdir(fuse_req_t request, fuse_ino_t node, size_t size, off_t offset,
+                               struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, node, path))
+        return;
+    DirectoryBuffer dir(request, size, offset);
+    const int result = frontEnd.backend.Readdir(path.c_str(), &dir, Fill, offset, fileInfo);
+    if (result != 0)
+        fuse_reply_err(request, -result);
+    else
+        fuse_reply_buf(request, dir.used == 0 ? NULL : &dir.data[0], dir.used);
+}
+
+void LowLevelFrontEnd::Releasedir(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path; // the backends do not need the path to release
+    frontEnd.inodes.Path(node, path);
+    fuse_reply_err(request, -frontEnd.backend.Releasedir(path.c_str(), fileInfo));
+}
+
+void LowLevelFrontEnd::Open(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, node, path))
+        return;
+    const int result = frontEnd.backend.Open(path.c_str(), fileInfo);
+    if (result != 0)
+        fuse_reply_err(request, -result);
+    else if (fuse_reply_open(request, fileInfo) != 0)
+        frontEnd.backend.Release(path.c_str(), fileInfo); // request was interrupted
+}
+
+void LowLevelFrontEnd::Read(fuse_req_t request, fuse_ino_t node, size_t size, off_t offset,
+                            struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path;
+    if (!frontEnd.NodePath(request, node, path))
+        return;
+    if (size == 0) {
+        fuse_reply_buf(request, NULL, 0);
+        return;
+    }
+    std::vector<char> buffer(size);
+    Cancellation::Scope cancellation(Cancellation::Context(Interrupted, request));
+    const int result = frontEnd.backend.Read(path.c_str(), &buffer[0], size, offset, fileInfo);
+    if (result < 0)
+        fuse_reply_err(request, -result);
+    else
+        fuse_reply_buf(request, &buffer[0], result);
+}
+
+bool LowLevelFrontEnd::Interrupted(void* request)
+{
+    return fuse_req_interrupted(static_cast<fuse_req_t>(request)) != 0;
+}
+
+void LowLevelFrontEnd::Release(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo)
+{
+    LowLevelFrontEnd& frontEnd = FromRequest(request);
+    std::string path; // the backends do not need the path to release
+    frontEnd.inodes.Path(node, path);
+    fuse_reply_err(request, -frontEnd.backend.Release(path.c_str(), fileInfo));
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,93 @@
+#ifndef ZFECFS_LOWLEVELFRONTEND_H
+#define ZFECFS_LOWLEVELFRONTEND_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <fuse_lowlevel.h>
+}
+
+#include <boost/utility.hpp>
+
+#include "zfecfs.h"
+#include "inodetable.h"
+#include "cacheinvalidator.h"
+
+namespace ZFecFS {
+
+/// Serves the mount with the inode based low-level API of fuse instead of
+/// fuse_main, using an encoder or decoder as backend.
+///
+/// Node ids are mapped to paths by our own InodeTable, so that libfuse does
+/// not keep its path tree (and its locks) and every operation passes the
+/// path it already has to the backend. Since the kernel can be told about
+/// node ids, the front end also invalidates stale kernel caches for the
+/// backend.
+class LowLevelFrontEnd : public CacheInvalidator, boost::noncopyable
+{
+public:
+    /// timeout is the number of seconds the kernel may cache attributes and
+    /// lookups.
+    LowLevelFrontEnd(ZFecFS& backend, double timeout);
+
+    /// Mounts with the fuse command line arguments in argv and serves
+    /// requests (in multiple threads unless -s is given) until unmounted.
+    /// The backend is started after daemonizing. Returns the exit code.
+    int Run(int argc, char* argv[]);
+
+    /// The operations Run serves, they expect the front end as user data of
+    /// the session.
+    static struct fuse_lowlevel_ops Operations();
+
+    virtual void InvalidateContents(const std::string& path);
+    virtual void InvalidateEntry(const std::string& parent, const std::string& name);
+
+private:
+    /// Collects the entries of a readdir reply.
+    class DirectoryBuffer {
+    public:
+        DirectoryBuffer(fuse_req_t request, size_t size, off_t offset)
+            : request(request), data(size), used(0), offset(offset), position(0)
+        {}
+        fuse_req_t request;
+        std::vector<char> data;
+        size_t used;
+        off_t offset;
+        off_t position; // for backends that list without offsets
+    };
+
+    static LowLevelFrontEnd& FromRequest(fuse_req_t request);
+    /// Replies ENOENT if the node is not known.
+    bool NodePath(fuse_req_t request, fuse_ino_t node, std::string& path) const;
+
+    static int Fill(void* buffer, const char* name, const struct stat* statBuf, off_t offset);
+
+    static void Lookup(fuse_req_t request, fuse_ino_t parent, const char* name);
+    static void Forget(fuse_req_t request, fuse_ino_t node, unsigned long lookups);
+    static void ForgetMulti(fuse_req_t request, size_t count, struct fuse_forget_data* forgets);
+    static void Getattr(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo);
+    static void Opendir(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo);
+    static void Readdir(fuse_req_t request, fuse_ino_t node, size_t size, off_t offset,
+                        struct fuse_file_info* fileInfo);
+    static void Releasedir(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo);
+    static void Open(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo);
+    static void Read(fuse_req_t request, fuse_ino_t node, size_t size, off_t offset,
+                     struct fuse_file_info* fileInfo);
+    static void Release(fuse_req_t request, fuse_ino_t node, struct fuse_file_info* fileInfo);
+
+    /// Cancellation check for the request passed as data.
+    static bool Interrupted(void* request);
+
+    ZFecFS& backend;
+    const double timeout;
+    InodeTable inodes;
+    struct fuse_chan* channel; // only set while mounted
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_LOWLEVELFRONTEND_H
@@ -2,6 +2,7 @@
 #define _USE_GNU
 
 #include <utility>
+#include <list>
 #include <string>
 #include <exception>
 #include <sstream>
@@ -30,6 +31,8 @@ extern "C" {
 #include "zfecfs.h"
 #include "zfecfsencoder.h"
 #include "zfecfsdecoder.h"
+#include "lowlevelfrontend.h"
+#include "cancellation.h"
 
 namespace ZFecFS {
 
@@ -47,6 +50,13 @@ ZFecFS& ZFecFS::GetInstance()
 
 extern "C" {
 
+static void* zfecfs_init(struct fuse_conn_info*)
+{
+    // fuse_main has daemonized by now
+    ZFecFS::ZFecFS::GetInstance().Start();
+    return NULL;
+}
+
 static int zfecfs_getattr(const char* path, struct stat* stbuf)
 {
     return ZFecFS::ZFecFS::GetInstance().Getattr(path, stbuf);
@@ -76,6 +86,10 @@ static int zfecfs_open(const char *path, struct fuse_file_info *fileInfo)
 static int zfecfs_read(const char* path, char* outBuffer, size_t size, off_t offset,
               struct fuse_file_info* fileInfo)
 {
+    // fuse_interrupted only works on the fuse thread of the request, the
+    // compute pool threads see what it returned there
+    ZFecFS::Cancellation::ThreadCheck interrupted(fuse_interrupted);
+    ZFecFS::Cancellation::Scope cancellation(interrupted.GetContext());
     return ZFecFS::ZFecFS::GetInstance().Read(path, outBuffer, size, offset,
                                               fileInfo);
 }
@@ -87,6 +101,23 @@ static int zfecfs_release(const char* path, struct fuse_file_info* fileInfo)
 
 static struct fuse_operations zfecfs_operations;
 
+/// Removes our own options from a comma-separated list of mount options and
+/// returns the remaining ones which are meant for fuse.
+static std::string FilterOptions(const std::string& optionList, ZFecFS::Options& options)
+{
+    std::string fuseOptions;
+    std::istringstream s(optionList);
+    std::string option;
+    while (std::getline(s, option, ',')) {
+        if (option.empty() || options.Parse(option))
+            continue;
+        if (!fuseOptions.empty())
+            fuseOptions += ",";
+        fuseOptions += option;
+    }
+    return fuseOptions;
+}
+
 static void ShowHelp(const std::string& firstArg)
 {
     std::cout << "Usage: " << firstArg << " [-r] [-d] [-f] <required> <shares> <source> <target>" << std::endl
@@ -97,7 +128,67 @@ static void ShowHelp(const std::string& firstArg)
               << "    -r    Reverse the operation - erasure-coded data is available in <source> and the" << std::endl
               << "          decoded data will appear at <target>." << std::endl
               << "    -f    Stay in foreground." << std::endl
-              << "    -d    Add debug output, implies -f." << std::endl;
+              << "    -d    Add debug output, implies -f." << std::endl
+              << "    -o    Mount options, passed on to fuse unless they are one of:" << std::endl
+              << std::endl
+              << "    block_cache=<size>  Bytes of decoded data the restore mount keeps in memory," << std::endl
+              << "                        0 to disable (default 64M)." << std::endl
+              << "    parity_cache=<dir>  Store computed parity shares in <dir> and serve them from there" << std::endl
+              << "                        as long as the source file is unchanged." << std::endl
+              << "    parity_scan=<secs>  Interval in which recently changed files are precomputed into" << std::endl
+              << "                        the parity cache, 0 to only fill it on misses (default 3600)." << std::endl
+              << "    mmap                Read source and share files through memory mappings." << std::endl
+              << "    direct_source       Read source files with O_DIRECT and serve shares with direct_io," << std::endl
+              << "                        so that neither ends up in the page cache." << std::endl
+              << "    open_cache=<n>      Number of file descriptors kept open for released files, so" << std::endl
+              << "                        that opening them again is cheap, 0 to disable (default 1024)." << std::endl
+              << "    open_cache_idle=<secs>  Time after which released files are closed (default 60)." << std::endl
+              << "    namespace_index     Keep the directory trees of all shares of the restore mount in" << std::endl
+              << "                        memory (watched with inotify) to find files without lstat." << std::endl
+              << "    size_cache=<n>      Number of decoded file sizes the restore mount remembers, so" << std::endl
+              << "                        that getattr does not open files, 0 to disable (default 65536)." << std::endl
+              << "    manifests           Serve a manifest file listing each directory in the shares," << std::endl
+              << "                        or answer getattr and readdir from these manifests when restoring." << std::endl
+              << "    prefetch=<n>        Number of threads reading file sizes of opened directories in the" << std::endl
+              << "                        restore mount ahead of getattr, 0 to disable (default 8)." << std::endl
+              << "    watch_source        Watch the source of the encoder with inotify and drop cached" << std::endl
+              << "                        encoded data of files that change." << std::endl
+              << "    cache_timeout=<secs>  Sets attr_timeout and entry_timeout of fuse." << std::endl
+              << "    journal=<file>      Record changes of the source in <file>. Each share then has a" << std::endl
+              << "                        file .zfecfs-journal with the current cursor and files" << std::endl
+              << "                        .zfecfs-changes-<cursor> listing the paths changed since, for" << std::endl
+              << "                        'rsync -r --files-from'. Implies watch_source." << std::endl
+              << "    block_sums=<size>   Serve <share>.zfecfs-sums next to each share file with the" << std::endl
+              << "                        SHA-256 sums of its blocks of <size> bytes." << std::endl
+              << "    lowlevel            Use the inode based low-level API of fuse, which avoids" << std::endl
+              << "                        rebuilding paths for each request and lets watch_source" << std::endl
+              << "                        invalidate what the kernel cached." << std::endl
+              << "    compute_threads=<n>  Number of threads large reads are split across for encoding" << std::endl
+              << "                        and decoding, 0 to not split reads (default: number of cores)." << std::endl
+              << "    shares=<list>       Only serve the shares in <list>, like 0-3:7, so that the shares" << std::endl
+              << "                        can be served by several processes mounted side by side." << std::endl
+              << "    stripe_cache=<size> Cache source blocks in the shared memory segment" << std::endl
+              << "                        /zfecfs-stripes-<uid> (created with <size> bytes by the first" << std::endl
+              << "                        process), so that processes serving different shares read the" << std::endl
+              << "                        source once." << std::endl
+              << "    io_depth=<n>        Number of reads of source or share files per disk at a time," << std::endl
+              << "                        reads for fuse going before prefetching and background work." << std::endl
+              << "    io_rates=<fg>:<prefetch>:<bg>  Bytes per second each class of reads may use, 0 for" << std::endl
+              << "                        no limit (e.g. io_rates=0:50M:20M)." << std::endl
+              << "    fastest_shares      Decode from the shares in the share directories with the lowest" << std::endl
+              << "                        read latency instead of the first ones found." << std::endl
+              << "    hedge_threads=<n>   Read shares on <n> threads when restoring, and if a read takes" << std::endl
+              << "                        longer than usual for its directory, read a spare share as well" << std::endl
+              << "                        and decode from the first ones that arrive. Implies fastest_shares." << std::endl
+              << "    small_files=<size>  Encode source files of at most <size> bytes into all shares at" << std::endl
+              << "                        once and serve the other shares from memory, 0 to disable" << std::endl
+              << "                        (default 16K)." << std::endl
+              << "    small_file_cache=<size>  Bytes of encoded shares of small files kept in memory" << std::endl
+              << "                        (default 16M)." << std::endl
+              << "    pack_small=<size>   Serve the regular files of at most <size> bytes in each directory" << std::endl
+              << "                        in a single file .zfecfs-pack per share instead of a share file" << std::endl
+              << "                        each, or show the files in these packs when restoring. A pack" << std::endl
+              << "                        takes at most a quarter of small_file_cache." << std::endl;
 }
 
 int main(int argc, char *argv[])
@@ -107,8 +198,10 @@ int main(int argc, char *argv[])
     unsigned int numShares = 0xffff;
     std::string source;
     std::string target;
+    ZFecFS::Options options;
 
     int positionalOption = 0;
+    std::list<std::string> fuseOptions;
     std::vector<char*> fuseArgv;
     fuseArgv.push_back(argv[0]);
 
@@ -122,9 +215,20 @@ int main(int argc, char *argv[])
         } else if (arg == "-d" || arg == "-f") {
             fuseArgv.push_back(argv[i]);
         } else if (arg == "-o") {
-            fuseArgv.push_back(argv[i]);
-            ++i;
-            fuseArgv.push_back(argv[i]);
+            if (++i >= argc) {
+                ShowHelp(argv[0]);
+                return 1;
+            }
+            try {
+                fuseOptions.push_back(FilterOptions(argv[i], options));
+            } catch (const std::exception& exc) {
+                std::cerr << "Invalid option " << argv[i] << ": " << exc.what() << std::endl;
+                return 1;
+            }
+            if (!fuseOptions.back().empty()) {
+                fuseArgv.push_back(argv[i - 1]);
+                fuseArgv.push_back(const_cast<char*>(fuseOptions.back().c_str()));
+            }
         } else {
             if (positionalOption < 2) {
                 std::istringstream s(arg);
@@ -156,12 +260,29 @@ int main(int argc, char *argv[])
     if (source[source.size() - 1] != '/')
         source += "/";
 
+    if (options.cacheTimeout > 0 && !options.lowLevel) {
+        std::ostringstream timeouts;
+        timeouts << "attr_timeout=" << options.cacheTimeout
+                 << ",entry_timeout=" << options.cacheTimeout;
+        fuseOptions.push_back(timeouts.str());
+        fuseArgv.push_back(const_cast<char*>("-o"));
+        fuseArgv.push_back(const_cast<char*>(fuseOptions.back().c_str()));
+    }
+
     if (decode) {
-        ZFecFS::globalZFecFSInstance = new ZFecFS::ZFecFSDecoder(requiredShares, numShares, source);
+        ZFecFS::globalZFecFSInstance = new ZFecFS::ZFecFSDecoder(requiredShares, numShares, source, options);
     } else {
-        ZFecFS::globalZFecFSInstance = new ZFecFS::ZFecFSEncoder(requiredShares, numShares, source);
+        ZFecFS::globalZFecFSInstance = new ZFecFS::ZFecFSEncoder(requiredShares, numShares, source, options);
+    }
+
+    if (options.lowLevel) {
+        // fuse's default for attr_timeout and entry_timeout is one second
+        ZFecFS::LowLevelFrontEnd frontEnd(ZFecFS::ZFecFS::GetInstance(),
+                                          options.cacheTimeout > 0 ? options.cacheTimeout : 1.0);
+        return frontEnd.Run(fuseArgv.size(), fuseArgv.data());
     }
 
+    zfecfs_operations.init = zfecfs_init;
     zfecfs_operations.getattr = zfecfs_getattr;
 
     zfecfs_operations.opendir = zfecfs_opendir;
@@ -0,0 +1,196 @@
+#include "manifest.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "file.h"
+#include "utils.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const char* const magic = "zfecfs-manifest 1";
+
+bool NameLess(const Manifest::Entry& a, const Manifest::Entry& b)
+{
+    return a.name < b.name;
+}
+
+bool Newer(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+} // anonymous namespace
+
+const char* const Manifest::fileName = ".zfecfs-manifest";
+
+void Manifest::Entry::ToStat(struct stat& statBuf) const
+{
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = mode;
+    statBuf.st_nlink = 1;
+    statBuf.st_uid = uid;
+    statBuf.st_gid = gid;
+    statBuf.st_size = size;
+    statBuf.st_mtim = mtime;
+    statBuf.st_ctim = mtime;
+    statBuf.st_atim = mtime;
+}
+
+void Manifest::Add(const std::string& name, const struct stat& statBuf, const std::string& header)
+{
+    Entry entry;
+    entry.name = name;
+    entry.mode = statBuf.st_mode;
+    entry.uid = statBuf.st_uid;
+    entry.gid = statBuf.st_gid;
+    entry.size = statBuf.st_size;
+    entry.mtime = statBuf.st_mtim;
+    entry.header = header;
+    entries.push_back(entry);
+}
+
+void Manifest::Sort()
+{
+    std::sort(entries.begin(), entries.end(), NameLess);
+}
+
+const Manifest::Entry* Manifest::Find(const std::string& name) const
+{
+    Entry key;
+    key.name = name;
+    std::vector<Entry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), key, NameLess);
+    if (it == entries.end() || it->name != name)
+        return NULL;
+    return &*it;
+}
+
+std::string Manifest::Serialize() const
+{
+    // one line per entry: mode uid gid size mtime header name
+    std::ostringstream data;
+    data << magic << '\n';
+    BOOST_FOREACH(const Entry& entry, entries) {
+        data << std::oct << entry.mode << std::dec << ' ' << entry.uid << ' ' << entry.gid << ' '
+             << entry.size << ' ' << entry.mtime.tv_sec << ' ' << entry.mtime.tv_nsec << ' ';
+        if (entry.header.empty()) {
+            data << '-';
+        } else {
+            BOOST_FOREACH(char c, entry.header)
+                data << Hex::EncodeDigit((c >> 4) & 0xf) << Hex::EncodeDigit(c & 0xf);
+        }
+        data << ' ' << LineEscape::Escape(entry.name) << '\n';
+    }
+    return data.str();
+}
+
+Manifest Manifest::Parse(const std::string& data)
+{
+    std::istringstream lines(data);
+    std::string line;
+    if (!std::getline(lines, line) || line != magic)
+        throw SimpleException("Not a manifest.");
+
+    Manifest manifest;
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string header;
+        fields >> std::oct >> entry.mode >> std::dec >> entry.uid >> entry.gid >> entry.size
+               >> entry.mtime.tv_sec >> entry.mtime.tv_nsec >> header;
+        if (fields.fail() || fields.get() != ' ')
+            throw SimpleException("Invalid manifest entry.");
+        if (header != "-") {
+            if (header.size() % 2 != 0)
+                throw SimpleException("Invalid manifest entry.");
+            for (unsigned int i = 0; i < header.size(); i += 2)
+                entry.header.push_back(char(Hex::DecodeDigit(header[i]) << 4 | Hex::DecodeDigit(header[i + 1])));
+        }
+        std::string name;
+        std::getline(fields, name);
+        entry.name = LineEscape::Unescape(name);
+        manifest.entries.push_back(entry);
+    }
+    manifest.Sort();
+    return manifest;
+}
+
+boost::shared_ptr<const Manifest> ManifestCache::Get(const std::string& directoryPath)
+{
+    const std::string path = directoryPath + "/" + Manifest::fileName;
+    struct stat manifestStat;
+    struct stat directoryStat;
+    if (lstat(path.c_str(), &manifestStat) == -1 || !S_ISREG(manifestStat.st_mode)
+            || lstat(directoryPath.c_str(), &directoryStat) == -1)
+        return boost::shared_ptr<const Manifest>();
+    // the encoder dates the manifest to the newest change in the directory,
+    // so anything changed on this side afterwards makes it stale
+    if (Newer(directoryStat.st_mtim, manifestStat.st_mtim))
+        return boost::shared_ptr<const Manifest>();
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::tr1::unordered_map<std::string, CachedList::iterator>::iterator it = index.find(path);
+        if (it != index.end()) {
+            const Cached& entry = *it->second;
+            if (entry.inode == manifestStat.st_ino && entry.size == manifestStat.st_size
+                    && !Newer(entry.mtime, manifestStat.st_mtim) && !Newer(manifestStat.st_mtim, entry.mtime)) {
+                cached.splice(cached.begin(), cached, it->second);
+                return entry.manifest;
+            }
+            cached.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    Cached entry;
+    entry.path = path;
+    entry.inode = manifestStat.st_ino;
+    entry.size = manifestStat.st_size;
+    entry.mtime = manifestStat.st_mtim;
+    entry.manifest = Load(path);
+    if (!entry.manifest)
+        return entry.manifest;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (index.find(path) == index.end()) {
+        cached.push_front(entry);
+        index[path] = cached.begin();
+        while (cached.size() > maxManifests) {
+            index.erase(cached.back().path);
+            cached.pop_back();
+        }
+    }
+    return entry.manifest;
+}
+
+boost::shared_ptr<const Manifest> ManifestCache::Load(const std::string& path) const
+{
+    try {
+        File file(path);
+        std::string data(file.Size(), 0);
+        if (!data.empty() && file.Read(&data[0], data.size(), 0) != ssize_t(data.size()))
+            return boost::shared_ptr<const Manifest>();
+        boost::shared_ptr<Manifest> manifest = boost::make_shared<Manifest>(Manifest::Parse(data));
+
+        // manifests written for a different number of required shares do not fit
+        BOOST_FOREACH(const Manifest::Entry& entry, manifest->Entries()) {
+            if (!entry.header.empty() && (entry.header.size() != 3
+                                          || (unsigned char)entry.header[0] != sharesRequired))
+                return boost::shared_ptr<const Manifest>();
+        }
+        return manifest;
+    } catch (const std::exception& exc) {
+        return boost::shared_ptr<const Manifest>();
+    }
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,97 @@
+#ifndef ZFECFS_MANIFEST_H
+#define ZFECFS_MANIFEST_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <tr1/unordered_map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Listing of a directory of a share, including everything getattr reports
+/// about its entries. The encoder serves it as an additional file in every
+/// directory of the share views, so that it is copied along with the
+/// shares and the restore mount does not have to look at every share file.
+class Manifest
+{
+public:
+    /// Name of the manifest file inside each directory.
+    static const char* const fileName;
+
+    class Entry {
+    public:
+        Entry() : mode(0), uid(0), gid(0), size(0) { mtime.tv_sec = mtime.tv_nsec = 0; }
+
+        std::string name;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        off_t size; // decoded size for regular files
+        struct timespec mtime;
+        std::string header; // metadata header of the share file, empty if not a regular file
+
+        void ToStat(struct stat& statBuf) const;
+    };
+
+    /// Adds the entry described by statBuf (of the source file).
+    void Add(const std::string& name, const struct stat& statBuf, const std::string& header);
+
+    /// Sorts the entries by name, must be called before Find.
+    void Sort();
+    const Entry* Find(const std::string& name) const;
+    const std::vector<Entry>& Entries() const { return entries; }
+
+    std::string Serialize() const;
+    /// @throws SimpleException if data is not a valid manifest
+    static Manifest Parse(const std::string& data);
+
+private:
+    std::vector<Entry> entries;
+};
+
+/// Bounded cache of parsed manifests for the restore mount.
+class ManifestCache : boost::noncopyable
+{
+public:
+    ManifestCache(unsigned int sharesRequired, size_t maxManifests)
+        : sharesRequired(sharesRequired)
+        , maxManifests(maxManifests)
+    {}
+
+    /// Returns the manifest inside the share directory directoryPath, or an
+    /// empty pointer if there is none, it is invalid or the directory was
+    /// modified after the manifest was written.
+    boost::shared_ptr<const Manifest> Get(const std::string& directoryPath);
+
+private:
+    class Cached {
+    public:
+        std::string path;
+        ino_t inode;
+        off_t size;
+        struct timespec mtime;
+        boost::shared_ptr<const Manifest> manifest;
+    };
+    typedef std::list<Cached> CachedList;
+
+    boost::shared_ptr<const Manifest> Load(const std::string& path) const;
+
+    const unsigned int sharesRequired;
+    const size_t maxManifests;
+
+    boost::mutex mutex;
+    CachedList cached; // most recently used first
+    std::tr1::unordered_map<std::string, CachedList::iterator> index;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_MANIFEST_H
@@ -0,0 +1,237 @@
+#include "mappedfile.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+namespace ZFecFS {
+
+namespace {
+
+/// Address ranges of all live mappings, read by the SIGBUS handler.
+class Mapping {
+public:
+    volatile uintptr_t start;
+    volatile uintptr_t end;
+    volatile unsigned long faults;
+};
+
+const unsigned int maxMappings = 1024;
+Mapping mappings[maxMappings];
+boost::mutex mappingsMutex;
+uintptr_t pageSize;
+struct sigaction previousSigbusAction;
+pthread_once_t sigbusHandlerInstalled = PTHREAD_ONCE_INIT;
+
+extern "C" void HandleSigbus(int number, siginfo_t* info, void* context)
+{
+    const uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (unsigned int i = 0; i < maxMappings; ++i) {
+        Mapping& mapping = mappings[i];
+        if (mapping.start <= address && address < mapping.end) {
+            // the file shrank, replace the page beyond its end by zeros
+            void* page = reinterpret_cast<void*>(address & ~(pageSize - 1));
+            if (mmap(page, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+                    != MAP_FAILED) {
+                __sync_fetch_and_add(&mapping.faults, 1);
+                return;
+            }
+        }
+    }
+    // not caused by one of our mappings, pass it on but stay installed for the next one
+    if (previousSigbusAction.sa_flags & SA_SIGINFO) {
+        previousSigbusAction.sa_sigaction(number, info, context);
+    } else if (previousSigbusAction.sa_handler != SIG_DFL && previousSigbusAction.sa_handler != SIG_IGN) {
+        previousSigbusAction.sa_handler(number);
+    } else {
+        // a real fault, the access is retried with the default action, which ends the process
+        signal(SIGBUS, SIG_DFL);
+    }
+}
+
+extern "C" void InstallSigbusHandler()
+{
+    pageSize = sysconf(_SC_PAGESIZE);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = HandleSigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previousSigbusAction);
+}
+
+int RegisterMapping(const char* data, size_t length)
+{
+    pthread_once(&sigbusHandlerInstalled, InstallSigbusHandler);
+
+    boost::lock_guard<boost::mutex> lock(mappingsMutex);
+    for (unsigned int i = 0; i < maxMappings; ++i) {
+        if (mappings[i].end == 0) {
+            mappings[i].start = reinterpret_cast<uintptr_t>(data);
+            mappings[i].end = reinterpret_cast<uintptr_t>(data) + length;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void UnregisterMapping(int slot)
+{
+    boost::lock_guard<boost::mutex> lock(mappingsMutex);
+    mappings[slot].end = 0;
+    mappings[slot].start = 0;
+}
+
+} // anonymous namespace
+
+const off_t MappedFile::windowSize;
+
+class MappedFile::Window : boost::noncopyable
+{
+public:
+    Window(int handle, off_t start, size_t length)
+        : start(start)
+        , length(length)
+        , data(static_cast<char*>(mmap(NULL, length, PROT_READ, MAP_SHARED, handle, start)))
+        , slot(-1)
+        , initialFaults(0)
+        , advisedUntil(start)
+    {
+        if (data == MAP_FAILED)
+            throw SimpleException("Error mapping file.");
+        slot = RegisterMapping(data, length);
+        if (slot == -1) {
+            // without protection against SIGBUS the mapping is not safe to use
+            munmap(data, length);
+            throw SimpleException("Too many mappings.");
+        }
+        initialFaults = mappings[slot].faults;
+        madvise(data, length, MADV_SEQUENTIAL);
+    }
+
+    ~Window()
+    {
+        UnregisterMapping(slot);
+        munmap(data, length);
+    }
+
+    unsigned long Faults() const
+    {
+        return mappings[slot].faults;
+    }
+
+    bool Damaged() const
+    {
+        return Faults() != initialFaults;
+    }
+
+    bool Contains(off_t offset) const
+    {
+        return start <= offset && offset < start + off_t(length);
+    }
+
+    /// Asks the kernel to read ahead whenever reads get close to the end of
+    /// the part we asked for last time.
+    void Advise(off_t offset, size_t size)
+    {
+        if (offset + off_t(size) <= advisedUntil && offset >= advisedUntil - readAhead)
+            return;
+        const off_t begin = offset - (offset - start) % pageSize;
+        advisedUntil = std::min(offset + std::max<off_t>(size, readAhead), start + off_t(length));
+        madvise(data + (begin - start), advisedUntil - begin, MADV_WILLNEED);
+    }
+
+    const off_t start;
+    const size_t length;
+    char* const data;
+private:
+    int slot;
+    unsigned long initialFaults;
+    off_t advisedUntil;
+
+    const static off_t readAhead = 4 << 20;
+};
+
+const off_t MappedFile::Window::readAhead;
+
+class MappedFile::MappedView : public FileView
+{
+public:
+    MappedView(const boost::shared_ptr<Window>& window, off_t offset, size_t size)
+        : FileView(window->data + (offset - window->start), size)
+        , window(window)
+        , faults(window->Faults())
+    {}
+
+    virtual bool Intact() const
+    {
+        return window->Faults() == faults;
+    }
+
+private:
+    const boost::shared_ptr<Window> window;
+    const unsigned long faults;
+};
+
+ssize_t MappedFile::Read(char* buffer, size_t size, off_t offset) const
+{
+    size_t sizeRead = 0;
+    while (sizeRead < size) {
+        boost::shared_ptr<const FileView> view = View(size - sizeRead, offset + sizeRead);
+        if (!view)
+            return sizeRead + file.Read(buffer + sizeRead, size - sizeRead, offset + sizeRead);
+        memcpy(buffer + sizeRead, view->Data(), view->Size());
+        if (!view->Intact())
+            return sizeRead + file.Read(buffer + sizeRead, size - sizeRead, offset + sizeRead);
+        sizeRead += view->Size();
+    }
+    return sizeRead;
+}
+
+boost::shared_ptr<const FileView> MappedFile::View(size_t size, off_t offset) const
+{
+    boost::shared_ptr<Window> window = GetWindow(offset, size);
+    if (!window)
+        return boost::shared_ptr<const FileView>();
+
+    size = std::min<off_t>(size, window->start + window->length - offset);
+    return boost::make_shared<MappedView>(window, offset, size);
+}
+
+boost::shared_ptr<MappedFile::Window> MappedFile::GetWindow(off_t offset, size_t size) const
+{
+    const off_t windowStart = offset - offset % windowSize;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    for (std::list<boost::shared_ptr<Window> >::iterator it = windows.begin();
+         it != windows.end(); ++it) {
+        if ((*it)->Contains(offset) && !(*it)->Damaged()) {
+            windows.splice(windows.begin(), windows, it);
+            windows.front()->Advise(offset, size);
+            return windows.front();
+        }
+    }
+
+    try {
+        const off_t fileSize = file.Size();
+        if (offset >= fileSize)
+            return boost::shared_ptr<Window>();
+        windows.push_front(boost::make_shared<Window>(file.GetHandle(), windowStart,
+                                                      std::min(windowSize, fileSize - windowStart)));
+    } catch (const std::exception& exc) {
+        return boost::shared_ptr<Window>();
+    }
+    while (windows.size() > maxWindows)
+        windows.pop_back();
+    windows.front()->Advise(offset, size);
+    return windows.front();
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,66 @@
+#ifndef ZFECFS_MAPPEDFILE_H
+#define ZFECFS_MAPPEDFILE_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// File that is read through memory mappings instead of pread.
+///
+/// The file is mapped in windows of windowSize bytes, of which the most
+/// recently used ones are kept. Views returned by View point directly into
+/// the page cache. If the file shrinks while it is mapped, accesses beyond
+/// its new end are answered with zeros instead of SIGBUS and the affected
+/// views report that they are no longer intact.
+class MappedFile : public AbstractFile, boost::noncopyable
+{
+public:
+    explicit MappedFile(const std::string& path)
+        : file(path)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const;
+
+    virtual off_t Size() const
+    {
+        return file.Size();
+    }
+
+    virtual bool Stat(struct stat& statBuf) const
+    {
+        return file.Stat(statBuf);
+    }
+
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const;
+
+    virtual off_t NextData(off_t offset) const
+    {
+        return file.NextData(offset);
+    }
+
+private:
+    class Window;
+    class MappedView;
+
+    boost::shared_ptr<Window> GetWindow(off_t offset, size_t size) const;
+
+    const static off_t windowSize = off_t(64) << 20;
+    const static unsigned int maxWindows = 4;
+
+    const File file;
+
+    mutable boost::mutex mutex;
+    mutable std::list<boost::shared_ptr<Window> > windows; // most recently used first
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_MAPPEDFILE_H
@@ -0,0 +1,418 @@
+#include "namespaceindex.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <algorithm>
+
+#include <boost/bind/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "utils.h"
+#include "directory.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                           | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+std::string Join(const std::string& directory, const char* name)
+{
+    std::string path = directory;
+    if (path.empty() || path[path.size() - 1] != '/')
+        path += '/';
+    return path.append(name);
+}
+
+} // anonymous namespace
+
+/// Walks the directory tree of one share below a given path, watching all
+/// directories it finds.
+class NamespaceIndex::Walk
+{
+public:
+    Walk(int inotifyHandle, const std::string& shareRoot, ShareNumber share, const std::string& start)
+        : share(share)
+        , failed(false)
+        , inotifyHandle(inotifyHandle)
+        , shareRoot(shareRoot)
+        , start(start)
+    {}
+
+    void Run()
+    {
+        Visit(start);
+    }
+
+    const ShareNumber share;
+    std::vector<std::pair<std::string, unsigned char> > paths;
+    std::vector<std::pair<int, std::string> > watched;
+    bool failed;
+
+private:
+    void Visit(const std::string& path)
+    {
+        const std::string absolutePath = shareRoot + path;
+        const int watch = inotify_add_watch(inotifyHandle, absolutePath.c_str(), watchMask);
+        if (watch == -1) {
+            failed = true;
+            return;
+        }
+        watched.push_back(std::make_pair(watch, path));
+
+        try {
+            Directory dir(absolutePath);
+            for (struct dirent* entry = dir.Readdir(); entry != NULL; entry = dir.Readdir()) {
+                if (IsDotDirectory(entry->d_name))
+                    continue;
+                const std::string child = Join(path, entry->d_name);
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN) {
+                    struct stat statBuf;
+                    if (lstat((shareRoot + child).c_str(), &statBuf) == -1)
+                        continue;
+                    type = IFTODT(statBuf.st_mode);
+                }
+                paths.push_back(std::make_pair(child, type));
+                if (type == DT_DIR)
+                    Visit(child);
+            }
+        } catch (const std::exception& exc) {
+            // vanished in the meantime
+        }
+    }
+
+    const int inotifyHandle;
+    const std::string shareRoot;
+    const std::string start;
+};
+
+NamespaceIndex::NamespaceIndex(const std::string& source)
+    : source(source)
+    , usable(false)
+    , watching(false)
+    , inotifyHandle(-1)
+    , sourceWatch(-1)
+{
+    if (pipe(stopPipe) == -1)
+        throw SimpleException("Unable to create pipe.");
+    Build();
+}
+
+NamespaceIndex::~NamespaceIndex()
+{
+    if (watcher.joinable() && write(stopPipe[1], "", 1) == 1)
+        watcher.join();
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    if (inotifyHandle != -1)
+        close(inotifyHandle);
+}
+
+void NamespaceIndex::Start()
+{
+    // changes since Build are queued in the inotify handle until then
+    boost::thread(&NamespaceIndex::Watch, this).swap(watcher);
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    watching = true;
+}
+
+bool NamespaceIndex::Lookup(const std::string& path, unsigned int maxMatches,
+                            std::vector<std::string>& sharePaths) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    if (!usable || !watching)
+        return false;
+
+    sharePaths.clear();
+    std::tr1::unordered_map<std::string, Node>::const_iterator it = nodes.find(path);
+    if (it == nodes.end())
+        return true;
+    for (unsigned int i = 0; i < it->second.shares.size() && sharePaths.size() < maxMatches; ++i)
+        sharePaths.push_back(source + shareNames[it->second.shares[i]] + path);
+    return true;
+}
+
+bool NamespaceIndex::List(const std::string& path, std::vector<Entry>& entries) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    if (!usable || !watching)
+        return false;
+
+    entries.clear();
+    std::tr1::unordered_map<std::string, Node>::const_iterator it = nodes.find(path);
+    if (it == nodes.end() || it->second.type != DT_DIR)
+        return true;
+    entries.reserve(it->second.children.size());
+    BOOST_FOREACH(const std::string& child, it->second.children) {
+        std::tr1::unordered_map<std::string, Node>::const_iterator childNode
+                = nodes.find(Join(path, child.c_str()));
+        entries.push_back(Entry(child, childNode == nodes.end() ? (unsigned char)DT_UNKNOWN
+                                                                : childNode->second.type));
+    }
+    return true;
+}
+
+void NamespaceIndex::Build()
+{
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+        usable = false;
+        shareNames.clear();
+        nodes.clear();
+    }
+    watches.clear();
+    if (inotifyHandle != -1)
+        close(inotifyHandle);
+    inotifyHandle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyHandle == -1)
+        return;
+    sourceWatch = inotify_add_watch(inotifyHandle, source.c_str(), watchMask);
+    if (sourceWatch == -1)
+        return;
+
+    // walk all shares in parallel, they usually live on different disks
+    std::vector<std::string> names;
+    try {
+        Directory sourceDir(source);
+        for (struct dirent* entry = sourceDir.Readdir(); entry != NULL; entry = sourceDir.Readdir()) {
+            struct stat statBuf;
+            if (!IsDotDirectory(entry->d_name)
+                    && stat((source + entry->d_name).c_str(), &statBuf) == 0
+                    && S_ISDIR(statBuf.st_mode))
+                names.push_back(entry->d_name);
+        }
+    } catch (const std::exception& exc) {
+        return;
+    }
+
+    std::vector<boost::shared_ptr<Walk> > walks;
+    boost::thread_group threads;
+    for (ShareNumber share = 0; share < names.size(); ++share) {
+        walks.push_back(boost::make_shared<Walk>(inotifyHandle, source + names[share], share, "/"));
+        threads.create_thread(boost::bind(&Walk::Run, walks.back().get()));
+    }
+    threads.join_all();
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    shareNames = names;
+    usable = true;
+    for (ShareNumber share = 0; share < names.size(); ++share) {
+        Insert(share, "/", DT_DIR);
+        Merge(*walks[share]);
+    }
+}
+
+void NamespaceIndex::AddTree(ShareNumber share, const std::string& path)
+{
+    std::string shareRoot;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        shareRoot = source + shareNames[share];
+    }
+    Walk walk(inotifyHandle, shareRoot, share, path);
+    walk.Run();
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    Merge(walk);
+}
+
+void NamespaceIndex::Merge(const Walk& walk)
+{
+    typedef std::pair<std::string, unsigned char> PathType;
+    BOOST_FOREACH(const PathType& path, walk.paths)
+        Insert(walk.share, path.first, path.second);
+    typedef std::pair<int, std::string> WatchPath;
+    BOOST_FOREACH(const WatchPath& watch, walk.watched)
+        watches[watch.first] = std::make_pair(walk.share, watch.second);
+    if (walk.failed)
+        usable = false;
+}
+
+void NamespaceIndex::Insert(ShareNumber share, const std::string& path, unsigned char type)
+{
+    Node& node = nodes[path];
+    if (node.shares.empty()) {
+        node.type = type;
+        if (path != "/")
+            nodes[Parent(path)].children.insert(path.substr(path.rfind('/') + 1));
+    }
+    std::vector<ShareNumber>::iterator it = std::lower_bound(node.shares.begin(), node.shares.end(), share);
+    if (it == node.shares.end() || *it != share)
+        node.shares.insert(it, share);
+}
+
+void NamespaceIndex::Erase(ShareNumber share, const std::string& path)
+{
+    std::tr1::unordered_map<std::string, Node>::iterator it = nodes.find(path);
+    if (it == nodes.end())
+        return;
+    if (!std::binary_search(it->second.shares.begin(), it->second.shares.end(), share))
+        return;
+
+    const std::vector<std::string> children(it->second.children.begin(), it->second.children.end());
+    BOOST_FOREACH(const std::string& child, children)
+        Erase(share, Join(path, child.c_str()));
+
+    it = nodes.find(path);
+    std::vector<ShareNumber>& shares = it->second.shares;
+    shares.erase(std::lower_bound(shares.begin(), shares.end(), share));
+    if (shares.empty()) {
+        nodes.erase(it);
+        if (path != "/") {
+            std::tr1::unordered_map<std::string, Node>::iterator parent = nodes.find(Parent(path));
+            if (parent != nodes.end())
+                parent->second.children.erase(path.substr(path.rfind('/') + 1));
+        }
+    }
+}
+
+void NamespaceIndex::RemoveTree(ShareNumber share, const std::string& path)
+{
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+        Erase(share, path);
+    }
+    const std::string prefix = path == "/" ? path : path + "/";
+    for (std::tr1::unordered_map<int, std::pair<ShareNumber, std::string> >::iterator it = watches.begin();
+         it != watches.end();) {
+        if (it->second.first == share
+                && (it->second.second == path || it->second.second.compare(0, prefix.size(), prefix) == 0)) {
+            inotify_rm_watch(inotifyHandle, it->first);
+            it = watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void NamespaceIndex::AddShare(const std::string& name)
+{
+    ShareNumber share;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+        if (std::find(shareNames.begin(), shareNames.end(), name) != shareNames.end())
+            return;
+        share = shareNames.size();
+        shareNames.push_back(name);
+        Insert(share, "/", DT_DIR);
+    }
+    AddTree(share, "/");
+}
+
+void NamespaceIndex::RemoveShare(const std::string& name)
+{
+    ShareNumber share;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        std::vector<std::string>::const_iterator it = std::find(shareNames.begin(), shareNames.end(), name);
+        if (it == shareNames.end())
+            return;
+        share = it - shareNames.begin();
+    }
+    RemoveTree(share, "/");
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    // keep the number reserved, it is still used in the watches of the walks
+    shareNames[share] = std::string();
+}
+
+void NamespaceIndex::HandleEvents(const char* buffer, size_t size)
+{
+    const struct inotify_event* event;
+    for (const char* position = buffer; position < buffer + size;
+         position += sizeof(struct inotify_event) + event->len) {
+        event = reinterpret_cast<const struct inotify_event*>(position);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // we lost track, start over
+            Build();
+            return;
+        }
+        if (event->mask & IN_IGNORED) {
+            watches.erase(event->wd);
+            continue;
+        }
+        if (event->len == 0)
+            continue;
+
+        if (event->wd == sourceWatch) {
+            struct stat statBuf;
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO))
+                    && stat((source + event->name).c_str(), &statBuf) == 0 && S_ISDIR(statBuf.st_mode))
+                AddShare(event->name);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                RemoveShare(event->name);
+            continue;
+        }
+
+        std::tr1::unordered_map<int, std::pair<ShareNumber, std::string> >::const_iterator watch
+                = watches.find(event->wd);
+        if (watch == watches.end())
+            continue;
+        const ShareNumber share = watch->second.first;
+        const std::string path = Join(watch->second.second, event->name);
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            unsigned char type = DT_DIR;
+            if (!(event->mask & IN_ISDIR)) {
+                struct stat statBuf;
+                std::string absolutePath;
+                {
+                    boost::shared_lock<boost::shared_mutex> lock(mutex);
+                    absolutePath = source + shareNames[share] + path;
+                }
+                if (lstat(absolutePath.c_str(), &statBuf) == -1)
+                    continue;
+                type = IFTODT(statBuf.st_mode);
+            }
+            {
+                boost::unique_lock<boost::shared_mutex> lock(mutex);
+                Insert(share, path, type);
+            }
+            if (type == DT_DIR)
+                AddTree(share, path);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            RemoveTree(share, path);
+        }
+    }
+}
+
+void NamespaceIndex::Watch()
+{
+    // large enough for many events, aligned for struct inotify_event
+    std::vector<struct inotify_event> buffer((1 << 16) / sizeof(struct inotify_event));
+    const size_t bufferSize = buffer.size() * sizeof(struct inotify_event);
+    while (true) {
+        struct pollfd handles[2];
+        handles[0].fd = stopPipe[0];
+        handles[0].events = POLLIN;
+        handles[1].fd = inotifyHandle;
+        handles[1].events = POLLIN;
+        if (poll(handles, inotifyHandle == -1 ? 1 : 2, -1) == -1)
+            continue;
+        if (handles[0].revents != 0)
+            return;
+
+        const ssize_t sizeRead = read(inotifyHandle, &buffer[0], bufferSize);
+        if (sizeRead > 0)
+            HandleEvents(reinterpret_cast<const char*>(&buffer[0]), sizeRead);
+    }
+}
+
+std::string NamespaceIndex::Parent(const std::string& path)
+{
+    const std::string::size_type slash = path.rfind('/');
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+} // namespace ZFecFS
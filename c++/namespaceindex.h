@@ -0,0 +1,96 @@
+#ifndef ZFECFS_NAMESPACEINDEX_H
+#define ZFECFS_NAMESPACEINDEX_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <utility>
+#include <tr1/unordered_map>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Merged view of the directory trees of all shares in the source
+/// directory of the restore mount.
+///
+/// Records for every path which shares contain it, so that finding a file
+/// in the shares is a hash lookup instead of a series of lstat calls. The
+/// index is built at startup by walking all shares in parallel and kept up
+/// to date with inotify once Start is called. If the index cannot be kept up
+/// to date (e.g. when running out of inotify watches, or before Start), it
+/// reports itself as not usable and callers have to look at the shares
+/// themselves.
+class NamespaceIndex : boost::noncopyable
+{
+public:
+    typedef std::pair<std::string, unsigned char> Entry; // name and dirent type
+
+    explicit NamespaceIndex(const std::string& source);
+    ~NamespaceIndex();
+
+    /// Starts watching the shares for changes, the index is not usable
+    /// before.
+    void Start();
+
+    /// Returns false if the index is not usable. Otherwise fills sharePaths
+    /// with the absolute paths of path in at most maxMatches shares, which
+    /// is empty if no share contains path.
+    bool Lookup(const std::string& path, unsigned int maxMatches,
+                std::vector<std::string>& sharePaths) const;
+
+    /// Returns false if the index is not usable. Otherwise fills entries with
+    /// the merged contents of the directory path in all shares, which is
+    /// empty if no share contains a directory at path.
+    bool List(const std::string& path, std::vector<Entry>& entries) const;
+
+private:
+    typedef unsigned short ShareNumber;
+
+    class Node {
+    public:
+        Node() : type(0) {}
+        unsigned char type;
+        std::vector<ShareNumber> shares;
+        std::set<std::string> children;
+    };
+
+    class Walk;
+
+    void Build();
+    void AddTree(ShareNumber share, const std::string& path);
+    // Merge, Insert and Erase require the mutex to be locked exclusively
+    void Merge(const Walk& walk);
+    void Insert(ShareNumber share, const std::string& path, unsigned char type);
+    void Erase(ShareNumber share, const std::string& path);
+    void RemoveTree(ShareNumber share, const std::string& path);
+    void AddShare(const std::string& name);
+    void RemoveShare(const std::string& name);
+    void HandleEvents(const char* buffer, size_t size);
+    void Watch();
+    static std::string Parent(const std::string& path);
+
+    const std::string source; // must be /-terminated
+
+    mutable boost::shared_mutex mutex;
+    bool usable;
+    bool watching; // set by Start
+    std::vector<std::string> shareNames; // empty for removed shares
+    std::tr1::unordered_map<std::string, Node> nodes;
+
+    // only used by the constructor and the watching thread
+    int inotifyHandle;
+    int stopPipe[2];
+    int sourceWatch;
+    std::tr1::unordered_map<int, std::pair<ShareNumber, std::string> > watches;
+
+    boost::thread watcher;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_NAMESPACEINDEX_H
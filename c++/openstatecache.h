@@ -0,0 +1,176 @@
+#ifndef ZFECFS_OPENSTATECACHE_H
+#define ZFECFS_OPENSTATECACHE_H
+
+#include <time.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Keeps the state of opened files (file descriptors, parsed metadata, ...)
+/// around after they are released, so that it can be reused by the next
+/// open of the same file.
+///
+/// States are shared between all handles that use them. A state that is not
+/// used by any handle is dropped after idleTimeout seconds, or earlier if the
+/// cached states hold more than maxFiles file descriptors. Once started, the
+/// idle states are also dropped when nothing is opened anymore, so that they
+/// do not keep deleted files around.
+template <class Key, class State>
+class OpenStateCache : boost::noncopyable
+{
+public:
+    OpenStateCache(unsigned int maxFiles, unsigned int idleTimeout)
+        : maxFiles(maxFiles)
+        , idleTimeout(idleTimeout)
+        , files(0)
+        , stopping(false)
+    {}
+
+    ~OpenStateCache()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            stopping = true;
+            stop.notify_all();
+        }
+        if (sweeper.joinable())
+            sweeper.join();
+    }
+
+    /// Starts the thread that drops idle states.
+    void Start()
+    {
+        if (Enabled())
+            sweeper = boost::thread(boost::bind(&OpenStateCache::Sweep, this));
+    }
+
+    bool Enabled() const { return maxFiles > 0; }
+
+    /// Returns the cached state or an empty pointer, the caller has to check
+    /// whether it is still valid.
+    boost::shared_ptr<State> Get(const Key& key)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        Evict(maxExamined);
+        typename Index::iterator it = index.find(key);
+        if (it == index.end())
+            return boost::shared_ptr<State>();
+        it->second->lastUsed = time(NULL);
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->state;
+    }
+
+    /// Stores state, which holds numFiles file descriptors, replacing any
+    /// state stored under the same key.
+    void Put(const Key& key, const boost::shared_ptr<State>& state, unsigned int numFiles)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        typename Index::iterator it = index.find(key);
+        if (it != index.end())
+            Erase(it->second);
+
+        Entry entry;
+        entry.key = key;
+        entry.state = state;
+        entry.files = numFiles;
+        entry.lastUsed = time(NULL);
+        entries.push_front(entry);
+        index[key] = entries.begin();
+        files += numFiles;
+
+        Evict(maxExamined);
+    }
+
+    void Remove(const Key& key)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        typename Index::iterator it = index.find(key);
+        if (it != index.end())
+            Erase(it->second);
+    }
+
+    void Clear()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        index.clear();
+        entries.clear();
+        files = 0;
+    }
+
+private:
+    class Entry {
+    public:
+        Key key;
+        boost::shared_ptr<State> state;
+        unsigned int files;
+        time_t lastUsed;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<Key, typename EntryList::iterator> Index;
+
+    void Sweep()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!stopping) {
+            stop.timed_wait(lock, boost::posix_time::seconds(std::max(idleTimeout, 1u)));
+            Evict(entries.size());
+        }
+    }
+
+    /// Looks at the examine least recently used entries only, so that
+    /// every call does a bounded amount of work.
+    void Evict(size_t examine)
+    {
+        const time_t now = time(NULL);
+        for (size_t examined = 0; examined < examine && !entries.empty(); ++examined) {
+            Entry& oldest = entries.back();
+            const bool expired = now - oldest.lastUsed >= time_t(idleTimeout);
+            if (!expired && files <= maxFiles)
+                break;
+            if (!oldest.state.unique()) {
+                // still open, look at it again later
+                oldest.lastUsed = now;
+                entries.splice(entries.begin(), entries, --entries.end());
+                continue;
+            }
+            Erase(--entries.end());
+        }
+    }
+
+    void Erase(typename EntryList::iterator entry)
+    {
+        files -= entry->files;
+        index.erase(entry->key);
+        entries.erase(entry);
+    }
+
+    const static unsigned int maxExamined = 16;
+
+    const unsigned int maxFiles;
+    const unsigned int idleTimeout;
+
+    boost::mutex mutex;
+    EntryList entries; // most recently used first
+    Index index;
+    unsigned int files;
+    bool stopping;
+    boost::condition_variable stop;
+    boost::thread sweeper;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_OPENSTATECACHE_H
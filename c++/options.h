@@ -0,0 +1,253 @@
+#ifndef ZFECFS_OPTIONS_H
+#define ZFECFS_OPTIONS_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <boost/thread/thread.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+/// Settings that are given as '-o name=value' mount options next to the
+/// options understood by fuse itself.
+class Options
+{
+public:
+    Options()
+        : blockCacheSize(64 << 20)
+        , parityScanInterval(3600)
+        , mappedFiles(false)
+        , directSourceReads(false)
+        , openCacheFiles(1024)
+        , openCacheIdleTime(60)
+        , namespaceIndex(false)
+        , sizeCacheEntries(65536)
+        , manifests(false)
+        , prefetchThreads(8)
+        , watchSource(false)
+        , cacheTimeout(0)
+        , blockSumsBlockSize(0)
+        , lowLevel(false)
+        , computeThreads(boost::thread::hardware_concurrency())
+        , stripeCacheSize(0)
+        , ioQueueDepth(0)
+        , fastestShares(false)
+        , hedgeThreads(0)
+        , smallFileSize(16 << 10)
+        , smallFileCacheSize(16 << 20)
+        , packedFileSize(0)
+    {}
+
+    /// Size in bytes of the decoded-block cache of the restore mount, 0 disables it.
+    size_t blockCacheSize;
+    /// Directory for precomputed parity shares, empty if parity shares are not cached.
+    std::string parityCacheDirectory;
+    /// Seconds between scans of the source for changed files to precompute
+    /// parity shares of, 0 to only precompute on cache misses.
+    unsigned int parityScanInterval;
+    /// Read source and share files through memory mappings instead of pread.
+    bool mappedFiles;
+    /// Read source files with O_DIRECT and do not let the kernel cache
+    /// encoded shares either.
+    bool directSourceReads;
+    /// Maximum number of file descriptors kept open for released files, 0
+    /// disables reusing the state of released files.
+    unsigned int openCacheFiles;
+    /// Seconds after which the state of a released file is dropped.
+    unsigned int openCacheIdleTime;
+    /// Keep an index of the directory trees of all shares in the restore
+    /// mount instead of looking at every share on each lookup.
+    bool namespaceIndex;
+    /// Number of decoded file sizes the restore mount remembers, 0 disables it.
+    size_t sizeCacheEntries;
+    /// Serve a manifest in every directory of the share views, or use these
+    /// manifests in the restore mount.
+    bool manifests;
+    /// Number of threads reading the sizes of the files in directories
+    /// opened in the restore mount ahead of getattr, 0 disables prefetching.
+    unsigned int prefetchThreads;
+    /// Watch the source of the encoder for changes, so that stale cached
+    /// encoded data is dropped.
+    bool watchSource;
+    /// Seconds the kernel may cache attributes and lookups, 0 to keep the
+    /// defaults of fuse.
+    unsigned int cacheTimeout;
+    /// File the encoder records changes of the source in, empty to not
+    /// keep a journal.
+    std::string journalPath;
+    /// Block size of the sums the encoder serves next to each share, 0 to
+    /// not serve sums.
+    size_t blockSumsBlockSize;
+    /// Serve the mount with the inode based low-level API of fuse.
+    bool lowLevel;
+    /// Number of threads large reads are encoded or decoded on, less than
+    /// two to keep each read on the thread that serves it.
+    unsigned int computeThreads;
+    /// Share indices the encoder serves, empty to serve all of them.
+    std::vector<bool> servedShares;
+    /// Size in bytes of the stripe cache shared by all encoder processes,
+    /// 0 to not use it.
+    size_t stripeCacheSize;
+    /// Number of reads of source or share files per device at a time, 0
+    /// for no limit.
+    unsigned int ioQueueDepth;
+    /// Bytes per second reads of the foreground, prefetch and background
+    /// classes of the IoScheduler may use, 0 or missing for no limit.
+    std::vector<size_t> ioRates;
+    /// Decode from the shares in the share directories with the lowest read
+    /// latency instead of the first ones found.
+    bool fastestShares;
+    /// Number of threads the restore mount reads shares on to hedge slow
+    /// reads with reads of spare shares, 0 to not hedge.
+    unsigned int hedgeThreads;
+    /// Source files of at most this many bytes are encoded into all their
+    /// shares at once when the first share is opened, 0 to disable it.
+    size_t smallFileSize;
+    /// Size in bytes of the cache of the shares of small files, 0 disables it.
+    size_t smallFileCacheSize;
+    /// Regular files of at most this many bytes are served in one pack file
+    /// per directory instead of one share file each, and are looked for in
+    /// these packs by the restore mount. 0 to not use packs.
+    size_t packedFileSize;
+
+    bool SchedulesIo() const
+    {
+        return ioQueueDepth > 0 || std::count(ioRates.begin(), ioRates.end(), 0) < int(ioRates.size());
+    }
+
+    bool ServesShare(unsigned int index) const
+    {
+        return servedShares.empty() || (index < servedShares.size() && servedShares[index]);
+    }
+
+    /// Parses a single 'name=value' option and returns false if it is not
+    /// one of ours (and should be passed on to fuse).
+    /// @throws SimpleException if the value cannot be parsed
+    bool Parse(const std::string& option)
+    {
+        const std::string::size_type equals = option.find('=');
+        const std::string name = option.substr(0, equals);
+        const std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (name == "block_cache") {
+            blockCacheSize = ParseSize(value);
+        } else if (name == "parity_cache") {
+            parityCacheDirectory = value;
+        } else if (name == "parity_scan") {
+            parityScanInterval = ParseNumber(value);
+        } else if (name == "mmap") {
+            mappedFiles = true;
+        } else if (name == "direct_source") {
+            directSourceReads = true;
+        } else if (name == "open_cache") {
+            openCacheFiles = ParseNumber(value);
+        } else if (name == "open_cache_idle") {
+            openCacheIdleTime = ParseNumber(value);
+        } else if (name == "namespace_index") {
+            namespaceIndex = true;
+        } else if (name == "size_cache") {
+            sizeCacheEntries = ParseNumber(value);
+        } else if (name == "manifests") {
+            manifests = true;
+        } else if (name == "prefetch") {
+            prefetchThreads = ParseNumber(value);
+        } else if (name == "watch_source") {
+            watchSource = true;
+        } else if (name == "cache_timeout") {
+            cacheTimeout = ParseNumber(value);
+        } else if (name == "journal") {
+            journalPath = value;
+        } else if (name == "block_sums") {
+            blockSumsBlockSize = ParseSize(value);
+        } else if (name == "lowlevel") {
+            lowLevel = true;
+        } else if (name == "compute_threads") {
+            computeThreads = ParseNumber(value);
+        } else if (name == "shares") {
+            servedShares = ParseIndexList(value);
+        } else if (name == "stripe_cache") {
+            stripeCacheSize = ParseSize(value);
+        } else if (name == "io_depth") {
+            ioQueueDepth = ParseNumber(value);
+        } else if (name == "io_rates") {
+            ioRates.clear();
+            std::istringstream s(value);
+            std::string rate;
+            while (std::getline(s, rate, ':'))
+                ioRates.push_back(ParseSize(rate));
+        } else if (name == "fastest_shares") {
+            fastestShares = true;
+        } else if (name == "hedge_threads") {
+            hedgeThreads = ParseNumber(value);
+        } else if (name == "small_files") {
+            smallFileSize = ParseSize(value);
+        } else if (name == "small_file_cache") {
+            smallFileCacheSize = ParseSize(value);
+        } else if (name == "pack_small") {
+            packedFileSize = ParseSize(value);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static unsigned int ParseNumber(const std::string& value)
+    {
+        std::istringstream s(value);
+        unsigned int number = 0;
+        s >> number;
+        if (s.fail() || !s.eof())
+            throw SimpleException("Invalid number.");
+        return number;
+    }
+
+    /// Parses a ':'-separated list of indices and ranges like '0-3:7' (',' separates the
+    /// mount options already).
+    static std::vector<bool> ParseIndexList(const std::string& value)
+    {
+        std::vector<bool> indices(256, false);
+        std::istringstream s(value);
+        std::string item;
+        while (std::getline(s, item, ':')) {
+            const std::string::size_type dash = item.find('-');
+            const unsigned int first = ParseNumber(item.substr(0, dash));
+            const unsigned int last = dash == std::string::npos ? first : ParseNumber(item.substr(dash + 1));
+            if (first > last || last >= indices.size())
+                throw SimpleException("Invalid share index.");
+            for (unsigned int index = first; index <= last; ++index)
+                indices[index] = true;
+        }
+        return indices;
+    }
+
+    /// Parses a size with an optional K, M or G suffix.
+    static size_t ParseSize(const std::string& value)
+    {
+        std::istringstream s(value);
+        size_t size = 0;
+        s >> size;
+        if (s.fail())
+            throw SimpleException("Invalid size.");
+        char suffix = 0;
+        s >> suffix;
+        switch (suffix) {
+        case 0:                     break;
+        case 'k': case 'K':         size <<= 10; break;
+        case 'm': case 'M':         size <<= 20; break;
+        case 'g': case 'G':         size <<= 30; break;
+        default: throw SimpleException("Invalid size suffix.");
+        }
+        return size;
+    }
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_OPTIONS_H
@@ -0,0 +1,183 @@
+#include "pack.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const char magic[] = "zfecfs-pack 1\n";
+const size_t magicSize = sizeof(magic) - 1;
+/// Limit on the size of the index read before it is known to be valid.
+const size_t maxIndexSize = 256 << 20;
+
+bool NameLess(const Pack::Entry& a, const Pack::Entry& b)
+{
+    return a.name < b.name;
+}
+
+// all numbers are stored little endian
+
+void Put(char*& data, uint64_t value, unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; ++i)
+        *data++ = char(value >> (8 * i));
+}
+
+uint64_t Get(const char*& data, unsigned int bytes)
+{
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < bytes; ++i)
+        value |= uint64_t((unsigned char)*data++) << (8 * i);
+    return value;
+}
+
+} // anonymous namespace
+
+const char* const Pack::fileName = ".zfecfs-pack";
+// magic, number of entries, size of the names
+const size_t Pack::headerSize = magicSize + 4 + 4;
+// mode, uid, gid, mtime seconds and nanoseconds, offset, size, name offset and length
+const size_t Pack::recordSize = 4 + 4 + 4 + 8 + 4 + 8 + 8 + 4 + 4;
+
+void Pack::Entry::ToStat(struct stat& statBuf) const
+{
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = mode;
+    statBuf.st_nlink = 1;
+    statBuf.st_uid = uid;
+    statBuf.st_gid = gid;
+    statBuf.st_size = size;
+    statBuf.st_blocks = (size + 511) / 512;
+    statBuf.st_mtim = mtime;
+    statBuf.st_ctim = mtime;
+    statBuf.st_atim = mtime;
+}
+
+void Pack::Add(const std::string& name, const struct stat& statBuf)
+{
+    Entry entry;
+    entry.name = name;
+    entry.mode = statBuf.st_mode;
+    entry.uid = statBuf.st_uid;
+    entry.gid = statBuf.st_gid;
+    entry.mtime = statBuf.st_mtim;
+    entry.size = statBuf.st_size;
+    entries.push_back(entry);
+}
+
+void Pack::Sort()
+{
+    std::sort(entries.begin(), entries.end(), NameLess);
+    namesSize = 0;
+    BOOST_FOREACH(const Entry& entry, entries)
+        namesSize += entry.name.size();
+    off_t offset = headerSize + entries.size() * recordSize + namesSize;
+    BOOST_FOREACH(Entry& entry, entries) {
+        entry.offset = offset;
+        offset += entry.size;
+    }
+}
+
+const Pack::Entry* Pack::Find(const std::string& name) const
+{
+    Entry key;
+    key.name = name;
+    std::vector<Entry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), key, NameLess);
+    if (it == entries.end() || it->name != name)
+        return NULL;
+    return &*it;
+}
+
+off_t Pack::Size() const
+{
+    if (entries.empty())
+        return headerSize;
+    return entries.back().offset + entries.back().size;
+}
+
+std::string Pack::Serialize(const FileReader& read) const
+{
+    // one byte more for the read of the last file, see below
+    std::string data(Size() + 1, '\0');
+    char* out = &data[0];
+    memcpy(out, magic, magicSize);
+    out += magicSize;
+    Put(out, entries.size(), 4);
+    Put(out, namesSize, 4);
+
+    char* names = out + entries.size() * recordSize;
+    size_t nameOffset = 0;
+    BOOST_FOREACH(const Entry& entry, entries) {
+        Put(out, entry.mode, 4);
+        Put(out, entry.uid, 4);
+        Put(out, entry.gid, 4);
+        Put(out, entry.mtime.tv_sec, 8);
+        Put(out, entry.mtime.tv_nsec, 4);
+        Put(out, entry.offset, 8);
+        Put(out, entry.size, 8);
+        Put(out, nameOffset, 4);
+        Put(out, entry.name.size(), 4);
+        memcpy(names + nameOffset, entry.name.data(), entry.name.size());
+        nameOffset += entry.name.size();
+    }
+
+    // one byte more to notice a file that grew, it is overwritten by the
+    // next file
+    BOOST_FOREACH(const Entry& entry, entries) {
+        if (read(entry.name, &data[entry.offset], entry.size + 1) != ssize_t(entry.size))
+            throw SimpleException("Packed file changed.");
+    }
+    data.resize(Size());
+    return data;
+}
+
+Pack Pack::ParseIndex(const PackReader& read)
+{
+    char header[headerSize];
+    if (read(header, headerSize, 0) != int(headerSize) || memcmp(header, magic, magicSize) != 0)
+        throw SimpleException("Not a pack.");
+    const char* in = header + magicSize;
+    const size_t count = Get(in, 4);
+    Pack pack;
+    pack.namesSize = Get(in, 4);
+    const uint64_t indexSize = uint64_t(count) * recordSize + pack.namesSize;
+    if (indexSize > maxIndexSize)
+        throw SimpleException("Invalid pack index.");
+
+    std::vector<char> index(indexSize);
+    if (indexSize > 0 && read(index.data(), index.size(), headerSize) != int(index.size()))
+        throw SimpleException("Invalid pack index.");
+    const char* names = index.data() + count * recordSize;
+    in = index.data();
+    pack.entries.resize(count);
+    BOOST_FOREACH(Entry& entry, pack.entries) {
+        entry.mode = Get(in, 4);
+        entry.uid = Get(in, 4);
+        entry.gid = Get(in, 4);
+        entry.mtime.tv_sec = Get(in, 8);
+        entry.mtime.tv_nsec = Get(in, 4);
+        entry.offset = Get(in, 8);
+        entry.size = Get(in, 8);
+        const size_t nameOffset = Get(in, 4);
+        const size_t nameLength = Get(in, 4);
+        if (nameOffset + nameLength > pack.namesSize || entry.offset < off_t(headerSize + indexSize)
+                || entry.size < 0)
+            throw SimpleException("Invalid pack index.");
+        entry.name.assign(names + nameOffset, nameLength);
+    }
+    for (size_t i = 1; i < count; ++i) {
+        if (!NameLess(pack.entries[i - 1], pack.entries[i]))
+            throw SimpleException("Invalid pack index.");
+    }
+    return pack;
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,83 @@
+#ifndef ZFECFS_PACK_H
+#define ZFECFS_PACK_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+namespace ZFecFS {
+
+/// Container for the small files of a directory. The encoder serves it
+/// as one additional file in every directory of the share views, encoded
+/// like any source file, instead of a share file for each small file, and
+/// the restore mount shows the files in it in place of the container.
+///
+/// The container starts with an index of fixed size records sorted by
+/// name, followed by the names and then the contents of the files, so that
+/// the restore mount only has to read the index to find a file.
+class Pack
+{
+public:
+    /// Name of the pack file inside each directory.
+    static const char* const fileName;
+
+    /// Reads the file name (in the packed directory) into buffer, returns
+    /// the number of bytes read.
+    typedef boost::function<ssize_t (const std::string& name, char* buffer, size_t size)> FileReader;
+    /// Reads from the pack file itself.
+    typedef boost::function<int (char* buffer, size_t size, off_t offset)> PackReader;
+
+    /// Bytes of the header of the pack and of each record of its index,
+    /// without the name.
+    static const size_t headerSize;
+    static const size_t recordSize;
+
+    Pack() : namesSize(0) {}
+
+    class Entry {
+    public:
+        Entry() : mode(0), uid(0), gid(0), offset(0), size(0) { mtime.tv_sec = mtime.tv_nsec = 0; }
+
+        std::string name;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        struct timespec mtime;
+        off_t offset; // of the contents in the pack
+        off_t size;
+
+        void ToStat(struct stat& statBuf) const;
+    };
+
+    /// Adds the file described by statBuf.
+    void Add(const std::string& name, const struct stat& statBuf);
+
+    /// Sorts the entries by name and lays out their contents, must be
+    /// called before Find, Size and Serialize.
+    void Sort();
+    const Entry* Find(const std::string& name) const;
+    const std::vector<Entry>& Entries() const { return entries; }
+
+    /// Size in bytes of the serialized pack.
+    off_t Size() const;
+    /// Returns the pack with the contents of the files read by read.
+    /// @throws SimpleException if a file cannot be read or its size changed
+    /// since it was added
+    std::string Serialize(const FileReader& read) const;
+    /// Reads the index of the pack, not the contents of the files.
+    /// @throws SimpleException if read does not return a valid pack
+    static Pack ParseIndex(const PackReader& read);
+
+private:
+    std::vector<Entry> entries;
+    size_t namesSize;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_PACK_H
@@ -0,0 +1,359 @@
+#include "paritycache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/conversion.hpp>
+
+#include "utils.h"
+#include "directory.h"
+#include "fileencoder.h"
+
+namespace ZFecFS {
+
+ParityCache::Stamp::Stamp()
+    : inode(0), size(0), mtimeSec(0), mtimeNsec(0), ctimeSec(0), ctimeNsec(0)
+{}
+
+ParityCache::Stamp::Stamp(const struct stat& statBuf)
+    : inode(statBuf.st_ino)
+    , size(statBuf.st_size)
+    , mtimeSec(statBuf.st_mtim.tv_sec)
+    , mtimeNsec(statBuf.st_mtim.tv_nsec)
+    , ctimeSec(statBuf.st_ctim.tv_sec)
+    , ctimeNsec(statBuf.st_ctim.tv_nsec)
+{}
+
+bool ParityCache::Stamp::operator==(const Stamp& other) const
+{
+    return inode == other.inode && size == other.size
+            && mtimeSec == other.mtimeSec && mtimeNsec == other.mtimeNsec
+            && ctimeSec == other.ctimeSec && ctimeNsec == other.ctimeNsec;
+}
+
+/// Share data as stored in the cache, i.e. without the trailing stamp.
+class ParityCache::CachedShare : public AbstractFile
+{
+public:
+    explicit CachedShare(const std::string& path)
+        : file(path)
+        , dataSize(file.Size() - off_t(sizeof(Stamp)))
+    {}
+
+    bool Matches(const Stamp& stamp) const
+    {
+        if (dataSize < off_t(Metadata::size))
+            return false;
+        Stamp cached;
+        if (file.Read(reinterpret_cast<char*>(&cached), sizeof(cached), dataSize)
+                != ssize_t(sizeof(cached)))
+            return false;
+        return cached == stamp;
+    }
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        if (offset >= dataSize)
+            return 0;
+        return file.Read(buffer, std::min<off_t>(size, dataSize - offset), offset);
+    }
+
+    virtual off_t Size() const
+    {
+        return dataSize;
+    }
+
+    virtual bool Stat(struct stat& statBuf) const
+    {
+        return file.Stat(statBuf);
+    }
+
+private:
+    const File file;
+    const off_t dataSize;
+};
+
+ParityCache::ParityCache(const std::string& directory,
+                         const std::string& source,
+                         unsigned int scanInterval,
+                         unsigned int numShares,
+                         const FecWrapper& fecWrapper,
+                         IoScheduler* ioScheduler)
+    : directory(directory[directory.size() - 1] == '/' ? directory : directory + "/")
+    , source(source)
+    , scanInterval(scanInterval)
+    , numShares(numShares)
+    , fecWrapper(fecWrapper)
+    , ioScheduler(ioScheduler)
+    , stopping(false)
+{
+    if (stat(this->directory.c_str(), &directoryStat) == -1 || !S_ISDIR(directoryStat.st_mode))
+        throw SimpleException("Parity cache directory does not exist.");
+}
+
+void ParityCache::Start()
+{
+    boost::thread(&ParityCache::Work, this).swap(worker);
+}
+
+ParityCache::~ParityCache()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+boost::shared_ptr<AbstractFile> ParityCache::Open(const std::string& sourcePath,
+                                                  const AbstractFile& sourceFile,
+                                                  DecodedPath::ShareIndex shareIndex)
+{
+    struct stat sourceStat;
+    if (!sourceFile.Stat(sourceStat))
+        return boost::shared_ptr<AbstractFile>();
+
+    try {
+        boost::shared_ptr<CachedShare> cached
+                = boost::make_shared<CachedShare>(CachePath(sourceStat, shareIndex));
+        if (cached->Matches(Stamp(sourceStat)))
+            return cached;
+        // computed from an older version of the source, do not keep it around
+        unlink(CachePath(sourceStat, shareIndex).c_str());
+    } catch (const std::exception& exc) {
+        // not cached yet
+    }
+    Schedule(sourcePath);
+    return boost::shared_ptr<AbstractFile>();
+}
+
+std::string ParityCache::CachePath(const struct stat& sourceStat,
+                                   DecodedPath::ShareIndex shareIndex) const
+{
+    char index[3];
+    DecodedPath::EncodeShareIndex(shareIndex, &(index[0]));
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%02x/%llx-%llx", index,
+             (unsigned int)(sourceStat.st_ino & 0xff),
+             (unsigned long long)sourceStat.st_dev,
+             (unsigned long long)sourceStat.st_ino);
+    return directory + name;
+}
+
+bool ParityCache::IsCached(const std::string& cachePath, const Stamp& stamp) const
+{
+    try {
+        return CachedShare(cachePath).Matches(stamp);
+    } catch (const std::exception& exc) {
+        return false;
+    }
+}
+
+void ParityCache::Schedule(const std::string& sourcePath)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (queue.size() >= maxQueueSize || !queued.insert(sourcePath).second)
+            return;
+        queue.push_back(sourcePath);
+    }
+    queueChanged.notify_one();
+}
+
+void ParityCache::Precompute(const std::string& sourcePath)
+{
+    boost::shared_ptr<AbstractFile> sourceFile = boost::make_shared<File>(sourcePath);
+    if (ioScheduler != NULL)
+        sourceFile = boost::make_shared<ScheduledFile>(sourceFile, *ioScheduler);
+    struct stat before;
+    sourceFile->Stat(before);
+    if (!S_ISREG(before.st_mode))
+        return;
+    const Stamp stamp(before);
+
+    std::vector<std::pair<std::string, std::string> > written;
+    bool success = true;
+    for (DecodedPath::ShareIndex shareIndex = fecWrapper.GetSharesRequired();
+         success && shareIndex < numShares; ++shareIndex) {
+        const std::string cachePath = CachePath(before, shareIndex);
+        if (IsCached(cachePath, stamp))
+            continue;
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".tmp%d", int(getpid()));
+        const std::string temporaryPath = cachePath + suffix;
+        written.push_back(std::make_pair(temporaryPath, cachePath));
+        success = WriteShare(sourceFile, shareIndex, stamp, temporaryPath);
+    }
+
+    // only publish the shares if the source did not change while encoding
+    struct stat after;
+    sourceFile->Stat(after);
+    success = success && Stamp(after) == stamp;
+
+    typedef std::pair<std::string, std::string> PathPair;
+    BOOST_FOREACH(const PathPair& paths, written) {
+        if (!success || rename(paths.first.c_str(), paths.second.c_str()) == -1)
+            unlink(paths.first.c_str());
+    }
+}
+
+bool ParityCache::WriteShare(const boost::shared_ptr<AbstractFile>& sourceFile,
+                             DecodedPath::ShareIndex shareIndex,
+                             const Stamp& stamp, const std::string& path)
+{
+    // create the two directory levels above the share on demand
+    for (std::string::size_type slash = path.find('/', directory.size());
+         slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        if (mkdir(path.substr(0, slash).c_str(), 0755) == -1 && errno != EEXIST)
+            return false;
+    }
+
+    const int handle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (handle == -1)
+        return false;
+
+    FileEncoder encoder(sourceFile, shareIndex, fecWrapper);
+    const off_t encodedSize = FileEncoder::Size(stamp.size, fecWrapper.GetSharesRequired());
+    std::vector<char> buffer(1 << 20);
+    off_t offset = 0;
+    bool success = true;
+    while (success && offset < encodedSize) {
+        const int sizeRead = encoder.Read(buffer.data(), buffer.size(), offset);
+        success = sizeRead > 0 && write(handle, buffer.data(), sizeRead) == sizeRead;
+        offset += sizeRead;
+    }
+    success = success && offset == encodedSize
+            && write(handle, &stamp, sizeof(stamp)) == ssize_t(sizeof(stamp));
+    return close(handle) == 0 && success;
+}
+
+bool ParityCache::Scan(const std::string& directoryPath, time_t since,
+                       std::vector<std::pair<dev_t, ino_t> >& live)
+{
+    bool complete = true;
+    try {
+        Directory dir(directoryPath);
+        std::string path = directoryPath;
+        for (struct dirent* entry = dir.Readdir(); entry != NULL; entry = dir.Readdir()) {
+            if (IsDotDirectory(entry->d_name))
+                continue;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (stopping)
+                    return false;
+            }
+            path.resize(directoryPath.size());
+            path.append(entry->d_name);
+
+            struct stat statBuf;
+            if (lstat(path.c_str(), &statBuf) == -1)
+                continue;
+            if (S_ISDIR(statBuf.st_mode)) {
+                if (statBuf.st_dev != directoryStat.st_dev || statBuf.st_ino != directoryStat.st_ino)
+                    complete = Scan(path + "/", since, live) && complete;
+            } else if (S_ISREG(statBuf.st_mode)) {
+                live.push_back(std::make_pair(statBuf.st_dev, statBuf.st_ino));
+                if (statBuf.st_ctime < since)
+                    continue;
+                try {
+                    Precompute(path);
+                } catch (const std::exception& exc) {
+                    continue;
+                }
+            }
+        }
+    } catch (const std::exception& exc) {
+        return false;
+    }
+    return complete;
+}
+
+void ParityCache::Prune(const std::vector<std::pair<dev_t, ino_t> >& live)
+{
+    // the cache holds <index>/<low byte of inode>/<device>-<inode> for each parity share
+    for (DecodedPath::ShareIndex shareIndex = fecWrapper.GetSharesRequired(); shareIndex < numShares; ++shareIndex) {
+        char index[3];
+        DecodedPath::EncodeShareIndex(shareIndex, &(index[0]));
+        for (unsigned int bucket = 0; bucket < 256; ++bucket) {
+            char name[16];
+            snprintf(name, sizeof(name), "%s/%02x/", index, bucket);
+            const std::string bucketPath = directory + name;
+            try {
+                Directory dir(bucketPath);
+                for (struct dirent* entry = dir.Readdir(); entry != NULL; entry = dir.Readdir()) {
+                    unsigned long long device;
+                    unsigned long long inode;
+                    int length = 0;
+                    // temporary files are removed by the process writing them
+                    if (sscanf(entry->d_name, "%llx-%llx%n", &device, &inode, &length) != 2
+                            || entry->d_name[length] != '\0')
+                        continue;
+                    if (!std::binary_search(live.begin(), live.end(),
+                                            std::make_pair(dev_t(device), ino_t(inode))))
+                        unlink((bucketPath + entry->d_name).c_str());
+                }
+            } catch (const std::exception& exc) {
+                continue;
+            }
+        }
+    }
+}
+
+void ParityCache::Work()
+{
+    IoScheduler::ClassScope background(IoScheduler::background);
+    time_t lastScan = time(NULL) - scanInterval;
+    while (true) {
+        std::string path;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!stopping && queue.empty()
+                   && (scanInterval == 0 || time(NULL) < lastScan + time_t(scanInterval))) {
+                if (scanInterval == 0)
+                    queueChanged.wait(lock);
+                else
+                    queueChanged.timed_wait(lock, boost::posix_time::from_time_t(lastScan + scanInterval));
+            }
+            if (stopping)
+                return;
+            if (!queue.empty()) {
+                path = queue.front();
+                queue.pop_front();
+                queued.erase(path);
+            }
+        }
+
+        if (!path.empty()) {
+            try {
+                Precompute(path);
+            } catch (const std::exception& exc) {
+                continue;
+            }
+        } else {
+            const time_t scanStart = time(NULL);
+            std::vector<std::pair<dev_t, ino_t> > live;
+            // a scan that could not list everything does not know which files are gone
+            if (Scan(source, lastScan, live)) {
+                std::sort(live.begin(), live.end());
+                Prune(live);
+            }
+            lastScan = scanStart;
+        }
+    }
+}
+
+} // namespace ZFecFS
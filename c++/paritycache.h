@@ -0,0 +1,110 @@
+#ifndef ZFECFS_PARITYCACHE_H
+#define ZFECFS_PARITYCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <string>
+#include <deque>
+#include <set>
+#include <vector>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+#include "fecwrapper.h"
+#include "decodedpath.h"
+#include "file.h"
+#include "ioscheduler.h"
+
+namespace ZFecFS {
+
+/// On-disk cache of encoded parity shares.
+///
+/// For every source file and parity share index, the cache directory holds
+/// the exact contents of the share followed by a stamp of the source file
+/// (inode, size, mtime and ctime) it was computed from, so that a valid
+/// cached share can be served by a plain pread. Shares are computed by a
+/// background worker, both for files that missed the cache on open and for
+/// files that were changed recently. Each scan also removes the cached
+/// shares of source files that no longer exist.
+class ParityCache : boost::noncopyable
+{
+public:
+    ParityCache(const std::string& directory,
+                const std::string& source,
+                unsigned int scanInterval,
+                unsigned int numShares,
+                const FecWrapper& fecWrapper,
+                IoScheduler* ioScheduler = NULL);
+    ~ParityCache();
+
+    /// Starts the background worker, shares are only computed after that.
+    void Start();
+
+    /// Returns the cached share for the given source file or an empty
+    /// pointer (and schedules its computation) if there is no valid one.
+    boost::shared_ptr<AbstractFile> Open(const std::string& sourcePath,
+                                         const AbstractFile& sourceFile,
+                                         DecodedPath::ShareIndex shareIndex);
+
+private:
+    class Stamp {
+    public:
+        uint64_t inode;
+        uint64_t size;
+        uint64_t mtimeSec;
+        uint64_t mtimeNsec;
+        uint64_t ctimeSec;
+        uint64_t ctimeNsec;
+
+        Stamp();
+        explicit Stamp(const struct stat& statBuf);
+        bool operator==(const Stamp& other) const;
+    };
+
+    class CachedShare;
+
+    std::string CachePath(const struct stat& sourceStat, DecodedPath::ShareIndex shareIndex) const;
+    bool IsCached(const std::string& cachePath, const Stamp& stamp) const;
+    void Schedule(const std::string& sourcePath);
+    void Precompute(const std::string& sourcePath);
+    bool WriteShare(const boost::shared_ptr<AbstractFile>& sourceFile,
+                    DecodedPath::ShareIndex shareIndex,
+                    const Stamp& stamp, const std::string& path);
+    /// Precomputes the files changed since the given time and collects the
+    /// device and inode of all regular files in live. Returns false if not
+    /// all of directory could be listed.
+    bool Scan(const std::string& directory, time_t since, std::vector<std::pair<dev_t, ino_t> >& live);
+    /// Removes the cached shares of source files that are not in live
+    /// (sorted).
+    void Prune(const std::vector<std::pair<dev_t, ino_t> >& live);
+    void Work();
+
+    const static size_t maxQueueSize = 65536;
+
+    const std::string directory; // must be /-terminated
+    const std::string source;
+    const unsigned int scanInterval;
+    const unsigned int numShares;
+    const FecWrapper& fecWrapper;
+    IoScheduler* const ioScheduler; // for the reads of the source
+    struct stat directoryStat;
+
+    boost::mutex mutex;
+    boost::condition_variable queueChanged;
+    std::deque<std::string> queue;
+    std::set<std::string> queued;
+    bool stopping;
+
+    boost::thread worker;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_PARITYCACHE_H
@@ -0,0 +1,66 @@
+#include "prefetcher.h"
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace ZFecFS {
+
+Prefetcher::Prefetcher(unsigned int numThreads, size_t maxQueueSize, const Fetch& fetch)
+    : numThreads(numThreads)
+    , maxQueueSize(maxQueueSize)
+    , fetch(fetch)
+    , stopping(false)
+{}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    workers.join_all();
+}
+
+void Prefetcher::Start()
+{
+    for (unsigned int i = 0; i < numThreads; ++i)
+        workers.create_thread(boost::bind(&Prefetcher::Work, this));
+}
+
+bool Prefetcher::Enqueue(const std::string& path)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (queue.size() >= maxQueueSize)
+            return false;
+        if (!queued.insert(path).second)
+            return true;
+        queue.push_back(path);
+    }
+    queueChanged.notify_one();
+    return true;
+}
+
+void Prefetcher::Work()
+{
+    while (true) {
+        std::string path;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!stopping && queue.empty())
+                queueChanged.wait(lock);
+            if (stopping)
+                return;
+            path = queue.front();
+            queue.pop_front();
+        }
+
+        fetch(path);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        queued.erase(path);
+    }
+}
+
+} // namespace ZFecFS
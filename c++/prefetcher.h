@@ -0,0 +1,55 @@
+#ifndef ZFECFS_PREFETCHER_H
+#define ZFECFS_PREFETCHER_H
+
+#include <string>
+#include <deque>
+#include <tr1/unordered_set>
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Runs a fetch function for queued paths on a pool of background threads,
+/// so that work a caller is about to need is done in parallel before it
+/// asks for it.
+///
+/// The queue is bounded, paths queued while it is full are dropped. Paths
+/// queued before Start wait for the threads to be started.
+class Prefetcher : boost::noncopyable
+{
+public:
+    typedef boost::function<void (const std::string&)> Fetch;
+
+    Prefetcher(unsigned int numThreads, size_t maxQueueSize, const Fetch& fetch);
+    ~Prefetcher();
+
+    bool Enabled() const { return numThreads > 0; }
+
+    /// Starts the threads.
+    void Start();
+
+    /// Returns false if the queue is full.
+    bool Enqueue(const std::string& path);
+
+private:
+    void Work();
+
+    const unsigned int numThreads;
+    const size_t maxQueueSize;
+    const Fetch fetch;
+
+    boost::mutex mutex;
+    boost::condition_variable queueChanged;
+    std::deque<std::string> queue;
+    std::tr1::unordered_set<std::string> queued;
+    bool stopping;
+    boost::thread_group workers;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_PREFETCHER_H
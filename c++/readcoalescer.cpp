@@ -0,0 +1,150 @@
+#include "readcoalescer.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "cancellation.h"
+
+namespace ZFecFS {
+
+int ReadCoalescer::Read(char* outBuffer, size_t size, off_t offset, const Reader& read)
+{
+    if (size == 0)
+        return 0;
+
+    const off_t first = offset / chunkSize;
+    const off_t last = (offset + size - 1) / chunkSize;
+    std::vector<FlightPtr> flights;
+    std::vector<bool> leading;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        for (off_t chunk = first; chunk <= last; ++chunk) {
+            std::map<off_t, FlightPtr>::iterator it = inFlight.find(chunk);
+            if (it != inFlight.end()) {
+                ++it->second->waiters;
+                flights.push_back(it->second);
+                leading.push_back(false);
+            } else {
+                flights.push_back(boost::make_shared<Flight>());
+                leading.push_back(true);
+                inFlight[chunk] = flights.back();
+            }
+        }
+    }
+
+    const bool direct = offset % chunkSize == 0 && size % chunkSize == 0
+            && std::find(leading.begin(), leading.end(), false) == leading.end();
+    // read the chunks nobody else is reading before waiting for any other
+    // chunk, so that two reads never wait for each other
+    try {
+        if (direct)
+            return Lead(first, flights.size(), flights.data(), read, outBuffer);
+        for (size_t i = 0; i < flights.size();) {
+            size_t end = i;
+            while (end < flights.size() && leading[end])
+                ++end;
+            if (end > i)
+                Lead(first + i, end - i, &flights[i], read, NULL);
+            i = end + 1;
+        }
+    } catch (const Cancelled&) {
+        Abandon(first, flights, leading, -EINTR);
+        throw;
+    } catch (...) {
+        Abandon(first, flights, leading, -EIO);
+        throw;
+    }
+
+    size_t sizeRead = 0;
+    for (size_t i = 0; i < flights.size(); ++i) {
+        const Flight& flight = *flights[i];
+        if (!leading[i]) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!flight.done)
+                completed.wait(lock);
+        }
+        if (flight.result == -EINTR) {
+            // the read we waited for was interrupted, but we were not
+            Cancellation::ThrowIfRequested();
+            const int result = read(outBuffer + sizeRead, size - sizeRead, offset + sizeRead);
+            if (result < 0)
+                return sizeRead > 0 ? int(sizeRead) : result;
+            return sizeRead + result;
+        }
+        if (flight.result < 0)
+            return sizeRead > 0 ? int(sizeRead) : flight.result;
+
+        const off_t chunkStart = (first + i) * chunkSize;
+        const size_t offsetInChunk = std::max(offset, chunkStart) - chunkStart;
+        if (offsetInChunk >= size_t(flight.result))
+            break;
+        const size_t sizeToCopy = std::min(size - sizeRead, flight.result - offsetInChunk);
+        memcpy(outBuffer + sizeRead, flight.data.get() + flight.start + offsetInChunk, sizeToCopy);
+        sizeRead += sizeToCopy;
+        if (size_t(flight.result) < chunkSize)
+            break; // end of file
+    }
+    return sizeRead;
+}
+
+int ReadCoalescer::Lead(off_t chunk, size_t count, const FlightPtr* flights, const Reader& read,
+                       char* direct)
+{
+    const size_t size = count * chunkSize;
+    boost::shared_array<char> data;
+    if (direct == NULL)
+        data.reset(new char[size]);
+    const int result = read(direct != NULL ? direct : data.get(), size, chunk * chunkSize);
+    for (size_t i = 0; i < count; ++i) {
+        Flight& flight = *flights[i];
+        flight.data = data;
+        flight.start = i * chunkSize;
+        if (result < 0)
+            flight.result = result;
+        else
+            flight.result = std::min<off_t>(std::max<off_t>(off_t(result) - off_t(flight.start), 0),
+                                            chunkSize);
+        if (direct == NULL) {
+            Complete(chunk + i, flight);
+            continue;
+        }
+        // the buffer is the caller's, copy the chunk for the reads that joined
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (flight.waiters > 0 && flight.result > 0) {
+            flight.data.reset(new char[flight.result]);
+            memcpy(flight.data.get(), direct + flight.start, flight.result);
+            flight.start = 0;
+        }
+        flight.done = true;
+        inFlight.erase(chunk + i);
+        completed.notify_all();
+    }
+    return result;
+}
+
+void ReadCoalescer::Abandon(off_t first, const std::vector<FlightPtr>& flights,
+                            const std::vector<bool>& leading, int error)
+{
+    for (size_t i = 0; i < flights.size(); ++i) {
+        if (leading[i] && !flights[i]->done) {
+            flights[i]->result = error;
+            Complete(first + i, *flights[i]);
+        }
+    }
+}
+
+void ReadCoalescer::Complete(off_t chunk, Flight& flight)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    flight.done = true;
+    inFlight.erase(chunk);
+    completed.notify_all();
+}
+
+} // namespace ZFecFS
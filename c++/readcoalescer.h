@@ -0,0 +1,73 @@
+#ifndef ZFECFS_READCOALESCER_H
+#define ZFECFS_READCOALESCER_H
+
+#include <sys/types.h>
+
+#include <vector>
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Table of the reads of one file that are in flight, so that concurrent
+/// reads of the same data (kernel readahead, several readers of a file) only
+/// read and transform it once.
+///
+/// Reads are split into aligned chunks. A read that finds a chunk already
+/// being read waits for it and copies from the result, all other chunks of
+/// the read are read together in as few calls of the underlying reader as
+/// possible, which also merges small adjacent requests into one aligned
+/// operation.
+///
+/// An aligned read that shares no chunk with another read when it starts
+/// reads directly into the caller's buffer. Its chunks are only copied for
+/// reads that join them while they are read.
+class ReadCoalescer : boost::noncopyable
+{
+public:
+    /// Has the semantics of pread, but returns a negative errno on errors.
+    typedef boost::function<int (char*, size_t, off_t)> Reader;
+
+    explicit ReadCoalescer(size_t chunkSize)
+        : chunkSize(chunkSize)
+    {}
+
+    /// Reads like read would, sharing chunks with concurrent calls.
+    int Read(char* outBuffer, size_t size, off_t offset, const Reader& read);
+
+private:
+    class Flight {
+    public:
+        Flight() : done(false), waiters(0), result(0), start(0) {}
+        bool done;
+        unsigned int waiters; // reads that wait for the chunk
+        int result; // bytes of the chunk read or a negative errno, -EINTR if the leader was interrupted
+        boost::shared_array<char> data;
+        size_t start;
+    };
+    typedef boost::shared_ptr<Flight> FlightPtr;
+
+    /// Reads the count chunks starting at chunk, whose flights we lead,
+    /// into direct if it is set, returns the result of read.
+    int Lead(off_t chunk, size_t count, const FlightPtr* flights, const Reader& read, char* direct);
+    /// Completes the flights we lead that are not done yet with error.
+    void Abandon(off_t first, const std::vector<FlightPtr>& flights,
+                 const std::vector<bool>& leading, int error);
+    void Complete(off_t chunk, Flight& flight);
+
+    const size_t chunkSize;
+
+    boost::mutex mutex;
+    boost::condition_variable completed;
+    std::map<off_t, FlightPtr> inFlight;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_READCOALESCER_H
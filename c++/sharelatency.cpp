@@ -0,0 +1,60 @@
+#include "sharelatency.h"
+
+#include <time.h>
+
+#include <boost/thread/lock_guard.hpp>
+
+namespace ZFecFS {
+
+ShareLatency::ShareLatency(uint32_t window)
+    : window(window)
+{
+}
+
+void ShareLatency::Record(const std::string& directory, double seconds)
+{
+    unsigned int bucket = 0;
+    for (double microseconds = seconds * 1e6; microseconds >= 2 && bucket + 1 < numBuckets; microseconds /= 2)
+        ++bucket;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    Histogram& histogram = histograms[directory];
+    if (histogram.total >= window) {
+        histogram.total = 0;
+        for (unsigned int i = 0; i < numBuckets; ++i) {
+            histogram.counts[i] /= 2;
+            histogram.total += histogram.counts[i];
+        }
+    }
+    histogram.counts[bucket]++;
+    histogram.total++;
+}
+
+double ShareLatency::Quantile(const std::string& directory, double fraction) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::tr1::unordered_map<std::string, Histogram>::const_iterator it = histograms.find(directory);
+    if (it == histograms.end() || it->second.total == 0)
+        return 0;
+
+    const Histogram& histogram = it->second;
+    const double rank = fraction * histogram.total;
+    uint32_t count = 0;
+    unsigned int bucket = 0;
+    for (; bucket + 1 < numBuckets; ++bucket) {
+        count += histogram.counts[bucket];
+        if (count >= rank)
+            break;
+    }
+    // upper end of the bucket
+    return double(uint64_t(1) << (bucket + 1)) / 1e6;
+}
+
+double ShareLatency::Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+} // namespace ZFecFS
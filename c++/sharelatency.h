@@ -0,0 +1,91 @@
+#ifndef ZFECFS_SHARELATENCY_H
+#define ZFECFS_SHARELATENCY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <string>
+#include <tr1/unordered_map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// Latency of the reads from each share directory of the restore mount, so
+/// that files can be decoded from the shares on the fastest disks.
+///
+/// Each directory has a histogram with power of two buckets of
+/// microseconds. Once it has window samples, all counts are halved, so
+/// that old samples fade out when a disk becomes slow or fast again.
+class ShareLatency : boost::noncopyable
+{
+public:
+    explicit ShareLatency(uint32_t window = 1024);
+
+    void Record(const std::string& directory, double seconds);
+    /// Returns the seconds fraction (0 to 1) of the recent reads from
+    /// directory took at most, 0 if there were no reads yet.
+    double Quantile(const std::string& directory, double fraction) const;
+
+    /// Returns the current time in seconds.
+    static double Now();
+
+private:
+    static const unsigned int numBuckets = 32;
+
+    class Histogram {
+    public:
+        Histogram() : total(0)
+        {
+            for (unsigned int i = 0; i < numBuckets; ++i)
+                counts[i] = 0;
+        }
+        uint32_t counts[numBuckets];
+        uint32_t total;
+    };
+
+    const uint32_t window;
+    mutable boost::mutex mutex;
+    std::tr1::unordered_map<std::string, Histogram> histograms;
+};
+
+/// Decorator recording the latency of the reads of a share file.
+class TimedFile : public AbstractFile, boost::noncopyable
+{
+public:
+    TimedFile(const boost::shared_ptr<AbstractFile>& file, ShareLatency& latency,
+              const std::string& directory)
+        : file(file)
+        , latency(latency)
+        , directory(directory)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        const double start = ShareLatency::Now();
+        const ssize_t sizeRead = file->Read(buffer, size, offset);
+        latency.Record(directory, ShareLatency::Now() - start);
+        return sizeRead;
+    }
+    virtual off_t Size() const { return file->Size(); }
+    virtual bool Stat(struct stat& statBuf) const { return file->Stat(statBuf); }
+    virtual boost::shared_ptr<const FileView> View(size_t size, off_t offset) const
+    {
+        return file->View(size, offset);
+    }
+    virtual off_t NextData(off_t offset) const { return file->NextData(offset); }
+
+private:
+    const boost::shared_ptr<AbstractFile> file;
+    ShareLatency& latency;
+    const std::string directory;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_SHARELATENCY_H
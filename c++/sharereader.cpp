@@ -0,0 +1,133 @@
+#include "sharereader.h"
+
+#include <algorithm>
+#include <exception>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "cancellation.h"
+#include "sharelatency.h"
+
+namespace ZFecFS {
+
+const double ShareReader::cancellationInterval = 0.01;
+
+ShareReader::ShareReader(unsigned int numThreads)
+    : numThreads(numThreads)
+    , started(false)
+    , stopping(false)
+{
+}
+
+ShareReader::~ShareReader()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    workers.join_all();
+}
+
+void ShareReader::StartWorkers()
+{
+    for (unsigned int i = 0; i < numThreads; ++i)
+        workers.create_thread(boost::bind(&ShareReader::Work, this));
+    boost::lock_guard<boost::mutex> lock(mutex);
+    started = numThreads > 0;
+}
+
+ShareReader::RequestPtr ShareReader::Start(const boost::shared_ptr<AbstractFile>& file,
+                                           size_t size, off_t offset)
+{
+    RequestPtr request(new Request(file, size, offset));
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        queue.push_back(request);
+    }
+    queueChanged.notify_one();
+    return request;
+}
+
+size_t ShareReader::Wait(const std::vector<RequestPtr>& requests, size_t count, double timeout)
+{
+    const double deadline = ShareLatency::Now() + timeout;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        size_t succeeded = 0;
+        size_t done = 0;
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (requests[i]->done) {
+                ++done;
+                if (requests[i]->result == int(requests[i]->buffer.size()))
+                    ++succeeded;
+            }
+        }
+        if (succeeded >= count || done == requests.size())
+            return succeeded;
+        if (!started && !queue.empty()) {
+            // nobody else would read it
+            const RequestPtr request = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            Execute(request);
+            lock.lock();
+            continue;
+        }
+
+        double wait = cancellationInterval;
+        if (timeout >= 0) {
+            const double left = deadline - ShareLatency::Now();
+            if (left <= 0)
+                return succeeded;
+            wait = std::min(wait, left);
+        }
+        completed.timed_wait(lock, boost::posix_time::microseconds(long(wait * 1e6) + 1));
+        if (Cancellation::Requested())
+            throw Cancelled();
+    }
+}
+
+bool ShareReader::Done(const RequestPtr& request) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return request->done;
+}
+
+void ShareReader::Work()
+{
+    while (true) {
+        RequestPtr request;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!stopping && queue.empty())
+                queueChanged.wait(lock);
+            if (stopping)
+                return;
+            request = queue.front();
+            queue.pop_front();
+        }
+        Execute(request);
+    }
+}
+
+void ShareReader::Execute(const RequestPtr& request)
+{
+    int result;
+    try {
+        result = request->file->Read(request->buffer.data(), request->buffer.size(), request->offset);
+    } catch (const std::exception& exc) {
+        result = -1;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        request->result = result;
+        request->done = true;
+    }
+    completed.notify_all();
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,77 @@
+#ifndef ZFECFS_SHAREREADER_H
+#define ZFECFS_SHAREREADER_H
+
+#include <sys/types.h>
+
+#include <vector>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// Reads shares on a pool of I/O threads, so that the decoder can wait for
+/// a limited time and give up on a slow share in favour of a spare one
+/// while its read is still running. Until the threads are started, the
+/// reads are done by the threads waiting for them.
+class ShareReader : boost::noncopyable
+{
+public:
+    /// A read that was started, owned by the caller and the I/O thread.
+    class Request : boost::noncopyable {
+    public:
+        Request(const boost::shared_ptr<AbstractFile>& file, size_t size, off_t offset)
+            : file(file), offset(offset), buffer(size), result(0), done(false)
+        {}
+        const boost::shared_ptr<AbstractFile> file;
+        const off_t offset;
+        std::vector<char> buffer;
+        int result; // bytes read or -1, the request succeeded if it read all of buffer
+        bool done; // guarded by the mutex of the reader
+    };
+    typedef boost::shared_ptr<Request> RequestPtr;
+
+    explicit ShareReader(unsigned int numThreads);
+    ~ShareReader();
+
+    /// Starts the I/O threads.
+    void StartWorkers();
+
+    RequestPtr Start(const boost::shared_ptr<AbstractFile>& file, size_t size, off_t offset);
+
+    /// Waits until count of the requests succeeded (read all they asked
+    /// for), all of them are done or timeout seconds passed (no limit if
+    /// negative), and returns the number of requests that succeeded.
+    /// @throws Cancelled if the request of the calling thread was interrupted
+    size_t Wait(const std::vector<RequestPtr>& requests, size_t count, double timeout);
+
+    /// Returns whether request is done, the result can be used after that.
+    bool Done(const RequestPtr& request) const;
+
+private:
+    void Work();
+    /// Reads request and wakes up the threads waiting for it.
+    void Execute(const RequestPtr& request);
+
+    /// Seconds between checks whether waiting reads were interrupted.
+    static const double cancellationInterval;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable queueChanged;
+    boost::condition_variable completed;
+    std::deque<RequestPtr> queue;
+    const unsigned int numThreads;
+    bool started;
+    bool stopping;
+    boost::thread_group workers;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_SHAREREADER_H
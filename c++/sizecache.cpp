@@ -0,0 +1,50 @@
+#include "sizecache.h"
+
+#include <boost/thread/lock_guard.hpp>
+
+namespace ZFecFS {
+
+bool SizeCache::Lookup(const struct stat& statBuf, off_t& decodedSize)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<Key, EntryList::iterator>::iterator it
+            = index.find(Key(statBuf.st_dev, statBuf.st_ino));
+    if (it == index.end())
+        return false;
+    const Entry& entry = *it->second;
+    if (entry.encodedSize != statBuf.st_size
+            || entry.mtime.tv_sec != statBuf.st_mtim.tv_sec
+            || entry.mtime.tv_nsec != statBuf.st_mtim.tv_nsec) {
+        entries.erase(it->second);
+        index.erase(it);
+        return false;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    decodedSize = entry.decodedSize;
+    return true;
+}
+
+void SizeCache::Insert(const struct stat& statBuf, off_t decodedSize)
+{
+    Entry entry;
+    entry.key = Key(statBuf.st_dev, statBuf.st_ino);
+    entry.encodedSize = statBuf.st_size;
+    entry.mtime = statBuf.st_mtim;
+    entry.decodedSize = decodedSize;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<Key, EntryList::iterator>::iterator it = index.find(entry.key);
+    if (it != index.end()) {
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    entries.push_front(entry);
+    index[entry.key] = entries.begin();
+
+    while (entries.size() > maxEntries) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,59 @@
+#ifndef ZFECFS_SIZECACHE_H
+#define ZFECFS_SIZECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <utility>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Bounded LRU cache of the decoded sizes of share files, so that getattr
+/// in the restore mount does not have to open each file to read its
+/// metadata header.
+///
+/// Entries are keyed by device and inode of the share file and are only
+/// used as long as its size and modification time still match the stat
+/// result the caller already has.
+class SizeCache : boost::noncopyable
+{
+public:
+    explicit SizeCache(size_t maxEntries)
+        : maxEntries(maxEntries)
+    {}
+
+    bool Enabled() const { return maxEntries > 0; }
+
+    /// Returns false if the size of the file described by statBuf is not
+    /// cached or the file was modified since.
+    bool Lookup(const struct stat& statBuf, off_t& decodedSize);
+    void Insert(const struct stat& statBuf, off_t decodedSize);
+
+private:
+    typedef std::pair<dev_t, ino_t> Key;
+
+    class Entry {
+    public:
+        Key key;
+        off_t encodedSize;
+        struct timespec mtime;
+        off_t decodedSize;
+    };
+    typedef std::list<Entry> EntryList;
+
+    const size_t maxEntries;
+
+    boost::mutex mutex;
+    EntryList entries; // most recently used first
+    std::map<Key, EntryList::iterator> index;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_SIZECACHE_H
@@ -0,0 +1,107 @@
+#include "smallfilecache.h"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "metadata.h"
+
+namespace ZFecFS {
+
+SmallFileCache::SharesPtr SmallFileCache::Lookup(const struct stat& statBuf)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<Key, EntryList::iterator>::iterator it
+            = index.find(Key(statBuf.st_dev, statBuf.st_ino));
+    if (it == index.end())
+        return SharesPtr();
+    if (!Matches(*it->second, statBuf)) {
+        bytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+        return SharesPtr();
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->shares;
+}
+
+void SmallFileCache::Insert(const struct stat& statBuf, const SharesPtr& shares)
+{
+    Entry entry;
+    entry.key = Key(statBuf.st_dev, statBuf.st_ino);
+    entry.size = statBuf.st_size;
+    entry.mtime = statBuf.st_mtim;
+    entry.ctime = statBuf.st_ctim;
+    entry.shares = shares;
+    entry.bytes = sizeof(Entry);
+    for (size_t i = 0; i < shares->size(); ++i)
+        entry.bytes += (*shares)[i].size();
+    if (entry.bytes > maxBytes)
+        return;
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<Key, EntryList::iterator>::iterator it = index.find(entry.key);
+    if (it != index.end()) {
+        bytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    entries.push_front(entry);
+    index[entry.key] = entries.begin();
+    bytes += entry.bytes;
+
+    while (bytes > maxBytes) {
+        bytes -= entries.back().bytes;
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+SmallFileCache::SharesPtr SmallFileCache::Encode(const AbstractFile& file, off_t size,
+                                                 const FecWrapper& fecWrapper, unsigned int numShares)
+{
+    const unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    std::vector<char> contents(size + 1);
+    // one byte more to notice a file that grew
+    if (file.Read(contents.data(), contents.size(), 0) != ssize_t(size))
+        return SharesPtr();
+
+    boost::shared_ptr<std::vector<std::string> > shares
+            = boost::make_shared<std::vector<std::string> >(numShares);
+    const size_t length = (size + sharesRequired - 1) / sharesRequired;
+    std::vector<std::string> inputs(sharesRequired, std::string(length, '\0'));
+    for (off_t i = 0; i < size; ++i)
+        inputs[i % sharesRequired][i / sharesRequired] = contents[i];
+
+    std::vector<char*> fecInput(sharesRequired);
+    for (unsigned int i = 0; i < sharesRequired; ++i)
+        fecInput[i] = &inputs[i][0];
+    std::vector<std::string> parity(numShares - sharesRequired, std::string(length, '\0'));
+    std::vector<char*> fecOutput(parity.size());
+    std::vector<unsigned int> indices(parity.size());
+    for (unsigned int i = 0; i < parity.size(); ++i) {
+        fecOutput[i] = &parity[i][0];
+        indices[i] = sharesRequired + i;
+    }
+    if (length > 0 && !parity.empty())
+        fecWrapper.Encode(fecOutput.data(), fecInput.data(), indices.data(), indices.size(), length);
+
+    for (unsigned int index = 0; index < numShares; ++index) {
+        const Metadata metadata(sharesRequired, index, size);
+        std::string& share = (*shares)[index];
+        share.reserve(Metadata::size + length);
+        share.assign(metadata.begin(), metadata.end());
+        share += index < sharesRequired ? inputs[index] : parity[index - sharesRequired];
+    }
+    return shares;
+}
+
+bool SmallFileCache::Matches(const Entry& entry, const struct stat& statBuf)
+{
+    return entry.size == statBuf.st_size
+            && entry.mtime.tv_sec == statBuf.st_mtim.tv_sec
+            && entry.mtime.tv_nsec == statBuf.st_mtim.tv_nsec
+            && entry.ctime.tv_sec == statBuf.st_ctim.tv_sec
+            && entry.ctime.tv_nsec == statBuf.st_ctim.tv_nsec;
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,89 @@
+#ifndef ZFECFS_SMALLFILECACHE_H
+#define ZFECFS_SMALLFILECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+#include "fecwrapper.h"
+
+namespace ZFecFS {
+
+/// Bounded LRU cache of all shares of small source files. A small file is
+/// read once and all its shares are encoded in one pass when the first
+/// share is opened, so that opening its other shares neither opens nor
+/// encodes the source again.
+///
+/// Entries are keyed by device and inode of the source file and are only
+/// used as long as its size, modification and change time still match the
+/// stat result the caller already has.
+class SmallFileCache : boost::noncopyable
+{
+public:
+    /// The encoded shares of a file, including their metadata headers.
+    typedef boost::shared_ptr<const std::vector<std::string> > SharesPtr;
+
+    SmallFileCache(size_t maxFileSize, size_t maxBytes)
+        : maxFileSize(maxFileSize)
+        , maxBytes(maxBytes)
+        , bytes(0)
+    {}
+
+    bool Enabled() const { return maxFileSize > 0 && maxBytes > 0; }
+    /// Returns whether the file described by statBuf is small enough to be
+    /// cached.
+    bool Covers(const struct stat& statBuf) const
+    {
+        return Enabled() && S_ISREG(statBuf.st_mode) && size_t(statBuf.st_size) <= maxFileSize;
+    }
+
+    /// Returns an empty pointer if the file described by statBuf is not
+    /// cached or was modified since.
+    SharesPtr Lookup(const struct stat& statBuf);
+    void Insert(const struct stat& statBuf, const SharesPtr& shares);
+
+    /// Reads all of file, which has the given size, and encodes numShares
+    /// shares of it. Returns an empty pointer if the file does not have
+    /// that size anymore.
+    static SharesPtr Encode(const AbstractFile& file, off_t size, const FecWrapper& fecWrapper,
+                            unsigned int numShares);
+
+private:
+    typedef std::pair<dev_t, ino_t> Key;
+
+    class Entry {
+    public:
+        Key key;
+        off_t size;
+        struct timespec mtime;
+        struct timespec ctime;
+        SharesPtr shares;
+        size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+
+    static bool Matches(const Entry& entry, const struct stat& statBuf);
+
+    const size_t maxFileSize;
+    const size_t maxBytes;
+
+    boost::mutex mutex;
+    EntryList entries; // most recently used first
+    std::map<Key, EntryList::iterator> index;
+    size_t bytes;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_SMALLFILECACHE_H
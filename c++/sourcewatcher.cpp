@@ -0,0 +1,161 @@
+#include "sourcewatcher.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <set>
+#include <vector>
+#include <utility>
+
+#include <boost/foreach.hpp>
+
+#include "utils.h"
+#include "directory.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const uint32_t watchMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                           | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                           | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+} // anonymous namespace
+
+SourceWatcher::SourceWatcher(const std::string& root, const Callback& callback)
+    : root(root.size() > 1 && root[root.size() - 1] == '/' ? root.substr(0, root.size() - 1) : root)
+    , callback(callback)
+    , complete(true)
+{
+    inotifyHandle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyHandle == -1)
+        throw SimpleException("Unable to initialize inotify.");
+    if (pipe(stopPipe) == -1) {
+        close(inotifyHandle);
+        throw SimpleException("Unable to create pipe.");
+    }
+    AddTree("");
+}
+
+SourceWatcher::~SourceWatcher()
+{
+    if (watcher.joinable() && write(stopPipe[1], "", 1) == 1)
+        watcher.join();
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    close(inotifyHandle);
+}
+
+void SourceWatcher::Start()
+{
+    boost::thread(&SourceWatcher::Watch, this).swap(watcher);
+}
+
+void SourceWatcher::AddTree(const std::string& path)
+{
+    const int watch = inotify_add_watch(inotifyHandle, (root + path).c_str(), watchMask);
+    if (watch == -1) {
+        complete = false;
+        return;
+    }
+    watches[watch] = path;
+
+    try {
+        Directory dir(root + path);
+        for (struct dirent* entry = dir.Readdir(); entry != NULL; entry = dir.Readdir()) {
+            if (IsDotDirectory(entry->d_name))
+                continue;
+            const std::string child = path + "/" + entry->d_name;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat statBuf;
+                if (lstat((root + child).c_str(), &statBuf) == -1)
+                    continue;
+                type = IFTODT(statBuf.st_mode);
+            }
+            if (type == DT_DIR)
+                AddTree(child);
+        }
+    } catch (const std::exception& exc) {
+        // removed in the meantime
+    }
+}
+
+void SourceWatcher::RemoveTree(const std::string& path)
+{
+    const std::string prefix = path + "/";
+    for (std::tr1::unordered_map<int, std::string>::iterator it = watches.begin(); it != watches.end();) {
+        if (it->second == path || it->second.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(inotifyHandle, it->first);
+            it = watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SourceWatcher::HandleEvents(const char* buffer, size_t size)
+{
+    // writes produce a lot of events for the same file, report it only once
+    std::set<std::pair<std::string, bool> > changed;
+
+    const struct inotify_event* event;
+    for (const char* position = buffer; position < buffer + size;
+         position += sizeof(struct inotify_event) + event->len) {
+        event = reinterpret_cast<const struct inotify_event*>(position);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            callback(std::string(), true);
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            watches.erase(event->wd);
+            continue;
+        }
+        std::tr1::unordered_map<int, std::string>::const_iterator watch = watches.find(event->wd);
+        if (watch == watches.end() || event->len == 0)
+            continue;
+        const std::string path = watch->second + "/" + event->name;
+
+        const bool entryChanged = event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                RemoveTree(path);
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                AddTree(path);
+        }
+        changed.insert(std::make_pair(path, entryChanged));
+    }
+
+    typedef std::pair<std::string, bool> Change;
+    BOOST_FOREACH(const Change& change, changed)
+        callback(change.first, change.second);
+}
+
+void SourceWatcher::Watch()
+{
+    // large enough for many events, aligned for struct inotify_event
+    std::vector<struct inotify_event> buffer((1 << 16) / sizeof(struct inotify_event));
+    const size_t bufferSize = buffer.size() * sizeof(struct inotify_event);
+    while (true) {
+        struct pollfd handles[2];
+        handles[0].fd = stopPipe[0];
+        handles[0].events = POLLIN;
+        handles[1].fd = inotifyHandle;
+        handles[1].events = POLLIN;
+        if (poll(handles, 2, -1) == -1)
+            continue;
+        if (handles[0].revents != 0)
+            return;
+
+        const ssize_t sizeRead = read(inotifyHandle, &buffer[0], bufferSize);
+        if (sizeRead > 0)
+            HandleEvents(reinterpret_cast<const char*>(&buffer[0]), sizeRead);
+    }
+}
+
+} // namespace ZFecFS
@@ -0,0 +1,55 @@
+#ifndef ZFECFS_SOURCEWATCHER_H
+#define ZFECFS_SOURCEWATCHER_H
+
+#include <string>
+#include <tr1/unordered_map>
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace ZFecFS {
+
+/// Watches a directory tree with inotify and reports changed paths.
+///
+/// The callback is called on the watching thread with the path relative to
+/// the root (starting with '/') and whether entries were created, removed
+/// or renamed (as opposed to contents or attributes changed). It is called
+/// with an empty path if events were lost and everything has to be assumed
+/// changed. Changes are watched from construction on, but only reported
+/// once Start is called.
+class SourceWatcher : boost::noncopyable
+{
+public:
+    typedef boost::function<void (const std::string& path, bool entryChanged)> Callback;
+
+    SourceWatcher(const std::string& root, const Callback& callback);
+    ~SourceWatcher();
+
+    /// Starts the watching thread.
+    void Start();
+
+    /// Returns false if not all directories could be watched (e.g. because
+    /// the inotify watch limit was reached).
+    bool Complete() const { return complete; }
+
+private:
+    void AddTree(const std::string& path);
+    void RemoveTree(const std::string& path);
+    void HandleEvents(const char* buffer, size_t size);
+    void Watch();
+
+    const std::string root; // without trailing /
+    const Callback callback;
+
+    int inotifyHandle;
+    int stopPipe[2];
+    volatile bool complete;
+    std::tr1::unordered_map<int, std::string> watches;
+
+    boost::thread watcher;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_SOURCEWATCHER_H
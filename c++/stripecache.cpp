@@ -0,0 +1,287 @@
+#include "stripecache.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "utils.h"
+
+namespace ZFecFS {
+
+namespace {
+
+const char magic[16] = "zfecfs-stripes\n";
+const uint32_t layoutVersion = 1;
+/// Space before the slots, so that they start page aligned.
+const size_t headerSpace = 4096;
+/// How often opening is retried while another process creates the segment.
+const unsigned int openAttempts = 100;
+
+} // anonymous namespace
+
+const size_t StripeCache::blockSize;
+
+/// Layout of the segment, the magic is written last once the rest is set.
+class StripeCache::Header {
+public:
+    char magic[16];
+    uint32_t version;
+    uint32_t blockSize;
+    uint64_t slotSize;
+    uint64_t slots;
+    volatile uint32_t users; // processes that have the segment open
+};
+
+class StripeCache::Slot {
+public:
+    volatile uint32_t sequence; // odd while the slot is written
+    volatile uint32_t writer; // process id of the writer, 0 if none
+    uint32_t length;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t fileSize;
+    uint64_t modified;
+    uint64_t changed;
+    uint64_t block;
+    char data[blockSize];
+
+    bool Matches(const struct stat& statBuf, off_t block) const
+    {
+        return inode == uint64_t(statBuf.st_ino)
+                && device == uint64_t(statBuf.st_dev)
+                && this->block == uint64_t(block)
+                && fileSize == uint64_t(statBuf.st_size)
+                && modified == Nanoseconds(statBuf.st_mtim)
+                && changed == Nanoseconds(statBuf.st_ctim);
+    }
+
+    static uint64_t Nanoseconds(const struct timespec& time)
+    {
+        return uint64_t(time.tv_sec) * 1000000000ULL + time.tv_nsec;
+    }
+};
+
+std::string StripeCache::DefaultName()
+{
+    std::ostringstream name;
+    name << "/zfecfs-stripes-" << getuid();
+    return name.str();
+}
+
+StripeCache::StripeCache(const std::string& name, size_t size)
+    : name(name)
+    , memory(MAP_FAILED)
+    , size(0)
+    , slots(0)
+    , inode(0)
+{
+    for (unsigned int attempt = 0; attempt < openAttempts; ++attempt) {
+        int handle = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (handle != -1) {
+            try {
+                Create(handle, size);
+            } catch (...) {
+                close(handle);
+                shm_unlink(name.c_str());
+                throw;
+            }
+            close(handle);
+            return;
+        }
+        if (errno != EEXIST || (handle = shm_open(name.c_str(), O_RDWR, 0)) == -1) {
+            if (errno == ENOENT)
+                continue; // unlinked in the meantime
+            throw SimpleException("Unable to open the shared stripe cache.");
+        }
+        OpenResult result;
+        try {
+            result = Attach(handle);
+        } catch (...) {
+            close(handle);
+            throw;
+        }
+        close(handle);
+        if (result == opened)
+            return;
+        // a creator that died before writing the header leaves it incomplete
+        if (result == incomplete && attempt + 1 < openAttempts) {
+            usleep(10000);
+            continue;
+        }
+        shm_unlink(name.c_str());
+    }
+    throw SimpleException("Unable to open the shared stripe cache.");
+}
+
+StripeCache::~StripeCache()
+{
+    if (__sync_sub_and_fetch(&GetHeader().users, 1) == 0) {
+        // unless it was replaced by a segment of another layout
+        const int handle = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat statBuf;
+        if (handle != -1 && fstat(handle, &statBuf) == 0 && statBuf.st_ino == inode)
+            shm_unlink(name.c_str());
+        if (handle != -1)
+            close(handle);
+    }
+    munmap(memory, size);
+}
+
+void StripeCache::Create(int handle, size_t size)
+{
+    const size_t newSlots = size / sizeof(Slot);
+    if (newSlots == 0 || ftruncate(handle, headerSpace + newSlots * sizeof(Slot)) == -1)
+        throw SimpleException("Unable to size the shared stripe cache.");
+    // a new segment is zero-filled, which is a valid table of empty slots
+    Map(handle, headerSpace + newSlots * sizeof(Slot));
+    slots = newSlots;
+    Header& header = GetHeader();
+    header.version = layoutVersion;
+    header.blockSize = blockSize;
+    header.slotSize = sizeof(Slot);
+    header.slots = slots;
+    header.users = 1;
+    __sync_synchronize();
+    memcpy(header.magic, magic, sizeof(magic));
+}
+
+StripeCache::OpenResult StripeCache::Attach(int handle)
+{
+    struct stat statBuf;
+    if (fstat(handle, &statBuf) == -1)
+        throw SimpleException("Unable to open the shared stripe cache.");
+    if (size_t(statBuf.st_size) < headerSpace)
+        return incomplete;
+    Map(handle, statBuf.st_size);
+    const Header& header = GetHeader();
+    const char empty[sizeof(magic)] = {};
+    OpenResult result = opened;
+    if (memcmp(header.magic, empty, sizeof(magic)) == 0)
+        result = incomplete;
+    else if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != layoutVersion
+             || header.blockSize != blockSize || header.slotSize != sizeof(Slot) || header.slots == 0
+             || headerSpace + header.slots * sizeof(Slot) != size)
+        result = stale;
+    if (result != opened) {
+        munmap(memory, size);
+        memory = MAP_FAILED;
+        return result;
+    }
+    __sync_synchronize();
+    slots = header.slots;
+    __sync_add_and_fetch(&GetHeader().users, 1);
+    return opened;
+}
+
+void StripeCache::Map(int handle, size_t size)
+{
+    struct stat statBuf;
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+    if (memory == MAP_FAILED || fstat(handle, &statBuf) == -1)
+        throw SimpleException("Unable to map the shared stripe cache.");
+    this->size = size;
+    inode = statBuf.st_ino;
+}
+
+ssize_t StripeCache::Lookup(const struct stat& statBuf, off_t block, char* buffer) const
+{
+    const Slot& slot = SlotOf(statBuf, block);
+    const uint32_t sequence = slot.sequence;
+    __sync_synchronize();
+    if (sequence % 2 != 0 || !slot.Matches(statBuf, block))
+        return -1;
+    const size_t length = std::min<size_t>(slot.length, blockSize);
+    memcpy(buffer, slot.data, length);
+    __sync_synchronize();
+    if (slot.sequence != sequence)
+        return -1; // overwritten while we copied it
+    return length;
+}
+
+void StripeCache::Insert(const struct stat& statBuf, off_t block, const char* data, size_t length)
+{
+    Slot& slot = SlotOf(statBuf, block);
+    const uint32_t self = getpid();
+    const uint32_t writer = slot.writer;
+    // a writer that died while writing would otherwise block the slot forever
+    if (writer != 0 && (kill(pid_t(writer), 0) == 0 || errno != ESRCH))
+        return; // somebody else is writing the slot
+    if (!__sync_bool_compare_and_swap(&slot.writer, writer, self))
+        return;
+
+    // still odd if the previous writer died
+    uint32_t sequence = slot.sequence;
+    if (sequence % 2 == 0)
+        slot.sequence = ++sequence;
+    __sync_synchronize();
+    slot.length = std::min(length, blockSize);
+    slot.device = statBuf.st_dev;
+    slot.inode = statBuf.st_ino;
+    slot.fileSize = statBuf.st_size;
+    slot.modified = Slot::Nanoseconds(statBuf.st_mtim);
+    slot.changed = Slot::Nanoseconds(statBuf.st_ctim);
+    slot.block = block;
+    memcpy(slot.data, data, slot.length);
+    __sync_synchronize();
+    slot.sequence = sequence + 1;
+    __sync_synchronize();
+    slot.writer = 0;
+}
+
+StripeCache::Slot& StripeCache::SlotOf(const struct stat& statBuf, off_t block) const
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const uint64_t values[] = { uint64_t(statBuf.st_dev), uint64_t(statBuf.st_ino), uint64_t(block) };
+    for (unsigned int i = 0; i < 3; ++i) {
+        hash ^= values[i];
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return reinterpret_cast<Slot*>(static_cast<char*>(memory) + headerSpace)[hash % slots];
+}
+
+ssize_t StripeCachedFile::Read(char* buffer, size_t size, off_t offset) const
+{
+    std::vector<char> blockBuffer;
+    size_t sizeRead = 0;
+    while (sizeRead < size) {
+        const off_t position = offset + sizeRead;
+        const off_t block = position / StripeCache::blockSize;
+        const off_t blockStart = block * StripeCache::blockSize;
+        const size_t offsetInBlock = position - blockStart;
+        // whole blocks are copied to the buffer directly
+        char* data = buffer + sizeRead;
+        if (offsetInBlock != 0 || size - sizeRead < StripeCache::blockSize) {
+            blockBuffer.resize(StripeCache::blockSize);
+            data = blockBuffer.data();
+        }
+
+        ssize_t length = cache.Lookup(statBuf, block, data);
+        if (length < 0) {
+            length = file->Read(data, StripeCache::blockSize, blockStart);
+            if (length < 0)
+                return sizeRead > 0 ? ssize_t(sizeRead) : length;
+            // only blocks that are short because of the end of the file are complete
+            if (length == ssize_t(StripeCache::blockSize) || blockStart + length == statBuf.st_size)
+                cache.Insert(statBuf, block, data, length);
+        }
+        if (offsetInBlock >= size_t(length))
+            break;
+        const size_t sizeToCopy = std::min(size - sizeRead, size_t(length) - offsetInBlock);
+        if (data != buffer + sizeRead)
+            memcpy(buffer + sizeRead, data + offsetInBlock, sizeToCopy);
+        sizeRead += sizeToCopy;
+        if (size_t(length) < StripeCache::blockSize)
+            break;
+    }
+    return sizeRead;
+}
+
+} // namespace ZFecFS
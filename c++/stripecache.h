@@ -0,0 +1,98 @@
+#ifndef ZFECFS_STRIPECACHE_H
+#define ZFECFS_STRIPECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include "file.h"
+
+namespace ZFecFS {
+
+/// Cache of source file blocks in a POSIX shared memory segment, so that
+/// several encoder processes serving different shares of the same source
+/// only read each block once.
+///
+/// The segment starts with a header describing its layout, followed by a
+/// table of slots, each holding one block, that a block can only be stored
+/// in one of. Slots are protected by sequence counters instead of locks:
+/// readers retry nothing and treat a slot that changed while they copied it
+/// as a miss, writers skip slots that are being written by a live process
+/// and take over slots whose writer died. Blocks are keyed by device,
+/// inode, size, modification and change time of the source file, so a
+/// modified file misses.
+///
+/// The last process to close the segment unlinks it. A segment with a
+/// different layout (e.g. left behind by another version) is replaced.
+class StripeCache : boost::noncopyable
+{
+public:
+    static const size_t blockSize = 65536;
+
+    /// Name of the segment shared by the processes of the calling user.
+    static std::string DefaultName();
+
+    /// Opens the segment name (created with about size bytes if it does not
+    /// exist yet, otherwise its existing size is used).
+    /// @throws SimpleException if the segment cannot be opened
+    StripeCache(const std::string& name, size_t size);
+    ~StripeCache();
+
+    /// Copies the block of the file described by statBuf to buffer (of
+    /// blockSize bytes) and returns its length, or returns -1 if it is not
+    /// cached.
+    ssize_t Lookup(const struct stat& statBuf, off_t block, char* buffer) const;
+    void Insert(const struct stat& statBuf, off_t block, const char* data, size_t length);
+
+private:
+    class Header;
+    class Slot;
+
+    enum OpenResult { opened, stale, incomplete };
+
+    /// Sizes and maps the segment just created and writes its header.
+    void Create(int handle, size_t size);
+    /// Maps an existing segment if its header matches our layout.
+    OpenResult Attach(int handle);
+    void Map(int handle, size_t size);
+    Header& GetHeader() const { return *static_cast<Header*>(memory); }
+    Slot& SlotOf(const struct stat& statBuf, off_t block) const;
+
+    const std::string name;
+    void* memory;
+    size_t size;
+    size_t slots;
+    ino_t inode; // of the segment, to only unlink our own
+};
+
+/// Source file read through a StripeCache.
+class StripeCachedFile : public AbstractFile, boost::noncopyable
+{
+public:
+    /// statBuf identifies the version of file in the cache.
+    StripeCachedFile(const boost::shared_ptr<AbstractFile>& file, StripeCache& cache,
+                     const struct stat& statBuf)
+        : file(file)
+        , cache(cache)
+        , statBuf(statBuf)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const;
+    virtual off_t Size() const { return file->Size(); }
+    virtual bool Stat(struct stat& statBuf) const { return file->Stat(statBuf); }
+    virtual off_t NextData(off_t offset) const { return file->NextData(offset); }
+
+private:
+    const boost::shared_ptr<AbstractFile> file;
+    StripeCache& cache;
+    const struct stat statBuf;
+};
+
+} // namespace ZFecFS
+
+#endif // ZFECFS_STRIPECACHE_H
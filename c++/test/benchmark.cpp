@@ -0,0 +1,209 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "fecwrapper.h"
+#include "file.h"
+#include "mappedfile.h"
+#include "fileencoder.h"
+#include "filedecoder.h"
+#include "computepool.h"
+#include "smallfilecache.h"
+
+using namespace ZFecFS;
+
+namespace {
+
+size_t readSize = 128 * 1024; // default max_read of fuse
+
+double Now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+boost::shared_ptr<AbstractFile> OpenFile(const std::string& path, bool mapped)
+{
+    if (mapped)
+        return boost::make_shared<MappedFile>(path);
+    else
+        return boost::make_shared<File>(path);
+}
+
+/// Reads every threads-th chunk of readSize bytes, the way concurrent fuse
+/// requests on one open file do.
+template <class Reader>
+class ChunkReader
+{
+public:
+    ChunkReader(Reader& reader, off_t size, unsigned int thread, unsigned int threads)
+        : reader(reader), size(size), thread(thread), threads(threads)
+    {}
+
+    void operator()()
+    {
+        std::vector<char> buffer(readSize);
+        for (off_t offset = off_t(thread) * readSize; offset < size; offset += off_t(threads) * readSize)
+            reader.Read(buffer.data(), buffer.size(), offset);
+    }
+
+private:
+    Reader& reader;
+    const off_t size;
+    const unsigned int thread;
+    const unsigned int threads;
+};
+
+template <class Reader>
+double TimeRead(Reader& reader, off_t size, unsigned int threads)
+{
+    const double start = Now();
+    boost::thread_group group;
+    for (unsigned int thread = 0; thread < threads; ++thread)
+        group.create_thread(ChunkReader<Reader>(reader, size, thread, threads));
+    group.join_all();
+    return Now() - start;
+}
+
+void WriteFile(const std::string& path, const std::vector<char>& contents)
+{
+    const int handle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (handle == -1 || write(handle, contents.data(), contents.size()) != ssize_t(contents.size())) {
+        std::cerr << "Unable to write " << path << std::endl;
+        exit(1);
+    }
+    close(handle);
+}
+
+void Report(const std::string& what, off_t size, double seconds)
+{
+    std::cout << std::setw(32) << std::left << what
+              << std::setw(10) << std::right << std::fixed << std::setprecision(1)
+              << size / seconds / (1 << 20) << " MiB/s" << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    unsigned int sharesRequired = 3;
+    unsigned int numShares = 10;
+    unsigned int threads = 1;
+    unsigned int computeThreads = 0;
+    off_t size = off_t(256) << 20;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg(argv[i]);
+        std::istringstream value(argv[i + 1]);
+        if (arg == "-k") {
+            value >> sharesRequired;
+        } else if (arg == "-n") {
+            value >> numShares;
+        } else if (arg == "-t") {
+            value >> threads;
+        } else if (arg == "-s") {
+            value >> size;
+            size <<= 20;
+        } else if (arg == "-r") {
+            value >> readSize;
+            readSize <<= 10;
+        } else if (arg == "-p") {
+            value >> computeThreads;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-k <required>] [-n <shares>] [-t <threads>] [-s <MiB>]"
+                      << " [-r <read KiB>] [-p <compute threads>]" << std::endl;
+            return 1;
+        }
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    std::string directory = std::string(tmp == NULL ? "/tmp" : tmp) + "/zfecfs_benchmark_XXXXXX";
+    if (mkdtemp(&directory[0]) == NULL) {
+        std::cerr << "Unable to create temporary directory." << std::endl;
+        return 1;
+    }
+
+    std::vector<char> contents(size);
+    srand(1);
+    for (off_t i = 0; i < size; ++i)
+        contents[i] = char(rand());
+    const std::string sourcePath = directory + "/source";
+    WriteFile(sourcePath, contents);
+
+    FecWrapper fecWrapper(sharesRequired, numShares);
+    const off_t encodedSize = FileEncoder::Size(size, sharesRequired);
+    ComputePool computePool(computeThreads);
+    computePool.Start();
+    std::cout << "k=" << sharesRequired << " n=" << numShares << " threads=" << threads
+              << " compute_threads=" << computeThreads << " read=" << (readSize >> 10) << "KiB"
+              << " size=" << (size >> 20) << "MiB (page cache is warm)" << std::endl;
+
+    // use the last shares for decoding, so that every byte needs the fec
+    std::vector<std::string> sharePaths;
+    for (unsigned int index = numShares - sharesRequired; index < numShares; ++index) {
+        FileEncoder encoder(OpenFile(sourcePath, false), index, fecWrapper);
+        std::vector<char> encoded(encodedSize);
+        encoder.Read(encoded.data(), encoded.size(), 0);
+        std::ostringstream sharePath;
+        sharePath << directory << "/share" << index;
+        WriteFile(sharePath.str(), encoded);
+        sharePaths.push_back(sharePath.str());
+    }
+
+    for (int mapped = 0; mapped < 2; ++mapped) {
+        const std::string backend = mapped ? "mmap" : "pread";
+        FileEncoder primary(OpenFile(sourcePath, mapped), 0, fecWrapper);
+        primary.UseComputePool(computePool);
+        Report("encode primary share, " + backend, size, TimeRead(primary, encodedSize, threads));
+        FileEncoder parity(OpenFile(sourcePath, mapped), sharesRequired, fecWrapper);
+        parity.UseComputePool(computePool);
+        Report("encode parity share, " + backend, size, TimeRead(parity, encodedSize, threads));
+
+        std::vector<boost::shared_ptr<AbstractFile> > shares;
+        for (unsigned int i = 0; i < sharePaths.size(); ++i)
+            shares.push_back(OpenFile(sharePaths[i], mapped));
+        boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(shares, fecWrapper));
+        decoder->UseComputePool(computePool);
+        Report("decode, " + backend, size, TimeRead(*decoder, size, threads));
+    }
+
+    // a crawl of all shares of small files, each share opened on its own
+    // or served from the shares encoded at the first open
+    const size_t smallSize = 4096;
+    const unsigned int smallFiles = 1000;
+    const boost::shared_ptr<AbstractFile> smallFile = boost::make_shared<MemoryFile>(
+                std::string(contents.begin(), contents.begin() + std::min<off_t>(smallSize, size)));
+    std::vector<char> smallShare(FileEncoder::Size(smallFile->Size(), sharesRequired));
+    double start = Now();
+    for (unsigned int file = 0; file < smallFiles; ++file) {
+        for (unsigned int index = 0; index < numShares; ++index)
+            FileEncoder(smallFile, index, fecWrapper).Read(smallShare.data(), smallShare.size(), 0);
+    }
+    Report("small files, share by share", off_t(smallFiles) * smallFile->Size(), Now() - start);
+    start = Now();
+    for (unsigned int file = 0; file < smallFiles; ++file) {
+        SmallFileCache::SharesPtr shares
+                = SmallFileCache::Encode(*smallFile, smallFile->Size(), fecWrapper, numShares);
+        for (unsigned int index = 0; index < numShares; ++index)
+            MemoryFile((*shares)[index]).Read(smallShare.data(), smallShare.size(), 0);
+    }
+    Report("small files, all shares at once", off_t(smallFiles) * smallFile->Size(), Now() - start);
+
+    for (unsigned int i = 0; i < sharePaths.size(); ++i)
+        unlink(sharePaths[i].c_str());
+    unlink(sourcePath.c_str());
+    rmdir(directory.c_str());
+    return 0;
+}
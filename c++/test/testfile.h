@@ -13,11 +13,13 @@ class TestFile : public AbstractFile
 public:
     explicit TestFile(const std::string& contents)
         : contents(contents)
+        , inode(NextInode())
     {}
 
     template <typename Container>
     explicit TestFile(const Container& contents)
         : contents(contents.begin(), contents.end())
+        , inode(NextInode())
     {}
 
     virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
@@ -35,8 +37,24 @@ public:
     {
         return contents.size();
     }
+
+    virtual bool Stat(struct stat& statBuf) const
+    {
+        std::fill(reinterpret_cast<char*>(&statBuf),
+                  reinterpret_cast<char*>(&statBuf) + sizeof(statBuf), 0);
+        statBuf.st_ino = inode;
+        statBuf.st_size = contents.size();
+        return true;
+    }
 private:
+    static ino_t NextInode()
+    {
+        static ino_t lastInode = 0;
+        return ++lastInode;
+    }
+
     const std::string contents;
+    const ino_t inode;
 };
 
 }
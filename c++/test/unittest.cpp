@@ -1,14 +1,52 @@
 #define BOOST_TEST_MODULE UnitTest
+#define FUSE_USE_VERSION 26
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <set>
+#include <map>
 
 #include <boost/test/included/unit_test.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "metadata.h"
 #include "fecwrapper.h"
 #include "testfile.h"
 #include "fileencoder.h"
 #include "filedecoder.h"
+#include "blockcache.h"
+#include "mappedfile.h"
+#include "directfile.h"
+#include "openstatecache.h"
+#include "namespaceindex.h"
+#include "sizecache.h"
+#include "directorysnapshot.h"
+#include "manifest.h"
+#include "prefetcher.h"
+#include "sourcewatcher.h"
+#include "changejournal.h"
+#include "blocksums.h"
+#include "inodetable.h"
+#include "readcoalescer.h"
+#include "computepool.h"
+#include "stripecache.h"
+#include "ioscheduler.h"
+#include "cancellation.h"
+#include "sharelatency.h"
+#include "sharereader.h"
+#include "smallfilecache.h"
+#include "pack.h"
+#include "paritycache.h"
+#include "lowlevelfrontend.h"
 
 using namespace ZFecFS;
 
@@ -148,3 +186,1651 @@ BOOST_AUTO_TEST_CASE(encode_decode_check)
         }
     }
 }
+
+BOOST_AUTO_TEST_CASE(block_cache_check)
+{
+    BlockCache cache(100);
+    BlockCache::ShareSet shareSet;
+    shareSet.id = "1:2/";
+    shareSet.version = "3:4/";
+
+    BOOST_CHECK(!cache.Lookup(shareSet, 0));
+    cache.Insert(shareSet, 0, boost::make_shared<std::vector<char> >(60, 'a'));
+    BOOST_REQUIRE(cache.Lookup(shareSet, 0));
+    BOOST_CHECK_EQUAL(cache.Lookup(shareSet, 0)->size(), 60);
+
+    // exceeding the budget evicts the least recently used block
+    cache.Insert(shareSet, 1, boost::make_shared<std::vector<char> >(60, 'b'));
+    BOOST_CHECK(!cache.Lookup(shareSet, 0));
+    BOOST_CHECK(cache.Lookup(shareSet, 1));
+    BOOST_CHECK_EQUAL(cache.GetStatistics().bytes, 60);
+    BOOST_CHECK_EQUAL(cache.GetStatistics().evictions, 1);
+
+    // modified shares invalidate their blocks
+    shareSet.version = "3:5/";
+    BOOST_CHECK(!cache.Lookup(shareSet, 1));
+    BOOST_CHECK_EQUAL(cache.GetStatistics().invalidations, 1);
+    BOOST_CHECK_EQUAL(cache.GetStatistics().bytes, 0);
+    BOOST_CHECK_EQUAL(cache.GetStatistics().hits, 3);
+    BOOST_CHECK_EQUAL(cache.GetStatistics().misses, 3);
+}
+
+BOOST_AUTO_TEST_CASE(encode_decode_cached_check)
+{
+    std::string contents;
+    for (unsigned int i = 0; i < 200000; ++i)
+        contents.push_back(char(i * 7 + i / 251));
+    FecWrapper fecWrapper(3, 10);
+    std::vector<boost::shared_ptr<AbstractFile> > encoded = EncodeFile(fecWrapper, 5, 7, contents);
+
+    BlockCache cache(1 << 20);
+    for (unsigned int pass = 0; pass < 2; ++pass) {
+        boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(encoded, fecWrapper));
+        decoder->UseBlockCache(cache);
+        std::vector<char> decoded(contents.size() + 10, '\0');
+        const size_t offsets[] = {0, 1, 49151, 49152, 100000, 199999};
+        for (unsigned int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+            BOOST_TEST_CHECKPOINT("Checking cached decode at offset " << offsets[i]);
+            const size_t expected = contents.size() - offsets[i];
+            BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), offsets[i]), expected);
+            BOOST_CHECK(std::equal(contents.begin() + offsets[i], contents.end(), decoded.begin()));
+        }
+    }
+    BOOST_CHECK(cache.GetStatistics().hits > 0);
+}
+
+/// A file whose reads fail.
+class FailingFile : public AbstractFile
+{
+public:
+    virtual ssize_t Read(char*, size_t, off_t) const
+    {
+        errno = EIO;
+        return -1;
+    }
+    virtual off_t Size() const { return 100; }
+};
+
+/// A share file that is rewritten in place, with the same inode and size
+/// but a new modification time.
+class RewrittenFile : public AbstractFile
+{
+public:
+    RewrittenFile(const boost::shared_ptr<AbstractFile>& before, const boost::shared_ptr<AbstractFile>& after)
+        : before(before), after(after), rewritten(false)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        return Current().Read(buffer, size, offset);
+    }
+    virtual off_t Size() const { return Current().Size(); }
+    virtual bool Stat(struct stat& statBuf) const
+    {
+        before->Stat(statBuf);
+        statBuf.st_mtim.tv_sec = rewritten ? 2 : 1;
+        return true;
+    }
+
+    void Rewrite() { rewritten = true; }
+
+private:
+    const AbstractFile& Current() const { return rewritten ? *after : *before; }
+
+    const boost::shared_ptr<AbstractFile> before;
+    const boost::shared_ptr<AbstractFile> after;
+    bool rewritten;
+};
+
+BOOST_AUTO_TEST_CASE(cached_decode_of_changed_shares_check)
+{
+    const std::string before(100000, 'a');
+    const std::string after(100000, 'b');
+    FecWrapper fecWrapper(3, 10);
+    std::vector<boost::shared_ptr<AbstractFile> > beforeShares = EncodeFile(fecWrapper, 5, 7, before);
+    std::vector<boost::shared_ptr<AbstractFile> > afterShares = EncodeFile(fecWrapper, 5, 7, after);
+    std::vector<boost::shared_ptr<RewrittenFile> > shares;
+    std::vector<boost::shared_ptr<AbstractFile> > files;
+    for (unsigned int i = 0; i < beforeShares.size(); ++i) {
+        shares.push_back(boost::make_shared<RewrittenFile>(beforeShares[i], afterShares[i]));
+        files.push_back(shares.back());
+    }
+
+    // a decoder that stays open does not serve the blocks of the old shares
+    BlockCache cache(1 << 20);
+    boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(files, fecWrapper));
+    decoder->UseBlockCache(cache);
+    char buffer[100];
+    BOOST_CHECK_EQUAL(decoder->Read(buffer, sizeof(buffer), 0), int(sizeof(buffer)));
+    BOOST_CHECK_EQUAL(buffer[0], 'a');
+    BOOST_CHECK_EQUAL(decoder->Read(buffer, sizeof(buffer), 0), int(sizeof(buffer)));
+    BOOST_CHECK_EQUAL(cache.GetStatistics().hits, 1u);
+    for (unsigned int i = 0; i < shares.size(); ++i)
+        shares[i]->Rewrite();
+    BOOST_CHECK_EQUAL(decoder->Read(buffer, sizeof(buffer), 0), int(sizeof(buffer)));
+    BOOST_CHECK_EQUAL(buffer[0], 'b');
+    BOOST_CHECK_EQUAL(buffer[99], 'b');
+    BOOST_CHECK_EQUAL(cache.GetStatistics().invalidations, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(mapped_file_check)
+{
+    char path[] = "/tmp/zfecfs_unittest_XXXXXX";
+    const int handle = mkstemp(path);
+    BOOST_REQUIRE(handle != -1);
+    std::string contents;
+    for (unsigned int i = 0; i < 100000; ++i)
+        contents.push_back(char(i * 13 + i / 253));
+    BOOST_REQUIRE_EQUAL(write(handle, contents.data(), contents.size()), ssize_t(contents.size()));
+
+    FecWrapper fecWrapper(3, 10);
+    for (unsigned int index = 0; index < 10; index += 4) {
+        BOOST_TEST_CHECKPOINT("Comparing mapped and in-memory encoding of share " << index);
+        boost::shared_ptr<FileEncoder> expectedEncoder = CreateEncoder(fecWrapper, index, contents);
+        FileEncoder mappedEncoder(boost::make_shared<MappedFile>(path), index, fecWrapper);
+        std::vector<char> expected(40000);
+        std::vector<char> mapped(40000);
+        BOOST_CHECK_EQUAL(expectedEncoder->Read(expected.data(), expected.size(), 5),
+                          mappedEncoder.Read(mapped.data(), mapped.size(), 5));
+        BOOST_CHECK(expected == mapped);
+    }
+
+    // views of a file that shrinks read zeros instead of crashing
+    MappedFile mappedFile(path);
+    boost::shared_ptr<const FileView> view = mappedFile.View(contents.size(), 0);
+    BOOST_REQUIRE(view);
+    BOOST_CHECK(view->Intact());
+    BOOST_REQUIRE_EQUAL(ftruncate(handle, 10), 0);
+    BOOST_CHECK_EQUAL(view->Data()[view->Size() - 1], 0);
+    BOOST_CHECK(!view->Intact());
+    char buffer[100];
+    BOOST_CHECK_EQUAL(mappedFile.Read(buffer, sizeof(buffer), 0), 10);
+    BOOST_CHECK(std::equal(buffer, buffer + 10, contents.begin()));
+
+    close(handle);
+    unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(direct_file_check)
+{
+    char path[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    const int handle = mkstemp(path);
+    BOOST_REQUIRE(handle != -1);
+    std::string contents;
+    for (unsigned int i = 0; i < 20000; ++i)
+        contents.push_back(char(i * 11 + i / 241));
+    BOOST_REQUIRE_EQUAL(write(handle, contents.data(), contents.size()), ssize_t(contents.size()));
+    close(handle);
+
+    DirectFile file(path);
+    BOOST_CHECK_EQUAL(file.Size(), off_t(contents.size()));
+    std::vector<char> buffer(contents.size());
+    const size_t offsets[] = {0, 1, 4095, 4096, 8193, 19999, 20000};
+    for (unsigned int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        BOOST_TEST_CHECKPOINT("Checking direct read at offset " << offsets[i]);
+        const size_t expected = contents.size() - offsets[i];
+        BOOST_CHECK_EQUAL(file.Read(buffer.data(), buffer.size(), offsets[i]), ssize_t(expected));
+        BOOST_CHECK(std::equal(contents.begin() + offsets[i], contents.end(), buffer.begin()));
+    }
+
+    FecWrapper fecWrapper(3, 10);
+    boost::shared_ptr<FileEncoder> expectedEncoder = CreateEncoder(fecWrapper, 7, contents);
+    FileEncoder directEncoder(boost::make_shared<DirectFile>(path), 7, fecWrapper);
+    std::vector<char> expected(7000);
+    std::vector<char> direct(7000);
+    BOOST_CHECK_EQUAL(expectedEncoder->Read(expected.data(), expected.size(), 1),
+                      directEncoder.Read(direct.data(), direct.size(), 1));
+    BOOST_CHECK(expected == direct);
+
+    unlink(path);
+}
+
+void WriteContents(const std::string& path, const std::string& contents)
+{
+    const int handle = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    BOOST_REQUIRE(handle != -1);
+    BOOST_REQUIRE_EQUAL(write(handle, contents.data(), contents.size()), ssize_t(contents.size()));
+    close(handle);
+}
+
+/// Waits until the parity cache serves share index of the source file at path.
+boost::shared_ptr<AbstractFile> OpenCached(ParityCache& cache, const std::string& path,
+                                           DecodedPath::ShareIndex index)
+{
+    boost::shared_ptr<AbstractFile> cached;
+    for (unsigned int tries = 0; tries < 300 && !cached; ++tries) {
+        cached = cache.Open(path, File(path), index);
+        if (!cached)
+            usleep(10000);
+    }
+    return cached;
+}
+
+/// Name of the cached share index of the file at path in the parity cache.
+std::string CachedShareName(const std::string& path, DecodedPath::ShareIndex index)
+{
+    struct stat statBuf;
+    BOOST_REQUIRE(stat(path.c_str(), &statBuf) == 0);
+    char name[64];
+    snprintf(name, sizeof(name), "%02x/%02x/%llx-%llx", index, (unsigned int)(statBuf.st_ino & 0xff),
+             (unsigned long long)statBuf.st_dev, (unsigned long long)statBuf.st_ino);
+    return name;
+}
+
+BOOST_AUTO_TEST_CASE(parity_cache_check)
+{
+    char root[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(root) != NULL);
+    const std::string source = std::string(root) + "/source/";
+    const std::string cacheDirectory = std::string(root) + "/cache/";
+    const std::string path = source + "file";
+    BOOST_REQUIRE(mkdir(source.c_str(), 0700) == 0);
+    BOOST_REQUIRE(mkdir(cacheDirectory.c_str(), 0700) == 0);
+    const std::string contents(100000, 'a');
+    WriteContents(path, contents);
+    const std::string cachedPath = cacheDirectory + CachedShareName(path, 4);
+
+    FecWrapper fecWrapper(3, 5);
+    {
+        // a miss schedules the share, nothing is computed before the worker is started
+        ParityCache cache(cacheDirectory, source, 0, 5, fecWrapper);
+        BOOST_CHECK(!cache.Open(path, File(path), 4));
+        usleep(50000);
+        BOOST_CHECK(!cache.Open(path, File(path), 4));
+        cache.Start();
+
+        boost::shared_ptr<AbstractFile> cached = OpenCached(cache, path, 4);
+        BOOST_REQUIRE(cached);
+        const size_t shareSize = FileEncoder::Size(contents.size(), 3);
+        BOOST_REQUIRE_EQUAL(cached->Size(), off_t(shareSize));
+        std::vector<char> expected(shareSize);
+        std::vector<char> read(shareSize);
+        CreateEncoder(fecWrapper, 4, contents)->Read(expected.data(), shareSize, 0);
+        BOOST_CHECK_EQUAL(cached->Read(read.data(), shareSize, 0), ssize_t(shareSize));
+        BOOST_CHECK(read == expected);
+        BOOST_CHECK(OpenCached(cache, path, 3));
+    }
+
+    // a stale stamp is not served and its share is removed
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = 2000000000;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    BOOST_REQUIRE(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+    {
+        ParityCache cache(cacheDirectory, source, 0, 5, fecWrapper);
+        BOOST_CHECK(access(cachedPath.c_str(), F_OK) == 0);
+        BOOST_CHECK(!cache.Open(path, File(path), 4));
+        BOOST_CHECK(access(cachedPath.c_str(), F_OK) != 0);
+    }
+
+    // each scan removes the shares of deleted files
+    const std::string otherPath = cacheDirectory + CachedShareName(path, 3);
+    BOOST_CHECK(access(otherPath.c_str(), F_OK) == 0);
+    unlink(path.c_str());
+    {
+        ParityCache cache(cacheDirectory, source, 1, 5, fecWrapper);
+        cache.Start();
+        for (unsigned int tries = 0; tries < 300 && access(otherPath.c_str(), F_OK) == 0; ++tries)
+            usleep(10000);
+        BOOST_CHECK(access(otherPath.c_str(), F_OK) != 0);
+    }
+
+    BOOST_CHECK_EQUAL(system(("rm -r " + std::string(root)).c_str()), 0);
+}
+
+BOOST_AUTO_TEST_CASE(open_state_cache_check)
+{
+    OpenStateCache<std::string, int> cache(3, 60);
+    boost::shared_ptr<int> first = boost::make_shared<int>(1);
+    cache.Put("first", first, 2);
+    cache.Put("second", boost::make_shared<int>(2), 2);
+    // over the limit, but "first" is still in use
+    BOOST_CHECK(cache.Get("first") == first);
+    BOOST_CHECK(!cache.Get("second"));
+
+    first.reset();
+    cache.Put("third", boost::make_shared<int>(3), 2);
+    BOOST_CHECK(!cache.Get("first"));
+    BOOST_REQUIRE(cache.Get("third"));
+    BOOST_CHECK_EQUAL(*cache.Get("third"), 3);
+
+    // once started, idle states are dropped without further opens
+    OpenStateCache<std::string, int> idle(3, 1);
+    idle.Start();
+    boost::shared_ptr<int> state = boost::make_shared<int>(4);
+    const boost::weak_ptr<int> dropped = state;
+    idle.Put("idle", state, 1);
+    state.reset();
+    sleep(3);
+    BOOST_CHECK(dropped.expired());
+}
+
+BOOST_AUTO_TEST_CASE(namespace_index_check)
+{
+    char root[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(root) != NULL);
+    const std::string source = std::string(root) + "/";
+    const char* directories[] = {"a", "b", "a/dir", "b/dir"};
+    for (unsigned int i = 0; i < sizeof(directories) / sizeof(directories[0]); ++i)
+        BOOST_REQUIRE(mkdir((source + directories[i]).c_str(), 0700) == 0);
+    const char* files[] = {"a/dir/x", "b/dir/y", "b/z", "a/z"};
+    for (unsigned int i = 0; i < 3; ++i)
+        close(open((source + files[i]).c_str(), O_CREAT | O_WRONLY, 0600));
+
+    {
+        NamespaceIndex index(source);
+        std::vector<std::string> paths;
+        // not kept up to date before it is started
+        BOOST_CHECK(!index.Lookup("/dir", 5, paths));
+        index.Start();
+        BOOST_REQUIRE(index.Lookup("/dir", 5, paths));
+        BOOST_CHECK_EQUAL(paths.size(), 2u);
+        BOOST_REQUIRE(index.Lookup("/dir", 1, paths));
+        BOOST_CHECK_EQUAL(paths.size(), 1u);
+        BOOST_REQUIRE(index.Lookup("/dir/x", 5, paths));
+        BOOST_REQUIRE_EQUAL(paths.size(), 1u);
+        BOOST_CHECK_EQUAL(paths[0], source + "a/dir/x");
+        BOOST_REQUIRE(index.Lookup("/missing", 5, paths));
+        BOOST_CHECK(paths.empty());
+
+        std::vector<NamespaceIndex::Entry> entries;
+        BOOST_REQUIRE(index.List("/dir", entries));
+        BOOST_REQUIRE_EQUAL(entries.size(), 2u);
+        BOOST_CHECK_EQUAL(entries[0].first, "x");
+        BOOST_CHECK_EQUAL(int(entries[0].second), int(DT_REG));
+        BOOST_CHECK_EQUAL(entries[1].first, "y");
+
+        // changes are picked up asynchronously
+        close(open((source + files[3]).c_str(), O_CREAT | O_WRONLY, 0600));
+        BOOST_REQUIRE(unlink((source + files[1]).c_str()) == 0);
+        for (unsigned int tries = 0; tries < 100; ++tries) {
+            index.Lookup("/z", 5, paths);
+            index.List("/dir", entries);
+            if (paths.size() == 2 && entries.size() == 1)
+                break;
+            usleep(10000);
+        }
+        BOOST_CHECK_EQUAL(paths.size(), 2u);
+        BOOST_CHECK_EQUAL(entries.size(), 1u);
+    }
+
+    for (unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+        unlink((source + files[i]).c_str());
+    for (unsigned int i = sizeof(directories) / sizeof(directories[0]); i > 0; --i)
+        rmdir((source + directories[i - 1]).c_str());
+    rmdir(root);
+}
+
+BOOST_AUTO_TEST_CASE(size_cache_check)
+{
+    SizeCache cache(2);
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_ino = 1;
+    statBuf.st_size = 10;
+    off_t size = 0;
+    BOOST_CHECK(!cache.Lookup(statBuf, size));
+    cache.Insert(statBuf, 21);
+    BOOST_CHECK(cache.Lookup(statBuf, size));
+    BOOST_CHECK_EQUAL(size, 21);
+
+    // modified files are not looked up
+    statBuf.st_mtim.tv_nsec = 1;
+    BOOST_CHECK(!cache.Lookup(statBuf, size));
+    cache.Insert(statBuf, 22);
+
+    struct stat other = statBuf;
+    other.st_ino = 2;
+    cache.Insert(other, 5);
+    other.st_ino = 3;
+    cache.Insert(other, 6);
+    BOOST_CHECK(!cache.Lookup(statBuf, size));
+    BOOST_CHECK(cache.Lookup(other, size));
+    BOOST_CHECK_EQUAL(size, 6);
+}
+
+BOOST_AUTO_TEST_CASE(directory_snapshot_check)
+{
+    DirectorySnapshot snapshot;
+    snapshot.Add("b", 1, DT_REG);
+    snapshot.Add("a", 2, DT_DIR);
+    snapshot.Add("b", 3, DT_REG);
+    snapshot.Add("c", 4, DT_LNK);
+    snapshot.RemoveDuplicates();
+    BOOST_REQUIRE_EQUAL(snapshot.Size(), 3u);
+    BOOST_CHECK_EQUAL(std::string(snapshot.Name(0)), "a");
+    BOOST_CHECK_EQUAL(std::string(snapshot.Name(1)), "b");
+    BOOST_CHECK_EQUAL(snapshot.Inode(1), ino_t(1));
+    BOOST_CHECK_EQUAL(std::string(snapshot.Name(2)), "c");
+    BOOST_CHECK_EQUAL(int(snapshot.Type(2)), int(DT_LNK));
+
+    char root[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(root) != NULL);
+    const std::string file = std::string(root) + "/file";
+    close(open(file.c_str(), O_CREAT | O_WRONLY, 0600));
+    const int handle = open(root, O_RDONLY | O_DIRECTORY);
+    BOOST_REQUIRE(handle != -1);
+    DirectorySnapshot listing;
+    listing.AddAll(handle);
+    close(handle);
+    listing.RemoveDuplicates();
+    BOOST_REQUIRE_EQUAL(listing.Size(), 3u);
+    BOOST_CHECK_EQUAL(std::string(listing.Name(0)), ".");
+    BOOST_CHECK_EQUAL(std::string(listing.Name(1)), "..");
+    BOOST_CHECK_EQUAL(std::string(listing.Name(2)), "file");
+    BOOST_CHECK_EQUAL(int(listing.Type(2)), int(DT_REG));
+    unlink(file.c_str());
+    rmdir(root);
+}
+
+BOOST_AUTO_TEST_CASE(manifest_check)
+{
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = S_IFREG | 0640;
+    statBuf.st_size = 12345;
+    statBuf.st_mtim.tv_sec = 1000;
+    statBuf.st_mtim.tv_nsec = 999;
+    const Metadata metadata(3, 7, statBuf.st_size);
+    Manifest manifest;
+    manifest.Add("with\nnewline and \\", statBuf, std::string(metadata.begin(), metadata.end()));
+    statBuf.st_mode = S_IFDIR | 0755;
+    manifest.Add("a directory", statBuf, "");
+    manifest.Sort();
+
+    const Manifest parsed = Manifest::Parse(manifest.Serialize());
+    BOOST_REQUIRE_EQUAL(parsed.Entries().size(), 2u);
+    const Manifest::Entry* file = parsed.Find("with\nnewline and \\");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_CHECK_EQUAL(file->mode, mode_t(S_IFREG | 0640));
+    BOOST_CHECK_EQUAL(file->size, 12345);
+    BOOST_CHECK_EQUAL(file->mtime.tv_nsec, 999);
+    BOOST_CHECK(file->header == std::string(metadata.begin(), metadata.end()));
+    const Manifest::Entry* dir = parsed.Find("a directory");
+    BOOST_REQUIRE(dir != NULL);
+    BOOST_CHECK(dir->header.empty());
+    BOOST_CHECK(parsed.Find("missing") == NULL);
+    BOOST_CHECK_THROW(Manifest::Parse("something else\n"), SimpleException);
+
+    // the cache only returns manifests that are not older than their directory
+    char root[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(root) != NULL);
+    const std::string path = std::string(root) + "/" + Manifest::fileName;
+    const std::string data = manifest.Serialize();
+    const int handle = open(path.c_str(), O_CREAT | O_WRONLY, 0600);
+    BOOST_REQUIRE_EQUAL(write(handle, data.data(), data.size()), ssize_t(data.size()));
+    close(handle);
+    ManifestCache cache(3, 4);
+    BOOST_REQUIRE(cache.Get(root));
+    BOOST_CHECK(cache.Get(root)->Find("a directory") != NULL);
+    BOOST_CHECK(!ManifestCache(2, 4).Get(root));
+
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = 1000;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    BOOST_REQUIRE(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+    BOOST_CHECK(!cache.Get(root));
+
+    unlink(path.c_str());
+    rmdir(root);
+}
+
+class FetchRecorder
+{
+public:
+    void Fetch(const std::string& path)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        fetched.push_back(path);
+    }
+
+    size_t Count()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return fetched.size();
+    }
+
+private:
+    boost::mutex mutex;
+    std::vector<std::string> fetched;
+};
+
+BOOST_AUTO_TEST_CASE(prefetcher_check)
+{
+    FetchRecorder recorder;
+    {
+        Prefetcher prefetcher(3, 100, boost::bind(&FetchRecorder::Fetch, &recorder, boost::placeholders::_1));
+        BOOST_CHECK(prefetcher.Enabled());
+        for (unsigned int i = 0; i < 50; ++i)
+            BOOST_CHECK(prefetcher.Enqueue(std::string(1, char('a' + i % 26)) + char('0' + i / 26)));
+        // queued before the threads are started
+        usleep(10000);
+        BOOST_CHECK_EQUAL(recorder.Count(), 0u);
+        prefetcher.Start();
+        for (unsigned int tries = 0; tries < 100 && recorder.Count() < 50; ++tries)
+            usleep(10000);
+    }
+    BOOST_CHECK_EQUAL(recorder.Count(), 50u);
+
+    Prefetcher disabled(0, 1, boost::bind(&FetchRecorder::Fetch, &recorder, boost::placeholders::_1));
+    BOOST_CHECK(!disabled.Enabled());
+    BOOST_CHECK(disabled.Enqueue("a"));
+    BOOST_CHECK(!disabled.Enqueue("b"));
+}
+
+class ChangeRecorder
+{
+public:
+    void Changed(const std::string& path, bool entryChanged)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        changes.insert(std::make_pair(path, entryChanged));
+    }
+
+    bool Seen(const std::string& path, bool entryChanged)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return changes.count(std::make_pair(path, entryChanged)) > 0;
+    }
+
+private:
+    boost::mutex mutex;
+    std::set<std::pair<std::string, bool> > changes;
+};
+
+BOOST_AUTO_TEST_CASE(source_watcher_check)
+{
+    char root[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(root) != NULL);
+    const std::string directory = std::string(root) + "/dir";
+    const std::string file = directory + "/file";
+
+    ChangeRecorder recorder;
+    {
+        SourceWatcher watcher(root, boost::bind(&ChangeRecorder::Changed, &recorder,
+                                                boost::placeholders::_1, boost::placeholders::_2));
+        BOOST_CHECK(watcher.Complete());
+        BOOST_REQUIRE(mkdir(directory.c_str(), 0700) == 0);
+        // changes before Start are reported once started
+        usleep(10000);
+        BOOST_CHECK(!recorder.Seen("/dir", true));
+        watcher.Start();
+        // the new directory is watched as soon as its creation is seen
+        for (unsigned int tries = 0; tries < 100 && !recorder.Seen("/dir", true); ++tries)
+            usleep(10000);
+        BOOST_CHECK(recorder.Seen("/dir", true));
+        const int handle = open(file.c_str(), O_CREAT | O_WRONLY, 0600);
+        BOOST_REQUIRE(handle != -1);
+        BOOST_CHECK_EQUAL(write(handle, "x", 1), 1);
+        close(handle);
+        for (unsigned int tries = 0; tries < 100 && !recorder.Seen("/dir/file", false); ++tries)
+            usleep(10000);
+    }
+    BOOST_CHECK(recorder.Seen("/dir/file", true));
+    BOOST_CHECK(recorder.Seen("/dir/file", false));
+
+    unlink(file.c_str());
+    rmdir(directory.c_str());
+    rmdir(root);
+
+    // directories that cannot be watched make it incomplete
+    SourceWatcher missing(std::string(root) + "/missing",
+                          boost::bind(&ChangeRecorder::Changed, &recorder,
+                                      boost::placeholders::_1, boost::placeholders::_2));
+    BOOST_CHECK(!missing.Complete());
+}
+
+BOOST_AUTO_TEST_CASE(change_journal_check)
+{
+    char path[] = "/var/tmp/zfecfs_unittest_XXXXXX";
+    const int handle = mkstemp(path);
+    BOOST_REQUIRE(handle != -1);
+    close(handle);
+
+    std::string listing;
+    {
+        ChangeJournal journal(path);
+        BOOST_CHECK_EQUAL(journal.Cursor(), 0u);
+        journal.Record("/a");
+        journal.Record("/b/c");
+        journal.Record("/a");
+        journal.Record("/b/with\nnewline");
+        BOOST_CHECK_EQUAL(journal.Cursor(), 4u);
+        BOOST_REQUIRE(journal.Changes(0, listing));
+        // names with newlines are replaced by their directory
+        BOOST_CHECK_EQUAL(listing, "a\nb\nb/c\n");
+        BOOST_REQUIRE(journal.Changes(2, listing));
+        BOOST_CHECK_EQUAL(listing, "a\nb\n");
+        BOOST_CHECK(!journal.Changes(5, listing));
+    }
+
+    // the journal survives a restart, with lost changes recorded as "everything"
+    ChangeJournal journal(path);
+    BOOST_CHECK_EQUAL(journal.Cursor(), 4u);
+    journal.Record("");
+    BOOST_REQUIRE(journal.Changes(4, listing));
+    BOOST_CHECK_EQUAL(listing, ".\n");
+
+    // once changes can be missed, everything is changed for any cursor
+    journal.Record("/a");
+    BOOST_REQUIRE(journal.Changes(5, listing));
+    BOOST_CHECK_EQUAL(listing, "a\n");
+    journal.MarkIncomplete();
+    BOOST_CHECK_EQUAL(journal.Cursor(), 7u);
+    BOOST_REQUIRE(journal.Changes(5, listing));
+    BOOST_CHECK_EQUAL(listing, ".\n");
+    BOOST_REQUIRE(journal.Changes(7, listing));
+    BOOST_CHECK_EQUAL(listing, ".\n");
+    BOOST_CHECK(!journal.Changes(8, listing));
+    unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(block_sums_check)
+{
+    FecWrapper fecWrapper(3, 10);
+    std::string contents;
+    for (unsigned int i = 0; i < 10000; ++i)
+        contents.push_back(char(i * 7 + i / 253));
+    boost::shared_ptr<FileEncoder> encoder = CreateEncoder(fecWrapper, 5, contents);
+    const off_t shareSize = FileEncoder::Size(contents.size(), 3);
+
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_ino = 42;
+    statBuf.st_size = contents.size();
+
+    BlockSums sums(1024, 1 << 20);
+    const BlockSums::ShareReader read = boost::bind(&FileEncoder::Read, encoder.get(), boost::placeholders::_1,
+                                                    boost::placeholders::_2, boost::placeholders::_3);
+    const std::string file = sums.Get(statBuf, 5, shareSize, read);
+    BOOST_CHECK_EQUAL(off_t(file.size()), sums.FileSize(shareSize));
+    BOOST_CHECK_EQUAL(file.substr(0, file.find('\n')), "zfecfs-sums sha256 1024 3337");
+    // 4 blocks, the last one short
+    BOOST_CHECK_EQUAL(std::count(file.begin(), file.end(), '\n'), 5);
+
+    // cached as long as the source is unchanged
+    const BlockSums::ShareReader failing = boost::bind(&FileEncoder::Read, boost::shared_ptr<FileEncoder>(),
+                                                       boost::placeholders::_1, boost::placeholders::_2,
+                                                       boost::placeholders::_3);
+    BOOST_CHECK(sums.Get(statBuf, 5, shareSize, failing) == file);
+    boost::shared_ptr<FileEncoder> otherEncoder = CreateEncoder(fecWrapper, 5, contents + "x");
+    statBuf.st_size += 1;
+    const std::string changed = sums.Get(statBuf, 5, FileEncoder::Size(contents.size() + 1, 3),
+                                         boost::bind(&FileEncoder::Read, otherEncoder.get(), boost::placeholders::_1,
+                                                     boost::placeholders::_2, boost::placeholders::_3));
+    BOOST_CHECK(changed != file);
+}
+
+BOOST_AUTO_TEST_CASE(inode_table_check)
+{
+    InodeTable inodes;
+    BOOST_CHECK_EQUAL(InodeTable::ChildPath("/", "00"), "/00");
+    BOOST_CHECK_EQUAL(InodeTable::ChildPath("/00", "a"), "/00/a");
+
+    std::string path;
+    BOOST_CHECK(inodes.Path(InodeTable::rootId, path));
+    BOOST_CHECK_EQUAL(path, "/");
+
+    const InodeTable::Id id = inodes.Add("/00/a");
+    BOOST_CHECK(id != InodeTable::rootId);
+    BOOST_CHECK_EQUAL(inodes.Add("/00/a"), id);
+    BOOST_CHECK(inodes.Add("/00/b") != id);
+    BOOST_CHECK_EQUAL(inodes.Find("/00/a"), id);
+    BOOST_CHECK(inodes.Path(id, path));
+    BOOST_CHECK_EQUAL(path, "/00/a");
+
+    // dropped once both lookups are forgotten
+    inodes.Forget(id, 1);
+    BOOST_CHECK_EQUAL(inodes.Find("/00/a"), id);
+    inodes.Forget(id, 1);
+    BOOST_CHECK_EQUAL(inodes.Find("/00/a"), InodeTable::Id(0));
+    BOOST_CHECK(!inodes.Path(id, path));
+    BOOST_CHECK(inodes.Add("/00/a") != id);
+
+    inodes.Forget(InodeTable::rootId, 100);
+    BOOST_CHECK_EQUAL(inodes.Size(), size_t(3));
+}
+
+namespace {
+
+/// Stands in for a fuse request to the low-level front end, records the reply.
+class FakeRequest {
+public:
+    explicit FakeRequest(LowLevelFrontEnd& frontEnd)
+        : frontEnd(frontEnd), interrupted(false), error(-1), node(0), replied(0)
+    {}
+
+    fuse_req_t Get() { return reinterpret_cast<fuse_req_t>(this); }
+    static FakeRequest& From(fuse_req_t request) { return *reinterpret_cast<FakeRequest*>(request); }
+
+    LowLevelFrontEnd& frontEnd;
+    bool interrupted; // replies fail like for an interrupted request
+    int error; // of the last reply, 0 for attributes
+    fuse_ino_t node; // of the last entry replied
+    std::vector<std::pair<std::string, off_t> > entries; // added to directory replies
+    size_t replied; // bytes of the last buffer replied
+};
+
+/// Lists count entries at once without offsets, any other path than
+/// "/missing" exists.
+class ListingBackend : public ZFecFS::ZFecFS {
+public:
+    explicit ListingBackend(unsigned int count)
+        : ZFecFS(1, 2, "/", Options())
+        , count(count)
+    {}
+
+    virtual int Getattr(const char* path, struct stat* stbuf)
+    {
+        if (strcmp(path, "/missing") == 0)
+            return -ENOENT;
+        stbuf->st_mode = S_IFREG | 0444;
+        return 0;
+    }
+    virtual int Opendir(const char*, struct fuse_file_info*) { return 0; }
+    virtual int Readdir(const char*, void* buffer, fuse_fill_dir_t filler,
+                        off_t, struct fuse_file_info*)
+    {
+        for (unsigned int i = 0; i < count; ++i) {
+            const std::string name = std::string("e") + char('0' + i);
+            if (filler(buffer, name.c_str(), NULL, 0) == 1)
+                break;
+        }
+        return 0;
+    }
+    virtual int Releasedir(const char*, struct fuse_file_info*) { return 0; }
+    virtual int Open(const char*, struct fuse_file_info*) { return -EACCES; }
+    virtual int Read(const char*, char*, size_t, off_t, struct fuse_file_info*) { return -EIO; }
+    virtual int Release(const char*, struct fuse_file_info*) { return 0; }
+
+private:
+    const unsigned int count;
+};
+
+/// Size of every directory entry added by the fake fuse_add_direntry.
+const size_t direntrySize = 32;
+
+} // anonymous namespace
+
+// the replies of libfuse, replaced for the requests of the tests
+
+extern "C" void* fuse_req_userdata(fuse_req_t request)
+{
+    return &FakeRequest::From(request).frontEnd;
+}
+
+extern "C" int fuse_req_interrupted(fuse_req_t request)
+{
+    return FakeRequest::From(request).interrupted;
+}
+
+extern "C" int fuse_reply_err(fuse_req_t request, int error)
+{
+    FakeRequest::From(request).error = error;
+    return 0;
+}
+
+extern "C" void fuse_reply_none(fuse_req_t)
+{
+}
+
+extern "C" int fuse_reply_entry(fuse_req_t request, const struct fuse_entry_param* entry)
+{
+    FakeRequest& fake = FakeRequest::From(request);
+    fake.error = 0;
+    fake.node = entry->ino;
+    return fake.interrupted ? -ENOENT : 0;
+}
+
+extern "C" int fuse_reply_attr(fuse_req_t request, const struct stat*, double)
+{
+    FakeRequest::From(request).error = 0;
+    return 0;
+}
+
+extern "C" int fuse_reply_open(fuse_req_t request, const struct fuse_file_info*)
+{
+    FakeRequest& fake = FakeRequest::From(request);
+    fake.error = 0;
+    return fake.interrupted ? -ENOENT : 0;
+}
+
+extern "C" int fuse_reply_buf(fuse_req_t request, const char*, size_t size)
+{
+    FakeRequest& fake = FakeRequest::From(request);
+    fake.error = 0;
+    fake.replied = size;
+    return 0;
+}
+
+extern "C" size_t fuse_add_direntry(fuse_req_t request, char*, size_t bufferSize, const char* name,
+                                    const struct stat*, off_t offset)
+{
+    // like libfuse, only adds the entry if it fits but always returns its size
+    if (direntrySize <= bufferSize)
+        FakeRequest::From(request).entries.push_back(std::make_pair(std::string(name), offset));
+    return direntrySize;
+}
+
+BOOST_AUTO_TEST_CASE(low_level_front_end_check)
+{
+    ListingBackend backend(5);
+    LowLevelFrontEnd frontEnd(backend, 1.0);
+    const struct fuse_lowlevel_ops operations = LowLevelFrontEnd::Operations();
+
+    // a node lives until all its lookups are forgotten
+    FakeRequest lookup(frontEnd);
+    operations.lookup(lookup.Get(), InodeTable::rootId, "a");
+    BOOST_CHECK_EQUAL(lookup.error, 0);
+    const fuse_ino_t node = lookup.node;
+    BOOST_CHECK(node != 0 && node != InodeTable::rootId);
+    operations.lookup(lookup.Get(), InodeTable::rootId, "a");
+    BOOST_CHECK_EQUAL(lookup.node, node);
+    FakeRequest forget(frontEnd);
+    operations.forget(forget.Get(), node, 1);
+    FakeRequest getattr(frontEnd);
+    operations.getattr(getattr.Get(), node, NULL);
+    BOOST_CHECK_EQUAL(getattr.error, 0);
+    operations.forget(forget.Get(), node, 1);
+    operations.getattr(getattr.Get(), node, NULL);
+    BOOST_CHECK_EQUAL(getattr.error, ENOENT);
+
+    operations.lookup(lookup.Get(), InodeTable::rootId, "b");
+    operations.lookup(lookup.Get(), InodeTable::rootId, "b");
+    struct fuse_forget_data forgets[] = {{lookup.node, 2}};
+    operations.forget_multi(forget.Get(), 1, forgets);
+    operations.getattr(getattr.Get(), lookup.node, NULL);
+    BOOST_CHECK_EQUAL(getattr.error, ENOENT);
+
+    // neither failed lookups nor interrupted replies leave a node behind
+    operations.lookup(lookup.Get(), InodeTable::rootId, "missing");
+    BOOST_CHECK_EQUAL(lookup.error, ENOENT);
+    lookup.interrupted = true;
+    operations.lookup(lookup.Get(), InodeTable::rootId, "c");
+    operations.getattr(getattr.Get(), lookup.node, NULL);
+    BOOST_CHECK_EQUAL(getattr.error, ENOENT);
+
+    // the backend lists all entries at once, the front end pages through them
+    struct fuse_file_info fileInfo;
+    memset(&fileInfo, 0, sizeof(fileInfo));
+    std::vector<std::pair<std::string, off_t> > listed;
+    off_t offset = 0;
+    for (unsigned int pages = 0; pages < 10; ++pages) {
+        FakeRequest readdir(frontEnd);
+        operations.readdir(readdir.Get(), InodeTable::rootId, 2 * direntrySize + 1, offset, &fileInfo);
+        BOOST_CHECK_EQUAL(readdir.error, 0);
+        BOOST_CHECK_EQUAL(readdir.replied, readdir.entries.size() * direntrySize);
+        if (readdir.entries.empty())
+            break;
+        BOOST_CHECK(readdir.entries.size() <= 2);
+        listed.insert(listed.end(), readdir.entries.begin(), readdir.entries.end());
+        offset = readdir.entries.back().second;
+    }
+    BOOST_REQUIRE_EQUAL(listed.size(), 5u);
+    for (unsigned int i = 0; i < listed.size(); ++i) {
+        BOOST_CHECK_EQUAL(listed[i].first, std::string("e") + char('0' + i));
+        BOOST_CHECK_EQUAL(listed[i].second, off_t(i + 1));
+    }
+}
+
+namespace {
+
+/// Serves reads from a string and counts them, slowly if asked to.
+class CountingReader {
+public:
+    CountingReader(const std::string& contents, unsigned int delayMilliseconds)
+        : contents(contents), delayMilliseconds(delayMilliseconds), reads(0)
+    {}
+
+    int Read(char* outBuffer, size_t size, off_t offset)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            ++reads;
+        }
+        usleep(delayMilliseconds * 1000);
+        if (offset >= off_t(contents.size()))
+            return 0;
+        const size_t sizeRead = std::min(size, contents.size() - size_t(offset));
+        memcpy(outBuffer, contents.data() + offset, sizeRead);
+        return sizeRead;
+    }
+
+    unsigned int Reads()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return reads;
+    }
+
+private:
+    const std::string contents;
+    const unsigned int delayMilliseconds;
+    boost::mutex mutex;
+    unsigned int reads;
+};
+
+void CoalescedRead(ReadCoalescer& coalescer, CountingReader& reader, size_t size, off_t offset,
+                   std::string& result)
+{
+    std::vector<char> buffer(size);
+    const int sizeRead = coalescer.Read(buffer.data(), size, offset,
+                                        boost::bind(&CountingReader::Read, &reader, boost::placeholders::_1,
+                                                    boost::placeholders::_2, boost::placeholders::_3));
+    result.assign(buffer.data(), std::max(sizeRead, 0));
+}
+
+int RecordTarget(char** target, char* outBuffer, size_t size, off_t)
+{
+    *target = outBuffer;
+    memset(outBuffer, 'x', size);
+    return size;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(read_coalescer_check)
+{
+    std::string contents;
+    for (int i = 0; i < 1000; ++i)
+        contents.push_back(char('a' + i % 26));
+
+    // unaligned reads, adjacent chunks are read with a single call
+    ReadCoalescer coalescer(64);
+    CountingReader reader(contents, 0);
+    std::string result;
+    CoalescedRead(coalescer, reader, 300, 10, result);
+    BOOST_CHECK(result == contents.substr(10, 300));
+    BOOST_CHECK_EQUAL(reader.Reads(), 1u);
+    CoalescedRead(coalescer, reader, 100, 950, result);
+    BOOST_CHECK(result == contents.substr(950));
+    CoalescedRead(coalescer, reader, 10, 1000, result);
+    BOOST_CHECK(result.empty());
+
+    // a read overlapping one in flight waits for it instead of reading again
+    CountingReader slowReader(contents, 200);
+    std::string first;
+    std::string second;
+    boost::thread reading(boost::bind(&CoalescedRead, boost::ref(coalescer), boost::ref(slowReader),
+                                      128, 0, boost::ref(first)));
+    usleep(50000);
+    CoalescedRead(coalescer, slowReader, 100, 20, second);
+    reading.join();
+    BOOST_CHECK(first == contents.substr(0, 128));
+    BOOST_CHECK(second == contents.substr(20, 100));
+    BOOST_CHECK_EQUAL(slowReader.Reads(), 1u);
+
+    // only aligned reads go directly into the caller's buffer
+    char buffer[128];
+    char* target = NULL;
+    BOOST_CHECK_EQUAL(coalescer.Read(buffer, 128, 64, boost::bind(&RecordTarget, &target, boost::placeholders::_1,
+                                                                  boost::placeholders::_2,
+                                                                  boost::placeholders::_3)), 128);
+    BOOST_CHECK(target == buffer);
+    BOOST_CHECK_EQUAL(coalescer.Read(buffer, 100, 64, boost::bind(&RecordTarget, &target, boost::placeholders::_1,
+                                                                  boost::placeholders::_2,
+                                                                  boost::placeholders::_3)), 100);
+    BOOST_CHECK(target != buffer);
+    BOOST_CHECK_EQUAL(std::string(buffer, 100), std::string(100, 'x'));
+}
+
+namespace {
+
+void Throw()
+{
+    throw SimpleException("Task failed.");
+}
+
+void Count(boost::mutex* mutex, int* count)
+{
+    boost::lock_guard<boost::mutex> lock(*mutex);
+    ++*count;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(compute_pool_check)
+{
+    ComputePool pool(4);
+    BOOST_CHECK(pool.Enabled());
+    BOOST_CHECK(!ComputePool(1).Enabled());
+    {
+        // the submitting thread runs all tasks until the threads are started
+        boost::mutex mutex;
+        int count = 0;
+        pool.Run(std::vector<ComputePool::Task>(20, boost::bind(&Count, &mutex, &count)));
+        BOOST_CHECK_EQUAL(count, 20);
+    }
+    pool.Start();
+
+    // pieces are read in parallel and joined to the result of one read
+    std::string contents;
+    for (int i = 0; i < 1000; ++i)
+        contents.push_back(char('a' + i % 26));
+    CountingReader reader(contents, 0);
+    const ComputePool::Reader read = boost::bind(&CountingReader::Read, &reader, boost::placeholders::_1,
+                                                 boost::placeholders::_2, boost::placeholders::_3);
+    std::vector<char> buffer(1200);
+    BOOST_CHECK_EQUAL(pool.Read(buffer.data(), 1200, 10, 100, read), 990);
+    BOOST_CHECK(std::string(buffer.data(), 990) == contents.substr(10));
+    BOOST_CHECK_EQUAL(reader.Reads(), 13u);
+    BOOST_CHECK_EQUAL(pool.Read(buffer.data(), 50, 110, 100, read), 50);
+    BOOST_CHECK_EQUAL(reader.Reads(), 14u);
+
+    std::vector<ComputePool::Task> tasks(3, &Throw);
+    BOOST_CHECK_THROW(pool.Run(tasks), SimpleException);
+
+    // encoding and decoding large reads on the pool gives the same data
+    std::string file;
+    for (int i = 0; i < 3 << 20; ++i)
+        file.push_back(char(i * 7 + i / 251));
+    FecWrapper fecWrapper(3, 5);
+    std::vector<boost::shared_ptr<AbstractFile> > encoded = EncodeFile(fecWrapper, 2, 4, file);
+    boost::shared_ptr<FileEncoder> encoder = CreateEncoder(fecWrapper, 4, file);
+    encoder->UseComputePool(pool);
+    std::vector<char> share(FileEncoder::Size(file.size(), 3));
+    BOOST_CHECK_EQUAL(encoder->Read(share.data(), share.size(), 0), int(share.size()));
+    std::vector<char> expected(share.size());
+    encoded[2]->Read(expected.data(), expected.size(), 0);
+    BOOST_CHECK(share == expected);
+
+    boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(encoded, fecWrapper));
+    decoder->UseComputePool(pool);
+    std::vector<char> decoded(file.size() + 100);
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 5), int(file.size() - 5));
+    BOOST_CHECK(std::string(decoded.data(), file.size() - 5) == file.substr(5));
+
+    BlockCache cache(1 << 20);
+    boost::scoped_ptr<FileDecoder> cachedDecoder(FileDecoder::Open(encoded, fecWrapper));
+    cachedDecoder->UseBlockCache(cache);
+    cachedDecoder->UseComputePool(pool);
+    BOOST_CHECK_EQUAL(cachedDecoder->Read(decoded.data(), 1 << 20, 12345), 1 << 20);
+    BOOST_CHECK(std::string(decoded.data(), 1 << 20) == file.substr(12345, 1 << 20));
+}
+
+BOOST_AUTO_TEST_CASE(stripe_cache_check)
+{
+    std::ostringstream name;
+    name << "/zfecfs-test-" << getpid();
+    shm_unlink(name.str().c_str());
+
+    std::string contents;
+    for (int i = 0; i < 200000; ++i)
+        contents.push_back(char(i * 13 + i / 509));
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_ino = 7;
+    statBuf.st_size = contents.size();
+
+    {
+        // two mappings of the segment, as two processes would have
+        StripeCache first(name.str(), 64 * StripeCache::blockSize);
+        StripeCache second(name.str(), 1);
+
+        StripeCachedFile file(boost::make_shared<TestFile>(contents), first, statBuf);
+        std::vector<char> buffer(contents.size() + 10);
+        BOOST_CHECK_EQUAL(file.Read(buffer.data(), buffer.size(), 0), ssize_t(contents.size()));
+        BOOST_CHECK(std::string(buffer.data(), contents.size()) == contents);
+        BOOST_CHECK_EQUAL(file.Read(buffer.data(), 1000, 65000), 1000);
+        BOOST_CHECK(std::string(buffer.data(), 1000) == contents.substr(65000, 1000));
+
+        // the other mapping serves the blocks without reading the file
+        StripeCachedFile other(boost::make_shared<TestFile>(std::string(contents.size(), 'x')),
+                               second, statBuf);
+        BOOST_CHECK_EQUAL(other.Read(buffer.data(), 5000, 150000), 5000);
+        BOOST_CHECK(std::string(buffer.data(), 5000) == contents.substr(150000, 5000));
+
+        // a modified file misses
+        statBuf.st_mtim.tv_sec = 1;
+        StripeCachedFile modified(boost::make_shared<TestFile>(std::string(contents.size(), 'x')),
+                                  second, statBuf);
+        BOOST_CHECK_EQUAL(modified.Read(buffer.data(), 10, 0), 10);
+        BOOST_CHECK(std::string(buffer.data(), 10) == "xxxxxxxxxx");
+
+        // read errors are passed on, not cached
+        statBuf.st_mtim.tv_sec = 2;
+        StripeCachedFile failing(boost::make_shared<FailingFile>(), first, statBuf);
+        BOOST_CHECK_EQUAL(failing.Read(buffer.data(), 10, 0), -1);
+        BOOST_CHECK_EQUAL(failing.Read(buffer.data(), 2 * StripeCache::blockSize, 0), -1);
+    }
+    // unlinked by the last process closing it
+    BOOST_CHECK_EQUAL(shm_open(name.str().c_str(), O_RDWR, 0), -1);
+
+    // a segment of another layout is replaced
+    const int handle = shm_open(name.str().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    BOOST_REQUIRE(handle != -1);
+    BOOST_REQUIRE(ftruncate(handle, 1 << 20) == 0);
+    BOOST_CHECK_EQUAL(write(handle, "zfecfs-stripes\n", 16), 16);
+    close(handle);
+    {
+        StripeCache first(name.str(), 4 * StripeCache::blockSize);
+        StripeCache second(name.str(), 1);
+        statBuf.st_mtim.tv_sec = 0;
+        StripeCachedFile file(boost::make_shared<TestFile>(contents), first, statBuf);
+        std::vector<char> buffer(100);
+        BOOST_CHECK_EQUAL(file.Read(buffer.data(), buffer.size(), 0), 100);
+        StripeCachedFile other(boost::make_shared<TestFile>(std::string(contents.size(), 'x')),
+                               second, statBuf);
+        BOOST_CHECK_EQUAL(other.Read(buffer.data(), buffer.size(), 0), 100);
+        BOOST_CHECK(std::string(buffer.data(), 100) == contents.substr(0, 100));
+    }
+    shm_unlink(name.str().c_str());
+
+    // not shared with other users
+    std::ostringstream defaultName;
+    defaultName << "/zfecfs-stripes-" << getuid();
+    BOOST_CHECK_EQUAL(StripeCache::DefaultName(), defaultName.str());
+}
+
+namespace {
+
+/// Reads with the given class and records the order the reads started in.
+class ScheduledReader {
+public:
+    ScheduledReader(IoScheduler& scheduler, IoScheduler::Class ioClass, std::vector<int>& order,
+                    boost::mutex& orderMutex)
+        : scheduler(scheduler), ioClass(ioClass), order(order), orderMutex(orderMutex)
+    {}
+
+    void operator()()
+    {
+        IoScheduler::ClassScope scope(ioClass);
+        IoScheduler::Ticket ticket(scheduler, 1, 100);
+        boost::lock_guard<boost::mutex> lock(orderMutex);
+        order.push_back(ioClass);
+    }
+
+private:
+    IoScheduler& scheduler;
+    const IoScheduler::Class ioClass;
+    std::vector<int>& order;
+    boost::mutex& orderMutex;
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(io_scheduler_check)
+{
+    BOOST_CHECK_EQUAL(IoScheduler::CurrentClass(), IoScheduler::foreground);
+    {
+        IoScheduler::ClassScope scope(IoScheduler::background);
+        BOOST_CHECK_EQUAL(IoScheduler::CurrentClass(), IoScheduler::background);
+    }
+    BOOST_CHECK_EQUAL(IoScheduler::CurrentClass(), IoScheduler::foreground);
+
+    // while the only slot of the device is taken, a background read queued
+    // first still has to let a foreground read go first
+    IoScheduler scheduler(1, std::vector<size_t>());
+    std::vector<int> order;
+    boost::mutex orderMutex;
+    boost::thread_group readers;
+    {
+        IoScheduler::Ticket busy(scheduler, 1, 100);
+        readers.create_thread(ScheduledReader(scheduler, IoScheduler::background, order, orderMutex));
+        usleep(50000);
+        readers.create_thread(ScheduledReader(scheduler, IoScheduler::foreground, order, orderMutex));
+        usleep(50000);
+    }
+    readers.join_all();
+    BOOST_REQUIRE_EQUAL(order.size(), 2u);
+    BOOST_CHECK_EQUAL(order[0], int(IoScheduler::foreground));
+    BOOST_CHECK_EQUAL(order[1], int(IoScheduler::background));
+
+    // background reads are limited to 1 MB/s after the first second worth
+    std::vector<size_t> rates(3, 0);
+    rates[IoScheduler::background] = 1000000;
+    IoScheduler limited(0, rates);
+    IoScheduler::ClassScope scope(IoScheduler::background);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < 12; ++i)
+        IoScheduler::Ticket ticket(limited, 1, 100000);
+    gettimeofday(&end, NULL);
+    const double seconds = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1e6;
+    BOOST_CHECK(seconds > 0.15 && seconds < 1.0);
+
+    // scheduled files read like the file they wrap
+    boost::shared_ptr<AbstractFile> file
+            = boost::make_shared<ScheduledFile>(boost::make_shared<TestFile>(std::string("abcdef")), scheduler);
+    char buffer[4];
+    BOOST_CHECK_EQUAL(file->Read(buffer, 4, 2), 4);
+    BOOST_CHECK(std::string(buffer, 4) == "cdef");
+}
+
+bool FlagSet(void* flag)
+{
+    return *static_cast<bool*>(flag);
+}
+
+int ReadCancelled(char*, size_t, off_t)
+{
+    throw Cancelled();
+}
+
+BOOST_AUTO_TEST_CASE(cancellation_check)
+{
+    BOOST_CHECK(!Cancellation::Requested());
+    bool interrupted = false;
+    bool innerInterrupted = true;
+    {
+        Cancellation::Scope scope(Cancellation::Context(FlagSet, &interrupted));
+        BOOST_CHECK(!Cancellation::Requested());
+        {
+            Cancellation::Scope inner(Cancellation::Context(FlagSet, &innerInterrupted));
+            BOOST_CHECK(Cancellation::Requested());
+        }
+        BOOST_CHECK(!Cancellation::Requested());
+
+        // an interrupted read stops before encoding the next batch
+        std::string file(100000, 'x');
+        FecWrapper fecWrapper(3, 5);
+        boost::shared_ptr<FileEncoder> encoder = CreateEncoder(fecWrapper, 4, file);
+        std::vector<char> share(FileEncoder::Size(file.size(), 3));
+        BOOST_CHECK_EQUAL(encoder->Read(share.data(), share.size(), 0), int(share.size()));
+        interrupted = true;
+        BOOST_CHECK_THROW(encoder->Read(share.data(), share.size(), 0), Cancelled);
+
+        // tasks of an interrupted request are skipped, also on the pool threads
+        ComputePool pool(4);
+        pool.Start();
+        boost::mutex mutex;
+        int count = 0;
+        std::vector<ComputePool::Task> tasks(20, boost::bind(&Count, &mutex, &count));
+        BOOST_CHECK_THROW(pool.Run(tasks), Cancelled);
+        BOOST_CHECK_EQUAL(count, 0);
+        interrupted = false;
+        pool.Run(tasks);
+        BOOST_CHECK_EQUAL(count, 20);
+    }
+    BOOST_CHECK(!Cancellation::Requested());
+
+    // an interrupted leader does not leave its chunks in flight
+    ReadCoalescer coalescer(100);
+    char buffer[250];
+    BOOST_CHECK_THROW(coalescer.Read(buffer, 250, 0, &ReadCancelled), Cancelled);
+    CountingReader reader(std::string(300, 'y'), 0);
+    BOOST_CHECK_EQUAL(coalescer.Read(buffer, 250, 0,
+                                     boost::bind(&CountingReader::Read, &reader, boost::placeholders::_1,
+                                                 boost::placeholders::_2, boost::placeholders::_3)), 250);
+}
+
+pthread_t fuseThread;
+bool fuseRequestInterrupted = false;
+boost::mutex foreignChecksMutex;
+unsigned int foreignInterruptChecks = 0;
+
+extern "C" int fuse_interrupted(void)
+{
+    // libfuse dereferences the missing request on threads outside fuse
+    if (!pthread_equal(pthread_self(), fuseThread)) {
+        boost::lock_guard<boost::mutex> lock(foreignChecksMutex);
+        ++foreignInterruptChecks;
+        return 0;
+    }
+    return fuseRequestInterrupted;
+}
+
+BOOST_AUTO_TEST_CASE(thread_check_check)
+{
+    fuseThread = pthread_self();
+    ComputePool pool(4);
+    pool.Start();
+    const std::string file(600000, 'x');
+    FecWrapper fecWrapper(3, 5);
+    boost::shared_ptr<FileEncoder> encoder = CreateEncoder(fecWrapper, 4, file);
+    encoder->UseComputePool(pool);
+    std::vector<char> share(FileEncoder::Size(file.size(), 3));
+    std::vector<char> expected(share.size());
+    CreateEncoder(fecWrapper, 4, file)->Read(expected.data(), expected.size(), 0);
+
+    // the pool threads working for the read only see the result of the
+    // check on the fuse thread
+    {
+        Cancellation::ThreadCheck interrupted(fuse_interrupted);
+        Cancellation::Scope scope(interrupted.GetContext());
+        BOOST_CHECK_EQUAL(encoder->Read(share.data(), share.size(), 0), int(share.size()));
+        BOOST_CHECK(share == expected);
+    }
+    fuseRequestInterrupted = true;
+    {
+        Cancellation::ThreadCheck interrupted(fuse_interrupted);
+        Cancellation::Scope scope(interrupted.GetContext());
+        BOOST_CHECK_THROW(encoder->Read(share.data(), share.size(), 0), Cancelled);
+    }
+    fuseRequestInterrupted = false;
+    BOOST_CHECK_EQUAL(foreignInterruptChecks, 0u);
+}
+
+class SlowFile : public TestFile
+{
+public:
+    explicit SlowFile(const AbstractFile& file)
+        : TestFile(Contents(file))
+        , delay(0)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        if (delay > 0)
+            usleep(useconds_t(delay * 1e6));
+        return TestFile::Read(buffer, size, offset);
+    }
+
+    double delay;
+
+private:
+    static std::string Contents(const AbstractFile& file)
+    {
+        std::vector<char> contents(file.Size());
+        file.Read(contents.data(), contents.size(), 0);
+        return std::string(contents.begin(), contents.end());
+    }
+};
+
+BOOST_AUTO_TEST_CASE(hedged_read_check)
+{
+    ShareLatency latency;
+    BOOST_CHECK_EQUAL(latency.Quantile("a", 0.5), 0.0);
+    for (int i = 0; i < 99; ++i)
+        latency.Record("a", 10e-6);
+    latency.Record("a", 1.0);
+    BOOST_CHECK(latency.Quantile("a", 0.5) >= 10e-6 && latency.Quantile("a", 0.5) < 20e-6);
+    BOOST_CHECK(latency.Quantile("a", 1.0) >= 1.0 && latency.Quantile("a", 1.0) < 2.0);
+    // old samples fade out
+    for (int i = 0; i < 5000; ++i)
+        latency.Record("a", 0.01);
+    BOOST_CHECK(latency.Quantile("a", 0.5) >= 0.01 && latency.Quantile("a", 0.5) < 0.02);
+
+    TimedFile timed(boost::make_shared<TestFile>(std::string("abc")), latency, "b");
+    char buffer[3];
+    BOOST_CHECK_EQUAL(timed.Read(buffer, 3, 0), 3);
+    BOOST_CHECK(latency.Quantile("b", 0.5) > 0);
+
+    // a slow share is replaced by a spare for the reads that would wait for it
+    std::string file;
+    for (int i = 0; i < 100000; ++i)
+        file.push_back(char(i * 11 + i / 253));
+    FecWrapper fecWrapper(3, 5);
+    std::vector<boost::shared_ptr<AbstractFile> > encoded = EncodeFile(fecWrapper, 0, 4, file);
+    boost::shared_ptr<SlowFile> slow = boost::make_shared<SlowFile>(*encoded[1]);
+    std::vector<boost::shared_ptr<AbstractFile> > shares(encoded.begin(), encoded.begin() + 3);
+    shares[1] = slow;
+    boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(shares, fecWrapper));
+    decoder->UseSpares(std::vector<boost::shared_ptr<AbstractFile> >(encoded.begin() + 3, encoded.end()));
+    ShareReader reader(8);
+    decoder->UseHedging(reader, 0.01);
+    std::vector<char> decoded(30000);
+    // before the threads are started the waiting thread reads
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 5), int(decoded.size()));
+    BOOST_CHECK(std::string(decoded.begin(), decoded.end()) == file.substr(5, decoded.size()));
+    reader.StartWorkers();
+    slow->delay = 0.3;
+
+    const double start = ShareLatency::Now();
+    for (int offset = 0; offset < 90000; offset += 30000) {
+        BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), offset + 7), int(decoded.size()));
+        BOOST_CHECK(std::string(decoded.begin(), decoded.end()) == file.substr(offset + 7, decoded.size()));
+    }
+    BOOST_CHECK(ShareLatency::Now() - start < 0.3);
+    slow->delay = 0;
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 99990), 10);
+    BOOST_CHECK(std::string(decoded.data(), 10) == file.substr(99990));
+}
+
+class FlakyFile : public TestFile
+{
+public:
+    explicit FlakyFile(const std::string& contents)
+        : TestFile(contents)
+        , limit(contents.size())
+        , broken(false)
+        , reads(0)
+    {}
+
+    virtual ssize_t Read(char* buffer, size_t size, off_t offset) const
+    {
+        ++reads;
+        if (broken)
+            throw SimpleException("Broken disk.");
+        if (offset >= limit)
+            return 0;
+        return TestFile::Read(buffer, std::min<off_t>(size, limit - offset), offset);
+    }
+
+    off_t limit;
+    bool broken;
+    mutable unsigned int reads;
+};
+
+BOOST_AUTO_TEST_CASE(failover_check)
+{
+    std::string file;
+    for (int i = 0; i < 50000; ++i)
+        file.push_back(char(i * 5 + i / 241));
+    FecWrapper fecWrapper(3, 5);
+    std::vector<boost::shared_ptr<AbstractFile> > encoded = EncodeFile(fecWrapper, 0, 4, file);
+    std::vector<char> share(encoded[1]->Size());
+    encoded[1]->Read(share.data(), share.size(), 0);
+    boost::shared_ptr<FlakyFile> flaky = boost::make_shared<FlakyFile>(std::string(share.begin(), share.end()));
+    std::vector<boost::shared_ptr<AbstractFile> > shares(encoded.begin(), encoded.begin() + 3);
+    shares[1] = flaky;
+    const std::vector<boost::shared_ptr<AbstractFile> > spares(encoded.begin() + 3, encoded.end());
+
+    // a share truncated while it is read is replaced by a spare
+    boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(shares, fecWrapper));
+    decoder->UseSpares(spares);
+    flaky->limit = 5000;
+    std::vector<char> decoded(file.size());
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 0), int(file.size()));
+    BOOST_CHECK(std::string(decoded.begin(), decoded.end()) == file);
+    const unsigned int reads = flaky->reads;
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), 1000, 100), 1000);
+    BOOST_CHECK(std::string(decoded.data(), 1000) == file.substr(100, 1000));
+    BOOST_CHECK_EQUAL(flaky->reads, reads);
+
+    // without spares the read fails
+    flaky->limit = share.size();
+    decoder.reset(FileDecoder::Open(shares, fecWrapper));
+    flaky->broken = true;
+    BOOST_CHECK_THROW(decoder->Read(decoded.data(), decoded.size(), 0), SimpleException);
+
+    // so does a hedged one
+    ShareReader reader(4);
+    reader.StartWorkers();
+    decoder->UseHedging(reader, 0.01);
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 0), -EIO);
+
+    // a hedged read replaces the share as well
+    flaky->broken = false;
+    decoder.reset(FileDecoder::Open(shares, fecWrapper));
+    decoder->UseSpares(spares);
+    decoder->UseHedging(reader, 0.01);
+    flaky->broken = true;
+    BOOST_CHECK_EQUAL(decoder->Read(decoded.data(), decoded.size(), 0), int(file.size()));
+    BOOST_CHECK(std::string(decoded.begin(), decoded.end()) == file);
+}
+
+BOOST_AUTO_TEST_CASE(sparse_source_check)
+{
+    // 3 MB with data in the middle and a few bytes at the end, the rest are holes
+    char path[] = "/tmp/zfecfs_unittest_XXXXXX";
+    const int handle = mkstemp(path);
+    BOOST_REQUIRE(handle != -1);
+    std::string contents(3000001, '\0');
+    for (unsigned int i = 1000000; i < 1100000; ++i)
+        contents[i] = char(i * 13 + i / 253);
+    contents.replace(contents.size() - 3, 3, "end");
+    BOOST_REQUIRE_EQUAL(ftruncate(handle, contents.size()), 0);
+    BOOST_REQUIRE_EQUAL(pwrite(handle, contents.data() + 1000000, 100000, 1000000), 100000);
+    BOOST_REQUIRE_EQUAL(pwrite(handle, contents.data() + contents.size() - 3, 3, contents.size() - 3), 3);
+
+    boost::shared_ptr<File> file = boost::make_shared<File>(path);
+    BOOST_CHECK(file->NextData(0) <= 1000000);
+    BOOST_CHECK_EQUAL(file->NextData(1000000), 1000000);
+    BOOST_CHECK_EQUAL(TestFile(contents).NextData(5), 5);
+
+    // holes and zeros encode like the zeros they read as
+    FecWrapper fecWrapper(3, 10);
+    for (unsigned int index = 0; index < 10; index += 4) {
+        BOOST_TEST_CHECKPOINT("Comparing sparse and in-memory encoding of share " << index);
+        boost::shared_ptr<FileEncoder> expectedEncoder = CreateEncoder(fecWrapper, index, contents);
+        FileEncoder sparseEncoder(file, index, fecWrapper);
+        const size_t shareSize = FileEncoder::Size(contents.size(), 3);
+        std::vector<char> expected(shareSize);
+        std::vector<char> sparse(shareSize);
+        BOOST_CHECK_EQUAL(expectedEncoder->Read(expected.data(), expected.size(), 0), int(shareSize));
+        BOOST_CHECK_EQUAL(sparseEncoder.Read(sparse.data(), sparse.size(), 0), int(shareSize));
+        BOOST_CHECK(expected == sparse);
+        BOOST_CHECK_EQUAL(sparseEncoder.Read(sparse.data(), 100, shareSize - 50), 50);
+        BOOST_CHECK(std::equal(sparse.begin(), sparse.begin() + 50, expected.end() - 50));
+    }
+
+    std::vector<char> zeros(30000);
+    std::vector<char> parity(zeros.size() / 3 + Metadata::size, 'x');
+    BOOST_CHECK_EQUAL(CreateEncoder(fecWrapper, 7, std::string(zeros.size(), '\0'))->Read(parity.data(), parity.size(), 0),
+                      int(parity.size()));
+    BOOST_CHECK(std::count(parity.begin() + Metadata::size, parity.end(), 0) == int(zeros.size() / 3));
+
+    close(handle);
+    unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(small_file_cache_check)
+{
+    FecWrapper fecWrapper(3, 10);
+    const size_t sizes[] = {0, 1, 3, 100, 10001};
+    for (unsigned int s = 0; s < 5; ++s) {
+        std::string contents(sizes[s], '\0');
+        for (size_t i = 0; i < contents.size(); ++i)
+            contents[i] = char(i * 7 + i / 101);
+        SmallFileCache::SharesPtr shares = SmallFileCache::Encode(TestFile(contents), contents.size(),
+                                                                  fecWrapper, 10);
+        BOOST_REQUIRE(shares);
+        BOOST_REQUIRE_EQUAL(shares->size(), 10u);
+        for (unsigned int index = 0; index < 10; ++index) {
+            BOOST_TEST_CHECKPOINT("Comparing share " << index << " of " << contents.size() << " bytes");
+            const size_t shareSize = FileEncoder::Size(contents.size(), 3);
+            std::vector<char> expected(shareSize);
+            BOOST_CHECK_EQUAL(CreateEncoder(fecWrapper, index, contents)->Read(expected.data(), shareSize, 0),
+                              int(shareSize));
+            BOOST_CHECK_EQUAL_COLLECTIONS(expected.begin(), expected.end(),
+                                          (*shares)[index].begin(), (*shares)[index].end());
+        }
+        // a file that is not of the size it was stat'ed with is not encoded
+        BOOST_CHECK(!SmallFileCache::Encode(TestFile(contents), contents.size() + 1, fecWrapper, 10));
+    }
+
+    SmallFileCache cache(100, 1000);
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = S_IFREG | 0644;
+    statBuf.st_ino = 1;
+    statBuf.st_size = 100;
+    BOOST_CHECK(cache.Covers(statBuf));
+    statBuf.st_size = 101;
+    BOOST_CHECK(!cache.Covers(statBuf));
+    statBuf.st_size = 100;
+
+    SmallFileCache::SharesPtr shares = SmallFileCache::Encode(TestFile(std::string(100, 'a')), 100,
+                                                              fecWrapper, 10);
+    BOOST_CHECK(!cache.Lookup(statBuf));
+    cache.Insert(statBuf, shares);
+    BOOST_CHECK(cache.Lookup(statBuf) == shares);
+
+    // changed files are not looked up
+    statBuf.st_ctim.tv_nsec = 1;
+    BOOST_CHECK(!cache.Lookup(statBuf));
+    cache.Insert(statBuf, shares);
+
+    // bounded by bytes, the least recently used file goes first
+    struct stat other = statBuf;
+    other.st_ino = 2;
+    cache.Insert(other, shares);
+    BOOST_CHECK(cache.Lookup(statBuf));
+    other.st_ino = 3;
+    cache.Insert(other, shares);
+    BOOST_CHECK(cache.Lookup(statBuf));
+    other.st_ino = 2;
+    BOOST_CHECK(!cache.Lookup(other));
+}
+
+ssize_t ReadPacked(const std::map<std::string, std::string>& files, const std::string& name,
+                   char* buffer, size_t size)
+{
+    const std::string& contents = files.find(name)->second;
+    const size_t sizeRead = std::min(size, contents.size());
+    memcpy(buffer, contents.data(), sizeRead);
+    return sizeRead;
+}
+
+BOOST_AUTO_TEST_CASE(pack_check)
+{
+    std::map<std::string, std::string> files;
+    files["b"] = "contents of b";
+    files["a\nwith newline"] = "";
+    files["c"] = std::string(5000, 'c');
+
+    Pack pack;
+    struct stat statBuf;
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = S_IFREG | 0640;
+    statBuf.st_mtim.tv_sec = 1000;
+    statBuf.st_mtim.tv_nsec = 999;
+    for (std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        statBuf.st_size = it->second.size();
+        pack.Add(it->first, statBuf);
+    }
+    pack.Sort();
+    const std::string data = pack.Serialize(boost::bind(&ReadPacked, boost::cref(files), boost::placeholders::_1,
+                                                        boost::placeholders::_2, boost::placeholders::_3));
+    BOOST_REQUIRE_EQUAL(off_t(data.size()), pack.Size());
+
+    // the index is read from the decoded shares of the pack, the files with random access
+    FecWrapper fecWrapper(3, 5);
+    SmallFileCache::SharesPtr shares = SmallFileCache::Encode(MemoryFile(data), data.size(), fecWrapper, 5);
+    std::vector<boost::shared_ptr<AbstractFile> > encoded;
+    for (unsigned int index = 2; index < 5; ++index)
+        encoded.push_back(boost::make_shared<MemoryFile>((*shares)[index]));
+    boost::scoped_ptr<FileDecoder> decoder(FileDecoder::Open(encoded, fecWrapper));
+    const Pack parsed = Pack::ParseIndex(boost::bind(&FileDecoder::Read, decoder.get(), boost::placeholders::_1,
+                                                     boost::placeholders::_2, boost::placeholders::_3));
+    BOOST_REQUIRE_EQUAL(parsed.Entries().size(), 3u);
+    for (std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        BOOST_TEST_CHECKPOINT("Checking packed file " << it->first);
+        const Pack::Entry* entry = parsed.Find(it->first);
+        BOOST_REQUIRE(entry != NULL);
+        BOOST_CHECK_EQUAL(entry->mode, mode_t(S_IFREG | 0640));
+        BOOST_CHECK_EQUAL(entry->mtime.tv_nsec, 999);
+        const std::string& expected = it->second;
+        BOOST_REQUIRE_EQUAL(entry->size, off_t(expected.size()));
+        std::vector<char> contents(expected.size());
+        BOOST_CHECK_EQUAL(decoder->Read(contents.data(), contents.size(), entry->offset), int(contents.size()));
+        BOOST_CHECK_EQUAL_COLLECTIONS(contents.begin(), contents.end(), expected.begin(), expected.end());
+    }
+    BOOST_CHECK(parsed.Find("missing") == NULL);
+
+    Pack empty;
+    empty.Sort();
+    const std::string emptyData = empty.Serialize(Pack::FileReader());
+    BOOST_CHECK(Pack::ParseIndex(boost::bind(&MemoryFile::Read, boost::make_shared<MemoryFile>(emptyData),
+                                             boost::placeholders::_1, boost::placeholders::_2,
+                                             boost::placeholders::_3)).Entries().empty());
+    BOOST_CHECK_THROW(Pack::ParseIndex(boost::bind(&MemoryFile::Read, boost::make_shared<MemoryFile>(data.substr(1)),
+                                                   boost::placeholders::_1, boost::placeholders::_2,
+                                                   boost::placeholders::_3)), SimpleException);
+    BOOST_CHECK_THROW(Pack::ParseIndex(boost::bind(&MemoryFile::Read, boost::make_shared<MemoryFile>(data.substr(0, 100)),
+                                                   boost::placeholders::_1, boost::placeholders::_2,
+                                                   boost::placeholders::_3)), SimpleException);
+
+    // files that shrank or grew since they were listed fail the pack
+    files["b"] = "contents";
+    BOOST_CHECK_THROW(pack.Serialize(boost::bind(&ReadPacked, boost::cref(files), boost::placeholders::_1,
+                                                 boost::placeholders::_2, boost::placeholders::_3)),
+                      SimpleException);
+    files["b"] = "contents of b, appended";
+    BOOST_CHECK_THROW(pack.Serialize(boost::bind(&ReadPacked, boost::cref(files), boost::placeholders::_1,
+                                                 boost::placeholders::_2, boost::placeholders::_3)),
+                      SimpleException);
+    files["b"] = "contents of b";
+    BOOST_CHECK(pack.Serialize(boost::bind(&ReadPacked, boost::cref(files), boost::placeholders::_1,
+                                           boost::placeholders::_2, boost::placeholders::_3)) == data);
+}
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <exception>
+#include <string>
 
 namespace ZFecFS {
 
@@ -48,6 +49,41 @@ struct Hex {
     }
 };
 
+/// Escapes newlines (and backslashes) so that strings which can contain
+/// anything but null, like file names, can be stored one per line.
+struct LineEscape {
+    static std::string Escape(const std::string& text)
+    {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (std::string::const_iterator it = text.begin(); it != text.end(); ++it) {
+            if (*it == '\\')
+                escaped.append("\\\\");
+            else if (*it == '\n')
+                escaped.append("\\n");
+            else
+                escaped.push_back(*it);
+        }
+        return escaped;
+    }
+
+    static std::string Unescape(const std::string& escaped)
+    {
+        std::string text;
+        text.reserve(escaped.size());
+        for (std::string::const_iterator it = escaped.begin(); it != escaped.end(); ++it) {
+            if (*it != '\\') {
+                text.push_back(*it);
+                continue;
+            }
+            if (++it == escaped.end())
+                throw SimpleException("Invalid escape sequence.");
+            text.push_back(*it == 'n' ? '\n' : *it);
+        }
+        return text;
+    }
+};
+
 } // namespace ZFecFS
 
 #endif // UTILS_H
@@ -9,7 +9,16 @@ extern "C" {
 #include <fuse.h>
 }
 
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+
 #include "fecwrapper.h"
+#include "options.h"
+#include "file.h"
+#include "mappedfile.h"
+#include "cacheinvalidator.h"
+#include "computepool.h"
+#include "ioscheduler.h"
 
 namespace ZFecFS {
 
@@ -20,6 +29,10 @@ protected:
     const unsigned int numShares;
     const std::string source; // must be /-terminated
     const FecWrapper fecWrapper;
+    const Options options;
+    CacheInvalidator* invalidator;
+    ComputePool computePool;
+    boost::scoped_ptr<IoScheduler> ioScheduler;
 
 public:
     static ZFecFS& GetInstance();
@@ -28,6 +41,18 @@ public:
 
     const FecWrapper& GetFecWrapper() const { return fecWrapper; }
 
+    /// Sets the object that is told about stale kernel caches, if the
+    /// front end is able to invalidate them.
+    void SetInvalidator(CacheInvalidator* invalidator) { this->invalidator = invalidator; }
+
+    /// Starts the threads working in the background. Called by the front
+    /// end once the process is daemonized, threads started before would
+    /// not survive the fork.
+    virtual void Start()
+    {
+        computePool.Start();
+    }
+
     virtual int Getattr(const char* path, struct stat* stbuf) = 0;
     virtual int Opendir(const char* path, struct fuse_file_info* fileInfo) = 0;
     virtual int Readdir(const char* path, void* buffer, fuse_fill_dir_t filler,
@@ -40,16 +65,39 @@ public:
 
 
 protected:
-    ZFecFS(unsigned int sharesRequired, unsigned int numShares, const std::string& source)
+    ZFecFS(unsigned int sharesRequired, unsigned int numShares, const std::string& source,
+           const Options& options)
         : sharesRequired(sharesRequired)
         , numShares(numShares)
         , source(source)
         , fecWrapper(sharesRequired, numShares)
+        , options(options)
+        , invalidator(NULL)
+        , computePool(options.computeThreads)
     {
+        if (options.SchedulesIo())
+            ioScheduler.reset(new IoScheduler(options.ioQueueDepth, options.ioRates));
     }
 
     virtual ~ZFecFS()
     { }
+
+    /// Opens a source or share file with the backend selected by the options.
+    boost::shared_ptr<AbstractFile> OpenFile(const std::string& path) const
+    {
+        if (options.mappedFiles)
+            return Schedule(boost::make_shared<MappedFile>(path));
+        else
+            return Schedule(boost::make_shared<File>(path));
+    }
+
+    /// Returns file with its reads going through the IoScheduler, if there is one.
+    boost::shared_ptr<AbstractFile> Schedule(const boost::shared_ptr<AbstractFile>& file) const
+    {
+        if (ioScheduler)
+            return boost::make_shared<ScheduledFile>(file, *ioScheduler);
+        return file;
+    }
 };
 
 
@@ -3,12 +3,34 @@ CONFIG += console
 CONFIG -= app_bundle
 CONFIG -= qt
 DEFINES += _FILE_OFFSET_BITS=64
-LIBS += -lboost_system # TODO can we get rid of this?
+LIBS += -lboost_system -lboost_thread -lcrypto -lrt # TODO can we get rid of boost_system?
 SOURCES += fec.c \
     zfecfsencoder.cpp \
     zfecfsdecoder.cpp \
     fileencoder.cpp \
     filedecoder.cpp \
+    blockcache.cpp \
+    paritycache.cpp \
+    mappedfile.cpp \
+    directfile.cpp \
+    namespaceindex.cpp \
+    sizecache.cpp \
+    directorysnapshot.cpp \
+    manifest.cpp \
+    prefetcher.cpp \
+    sourcewatcher.cpp \
+    changejournal.cpp \
+    blocksums.cpp \
+    inodetable.cpp \
+    readcoalescer.cpp \
+    computepool.cpp \
+    stripecache.cpp \
+    ioscheduler.cpp \
+    cancellation.cpp \
+    sharelatency.cpp \
+    sharereader.cpp \
+    smallfilecache.cpp \
+    pack.cpp \
     metadata.cpp
 CCFLAG += --std=c11 -O3
 HEADERS += \
@@ -24,14 +46,46 @@ HEADERS += \
     file.h \
     threadlocalizer.h \
     fileencoder.h \
-    filedecoder.h
+    filedecoder.h \
+    blockcache.h \
+    paritycache.h \
+    mappedfile.h \
+    directfile.h \
+    openstatecache.h \
+    namespaceindex.h \
+    sizecache.h \
+    directorysnapshot.h \
+    manifest.h \
+    prefetcher.h \
+    sourcewatcher.h \
+    cacheinvalidator.h \
+    changejournal.h \
+    blocksums.h \
+    inodetable.h \
+    readcoalescer.h \
+    computepool.h \
+    stripecache.h \
+    ioscheduler.h \
+    cancellation.h \
+    sharelatency.h \
+    sharereader.h \
+    deferredfile.h \
+    smallfilecache.h \
+    pack.h \
+    lowlevelfrontend.h \
+    options.h
 
 test {
-    SOURCES += test/unittest.cpp
+    # the unit test replaces the fuse replies the front end sends
+    SOURCES += test/unittest.cpp lowlevelfrontend.cpp
     HEADERS += test/testfile.h
     DEFINES += BOOST_TEST_MAIN BOOST_TEST_DYN_LINK
+    LIBS += -lfuse
     TARGET = zfecfs_unittest
+} else:bench {
+    SOURCES += test/benchmark.cpp
+    TARGET = zfecfs_benchmark
 } else {
-    SOURCES += main.cpp
+    SOURCES += main.cpp lowlevelfrontend.cpp
     LIBS += -lfuse
 }
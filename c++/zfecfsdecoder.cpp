@@ -9,25 +9,59 @@
 #include <iostream>
 #include <string>
 #include <algorithm>
-#include <tr1/unordered_set>
 
 #include <boost/foreach.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
 
 #include "directory.h"
+#include "deferredfile.h"
 #include "filedecoder.h"
 #include "utils.h"
 
 namespace ZFecFS {
 
+const double ZFecFSDecoder::defaultHedgeDelay = 0.05;
+const double ZFecFSDecoder::hedgeQuantile = 0.95;
+
 int ZFecFSDecoder::Getattr(const char *path, struct stat *stbuf)
 {
     if (path[0] != '/') return -ENOENT;
 
     try {
-        std::string realPath = GetFirstPathMatchInAnyShare(path, stbuf);
+        const std::string pathString(path);
+        const std::string::size_type slash = pathString.rfind('/');
+        const std::string name = pathString.substr(slash + 1);
+        if ((options.manifests && name == Manifest::fileName)
+                || (options.packedFileSize > 0 && name == Pack::fileName))
+            return -ENOENT;
+        if (options.manifests && !name.empty()) {
+            boost::shared_ptr<const Manifest> manifest
+                    = GetManifest(slash == 0 ? "/" : pathString.substr(0, slash));
+            if (manifest) {
+                const Manifest::Entry* entry = manifest->Find(name);
+                if (entry == NULL)
+                    return -ENOENT;
+                entry->ToStat(*stbuf);
+                return 0;
+            }
+        }
+
+        std::string realPath;
+        try {
+            realPath = GetFirstPathMatchInAnyShare(path, stbuf);
+        } catch (const std::exception& exc) {
+            if (options.packedFileSize == 0 || name.empty())
+                throw;
+            const Handle pack = OpenPack(slash == 0 ? "/" : pathString.substr(0, slash));
+            const Pack::Entry* entry = pack->pack->Find(name);
+            if (entry == NULL)
+                return -ENOENT;
+            entry->ToStat(*stbuf);
+            return 0;
+        }
         if (S_ISREG(stbuf->st_mode))
-            stbuf->st_size = FileDecoder::Size(realPath);
+            stbuf->st_size = DecodedSize(realPath, *stbuf);
     } catch (const std::exception& exc) {
         return -ENOENT;
     }
@@ -43,8 +77,31 @@ int ZFecFSDecoder::Opendir(const char* path, fuse_file_info* fileInfo)
         // check whether the directory exists in at least one share
         GetFirstPathMatchInAnyShare(path);
 
+        DirectorySnapshot* snapshot = new DirectorySnapshot();
+        bool fromManifest;
+        try {
+            fromManifest = TakeSnapshot(path, *snapshot);
+        } catch (...) {
+            delete snapshot;
+            throw;
+        }
+
+        // ls -l and du will stat all entries right after reading them
+        if (prefetcher.Enabled() && !fromManifest) {
+            std::string entryPath(path);
+            if (entryPath[entryPath.size() - 1] != '/')
+                entryPath += '/';
+            const size_t directoryLength = entryPath.size();
+            for (size_t i = 0; i < snapshot->Size(); ++i) {
+                if (snapshot->Type(i) != DT_REG && snapshot->Type(i) != DT_UNKNOWN)
+                    continue;
+                entryPath.resize(directoryLength);
+                if (!prefetcher.Enqueue(entryPath.append(snapshot->Name(i))))
+                    break;
+            }
+        }
         fileInfo->keep_cache = 1;
-        fileInfo->fh = reinterpret_cast<uint64_t>(new std::string(path));
+        fileInfo->fh = reinterpret_cast<uint64_t>(snapshot);
     } catch (const std::exception& exc) {
         return -ENOENT;
     }
@@ -53,18 +110,189 @@ int ZFecFSDecoder::Opendir(const char* path, fuse_file_info* fileInfo)
 }
 
 int ZFecFSDecoder::Readdir(const char*, void* buffer, fuse_fill_dir_t filler,
-                           off_t /*offset*/, fuse_file_info* fileInfo)
+                           off_t offset, fuse_file_info* fileInfo)
 {
-    const std::string& path = *reinterpret_cast<std::string*>(fileInfo->fh);
-
-    Directory sourceDir(GetSource());
+    const DirectorySnapshot& snapshot = *reinterpret_cast<DirectorySnapshot*>(fileInfo->fh);
 
-    std::tr1::unordered_set<std::string> entriesSeen;
+    // offset 0 and 1 are '.' and '..', entry i of the snapshot is at i + 2
     struct stat st;
     memset(&st, 0, sizeof(st));
+    for (size_t position = offset; position < snapshot.Size() + 2; ++position) {
+        const char* name;
+        if (position < 2) {
+            name = position == 0 ? "." : "..";
+            st.st_ino = 0;
+            st.st_mode = S_IFDIR;
+        } else {
+            name = snapshot.Name(position - 2);
+            st.st_ino = snapshot.Inode(position - 2);
+            st.st_mode = DTTOIF(snapshot.Type(position - 2));
+        }
+        if (filler(buffer, name, &st, position + 1) == 1)
+            break;
+    }
+
+    return 0;
+}
+
+int ZFecFSDecoder::Releasedir(const char *, fuse_file_info *fileInfo)
+{
+    delete reinterpret_cast<DirectorySnapshot*>(fileInfo->fh);
+    return 0;
+}
 
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
+int ZFecFSDecoder::Open(const char *path, fuse_file_info *fileInfo)
+{
+    try {
+        Handle state;
+        try {
+            state = OpenDecoder(path);
+        } catch (const std::exception& exc) {
+            const std::string pathString(path);
+            const std::string::size_type slash = pathString.rfind('/');
+            if (options.packedFileSize == 0 || slash == std::string::npos)
+                throw;
+            const Handle pack = OpenPack(slash == 0 ? "/" : pathString.substr(0, slash));
+            const Pack::Entry* entry = pack->pack->Find(pathString.substr(slash + 1));
+            if (entry == NULL)
+                throw;
+            // shares the decoder of the pack, reading only the range of the file
+            state = boost::make_shared<OpenFileState>(*pack);
+            state->pack.reset();
+            state->packedOffset = entry->offset;
+            state->packedSize = entry->size;
+        }
+        fileInfo->fh = ToHandle(new Handle(state));
+    } catch (const std::exception& exc) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+ZFecFSDecoder::Handle ZFecFSDecoder::OpenDecoder(const char* path)
+{
+    if (openFiles.Enabled()) {
+        Handle state = openFiles.Get(path);
+        if (state && state->StillValid())
+            return state;
+    }
+
+    const unsigned int sharesRequired = fecWrapper.GetSharesRequired();
+    struct stat statBuf;
+    // the shares beyond the required ones are spares in case one fails
+    std::vector<std::string> paths = GetFirstNumPathMatchesInAnyShare(path, numShares, &statBuf,
+                                                                      sharesRequired);
+    if (paths.size() < sharesRequired || sharesRequired < 1)
+        throw SimpleException("Not enough encoded files.");
+    if (options.fastestShares || shareReader)
+        SortByLatency(paths);
+
+    Handle state = boost::make_shared<OpenFileState>();
+    // TODO vector of shared_ptr is not nice...
+    std::vector<boost::shared_ptr<AbstractFile> > files;
+    std::vector<boost::shared_ptr<AbstractFile> > spares;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (i >= sharesRequired) {
+            spares.push_back(boost::make_shared<DeferredFile>(boost::bind(&ZFecFSDecoder::OpenShare,
+                                                                          this, paths[i])));
+            continue;
+        }
+        files.push_back(OpenShare(paths[i]));
+        state->shareStats.push_back(statBuf);
+        files.back()->Stat(state->shareStats.back());
+    }
+    paths.resize(sharesRequired);
+
+    state->decoder.reset(FileDecoder::Open(files, fecWrapper));
+    state->decoder->UseBlockCache(blockCache);
+    state->decoder->UseComputePool(computePool);
+    state->decoder->UseSpares(spares);
+    if (shareReader)
+        state->decoder->UseHedging(*shareReader, HedgeDelay(paths));
+    state->sharePaths = paths;
+    if (openFiles.Enabled())
+        openFiles.Put(path, state, files.size());
+    return state;
+}
+
+boost::shared_ptr<AbstractFile> ZFecFSDecoder::OpenShare(const std::string& path)
+{
+    boost::shared_ptr<AbstractFile> file = OpenFile(path);
+    if (options.fastestShares || shareReader)
+        file = boost::make_shared<TimedFile>(file, boost::ref(shareLatency), ShareDirectory(path));
+    return file;
+}
+
+ZFecFSDecoder::Handle ZFecFSDecoder::OpenPack(const std::string& path)
+{
+    if (packs.Enabled()) {
+        Handle state = packs.Get(path);
+        if (state && state->StillValid())
+            return state;
+    }
+
+    std::string packPath = path;
+    if (packPath[packPath.size() - 1] != '/')
+        packPath += '/';
+    packPath += Pack::fileName;
+    Handle state = OpenDecoder(packPath.c_str());
+    boost::shared_ptr<const Pack> pack;
+    {
+        boost::lock_guard<boost::mutex> lock(packMutex);
+        pack = state->pack;
+    }
+    if (!pack) {
+        pack = boost::make_shared<Pack>(Pack::ParseIndex(boost::bind(&FileDecoder::Read, state->decoder.get(),
+                                                                     boost::placeholders::_1,
+                                                                     boost::placeholders::_2,
+                                                                     boost::placeholders::_3)));
+        boost::lock_guard<boost::mutex> lock(packMutex);
+        if (!state->pack)
+            state->pack = pack;
+    }
+    if (packs.Enabled()) {
+        // a copy sharing the decoder, a state held by both caches would
+        // never look unused to either of them
+        Handle cached;
+        {
+            boost::lock_guard<boost::mutex> lock(packMutex);
+            cached = boost::make_shared<OpenFileState>(*state);
+        }
+        packs.Put(path, cached, state->sharePaths.size());
+    }
+    return state;
+}
+
+bool ZFecFSDecoder::TakeSnapshot(const char* path, DirectorySnapshot& snapshot)
+{
+    if (options.manifests) {
+        boost::shared_ptr<const Manifest> manifest = GetManifest(path);
+        if (manifest) {
+            BOOST_FOREACH(const Manifest::Entry& entry, manifest->Entries())
+                snapshot.Add(entry.name.c_str(), 0, IFTODT(entry.mode));
+            return true;
+        }
+    }
+
+    bool packed = false;
+    std::vector<NamespaceIndex::Entry> entries;
+    if (namespaceIndex && namespaceIndex->List(path, entries)) {
+        BOOST_FOREACH(const NamespaceIndex::Entry& entry, entries) {
+            if (options.packedFileSize > 0 && entry.first == Pack::fileName)
+                packed = true;
+            else if (!options.manifests || entry.first != Manifest::fileName)
+                snapshot.Add(entry.first.c_str(), 0, entry.second);
+        }
+        if (packed) {
+            // share files left over from before the files were packed
+            AddPacked(path, snapshot);
+            snapshot.RemoveDuplicates();
+        }
+        return false;
+    }
+
+    Directory sourceDir(GetSource());
     std::string potentialPath = GetSource();
     while (true) {
         struct dirent* shareEntry = sourceDir.Readdir();
@@ -80,73 +308,121 @@ int ZFecFSDecoder::Readdir(const char*, void* buffer, fuse_fill_dir_t filler,
             while (true) {
                 struct dirent* entry = sharedDir.Readdir();
                 if (entry == NULL) break;
-                if (IsDotDirectory(entry->d_name))
-                    continue;
-                const bool inserted = entriesSeen.insert(entry->d_name).second;
-                if (inserted) {
-                    std::string absolutePath = potentialPath;
-                    absolutePath.append("/");
-                    absolutePath.append(entry->d_name);
-                    st.st_ino = entry->d_ino;
-                    st.st_mode = entry->d_type << 12;
-                    if (S_ISREG(st.st_mode)) {
-                        // TODO this is very expensive - do we really need it?
-                        st.st_size = FileDecoder::Size(absolutePath);
-                    } else {
-                        st.st_size = 1;
-                    }
-                    if (filler(buffer, entry->d_name, &st, 0) == 1)
-                        return -EIO;
-                }
+                if (options.packedFileSize > 0 && strcmp(entry->d_name, Pack::fileName) == 0)
+                    packed = true;
+                else if (!IsDotDirectory(entry->d_name)
+                         && (!options.manifests || strcmp(entry->d_name, Manifest::fileName) != 0))
+                    snapshot.Add(entry->d_name, entry->d_ino, entry->d_type);
             }
         } catch (std::exception& exc) {
             continue;
         }
     }
+    if (packed)
+        AddPacked(path, snapshot);
+    snapshot.RemoveDuplicates();
+    return false;
+}
 
-    return 0;
+void ZFecFSDecoder::AddPacked(const char* path, DirectorySnapshot& snapshot)
+{
+    try {
+        const Handle pack = OpenPack(path);
+        BOOST_FOREACH(const Pack::Entry& entry, pack->pack->Entries())
+            snapshot.Add(entry.name.c_str(), 0, IFTODT(entry.mode));
+    } catch (const std::exception& exc) {
+        // not enough shares of the pack, the files in it are not available
+    }
 }
 
-int ZFecFSDecoder::Releasedir(const char *, fuse_file_info *fileInfo)
+boost::shared_ptr<const Manifest> ZFecFSDecoder::GetManifest(const std::string& path)
 {
-    delete reinterpret_cast<std::string*>(fileInfo->fh);
-    return 0;
+    std::vector<std::string> directories;
+    if (!namespaceIndex || !namespaceIndex->Lookup(path, numShares, directories)) {
+        Directory sourceDir(GetSource());
+        for (struct dirent* entry = sourceDir.Readdir(); entry != NULL; entry = sourceDir.Readdir()) {
+            if (!IsDotDirectory(entry->d_name))
+                directories.push_back(GetSource() + entry->d_name + path);
+        }
+    }
+
+    BOOST_FOREACH(const std::string& directory, directories) {
+        boost::shared_ptr<const Manifest> manifest = manifests.Get(directory);
+        if (manifest)
+            return manifest;
+    }
+    return boost::shared_ptr<const Manifest>();
 }
 
-int ZFecFSDecoder::Open(const char *path, fuse_file_info *fileInfo)
+off_t ZFecFSDecoder::DecodedSize(const std::string& path, const struct stat& statBuf)
+{
+    off_t size;
+    if (sizes.Enabled() && sizes.Lookup(statBuf, size))
+        return size;
+    size = FileDecoder::Size(*OpenFile(path));
+    if (sizes.Enabled())
+        sizes.Insert(statBuf, size);
+    return size;
+}
+
+void ZFecFSDecoder::PrefetchSize(const std::string& path)
 {
+    IoScheduler::ClassScope prefetch(IoScheduler::prefetch);
     try {
         struct stat statBuf;
-        std::vector<std::string> paths = GetFirstNumPathMatchesInAnyShare(path,
-                                                                          GetFecWrapper().GetSharesRequired(),
-                                                                          &statBuf);
-        if (paths.size() < fecWrapper.GetSharesRequired() || fecWrapper.GetSharesRequired() < 1)
-            throw SimpleException("Not enough encoded files.");
-
-        // TODO vector of shared_ptr is not nice...
-        std::vector<boost::shared_ptr<AbstractFile> > files;
-        BOOST_FOREACH(const std::string& path, paths)
-            files.push_back(boost::make_shared<File>(path));
-
-        fileInfo->fh = ToHandle(FileDecoder::Open(files, fecWrapper));
+        const std::string realPath = GetFirstPathMatchInAnyShare(path.c_str(), &statBuf);
+        if (S_ISREG(statBuf.st_mode))
+            DecodedSize(realPath, statBuf);
     } catch (const std::exception& exc) {
-        return -ENOENT;
+        // removed in the meantime or not a valid share, getattr will tell
     }
+}
 
-    return 0;
+int ZFecFSDecoder::OpenFileState::Read(char* outBuffer, size_t size, off_t offset) const
+{
+    if (packedSize < 0)
+        return decoder->Read(outBuffer, size, offset);
+    if (offset >= packedSize)
+        return 0;
+    return decoder->Read(outBuffer, std::min<off_t>(size, packedSize - offset), packedOffset + offset);
+}
+
+bool ZFecFSDecoder::OpenFileState::StillValid() const
+{
+    for (unsigned int i = 0; i < sharePaths.size(); ++i) {
+        struct stat statBuf;
+        // follows symlinks like the fstat of the opened share
+        if (stat(sharePaths[i].c_str(), &statBuf) == -1)
+            return false;
+        const struct stat& opened = shareStats[i];
+        if (statBuf.st_dev != opened.st_dev || statBuf.st_ino != opened.st_ino
+                || statBuf.st_size != opened.st_size
+                || statBuf.st_mtim.tv_sec != opened.st_mtim.tv_sec
+                || statBuf.st_mtim.tv_nsec != opened.st_mtim.tv_nsec)
+            return false;
+    }
+    return true;
 }
 
 std::vector<std::string> ZFecFSDecoder::GetFirstNumPathMatchesInAnyShare(
                              const char* pathToFind, unsigned int numMatches,
-                             struct stat* statBuf )
+                             struct stat* statBuf, unsigned int minMatches)
 {
     struct stat statBufHere;
     if (statBuf == NULL)
         statBuf = &statBufHere;
+    if (minMatches == 0)
+        minMatches = numMatches;
+
+    std::vector<std::string> paths;
+    if (namespaceIndex && namespaceIndex->Lookup(pathToFind, numMatches, paths)) {
+        if (paths.size() >= minMatches && lstat(paths.front().c_str(), statBuf) == 0)
+            return paths;
+        throw SimpleException("Not enough shares found for file.");
+    }
 
     Directory sourceDir(GetSource());
 
-    std::vector<std::string> paths;
     std::string potentialPath = GetSource();
     while (paths.size() < numMatches) {
         struct dirent* entry = sourceDir.Readdir();
@@ -160,18 +436,55 @@ std::vector<std::string> ZFecFSDecoder::GetFirstNumPathMatchesInAnyShare(
         if (lstat(potentialPath.c_str(), statBuf) == 0)
             paths.push_back(potentialPath);
     }
-    if (paths.size() >= numMatches)
+    if (paths.size() >= minMatches)
         return paths;
     else
         throw SimpleException("Not enough shares found for file.");
 }
 
+std::string ZFecFSDecoder::ShareDirectory(const std::string& path) const
+{
+    const std::string::size_type start = GetSource().size();
+    return path.substr(start, path.find('/', start) - start);
+}
+
+void ZFecFSDecoder::SortByLatency(std::vector<std::string>& paths) const
+{
+    std::vector<std::pair<double, size_t> > latencies;
+    for (size_t i = 0; i < paths.size(); ++i)
+        latencies.push_back(std::make_pair(shareLatency.Quantile(ShareDirectory(paths[i]), 0.5), i));
+    std::stable_sort(latencies.begin(), latencies.end());
+
+    std::vector<std::string> sorted;
+    for (size_t i = 0; i < latencies.size(); ++i)
+        sorted.push_back(paths[latencies[i].second]);
+    paths.swap(sorted);
+}
+
+double ZFecFSDecoder::HedgeDelay(const std::vector<std::string>& paths) const
+{
+    double delay = 0;
+    BOOST_FOREACH(const std::string& path, paths) {
+        const double latency = shareLatency.Quantile(ShareDirectory(path), hedgeQuantile);
+        if (latency == 0)
+            return defaultHedgeDelay;
+        delay = std::max(delay, latency);
+    }
+    return delay;
+}
+
 std::string ZFecFSDecoder::GetFirstPathMatchInAnyShare(const char* pathToFind,
                                                        struct stat* statBuf)
 {
     struct stat statBufHere;
     if (statBuf == NULL) statBuf = &statBufHere;
-    // TODO cache directory info of base directory?
+
+    std::vector<std::string> paths;
+    if (namespaceIndex && namespaceIndex->Lookup(pathToFind, 1, paths)) {
+        if (!paths.empty() && lstat(paths.front().c_str(), statBuf) == 0)
+            return paths.front();
+        throw SimpleException("File not found in any share.");
+    }
 
     Directory sourceDir(GetSource());
 
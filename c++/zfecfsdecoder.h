@@ -7,9 +7,26 @@
 #include <errno.h>
 
 #include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "zfecfs.h"
+#include "blockcache.h"
 #include "filedecoder.h"
+#include "openstatecache.h"
+#include "namespaceindex.h"
+#include "sizecache.h"
+#include "directorysnapshot.h"
+#include "manifest.h"
+#include "pack.h"
+#include "prefetcher.h"
+#include "sharelatency.h"
+#include "sharereader.h"
+#include "cancellation.h"
 
 namespace ZFecFS {
 
@@ -18,9 +35,34 @@ class ZFecFSDecoder : public ZFecFS
 public:
     ZFecFSDecoder(unsigned int sharesRequired,
                   unsigned int numShares,
-                  const std::string &source)
-    : ZFecFS(sharesRequired, numShares, source)
-    {}
+                  const std::string &source,
+                  const Options& options)
+    : ZFecFS(sharesRequired, numShares, source, options)
+    , blockCache(options.blockCacheSize)
+    , openFiles(options.openCacheFiles, options.openCacheIdleTime)
+    , packs(options.openCacheFiles, options.openCacheIdleTime)
+    , sizes(options.sizeCacheEntries)
+    , manifests(sharesRequired, maxCachedManifests)
+    , prefetcher(options.sizeCacheEntries > 0 ? options.prefetchThreads : 0, maxPrefetchQueueSize,
+                 boost::bind(&ZFecFSDecoder::PrefetchSize, this, boost::placeholders::_1))
+    {
+        if (options.namespaceIndex)
+            namespaceIndex.reset(new NamespaceIndex(GetSource()));
+        if (options.hedgeThreads > 0)
+            shareReader.reset(new ShareReader(options.hedgeThreads));
+    }
+
+    virtual void Start()
+    {
+        ZFecFS::Start();
+        openFiles.Start();
+        packs.Start();
+        if (namespaceIndex)
+            namespaceIndex->Start();
+        if (shareReader)
+            shareReader->StartWorkers();
+        prefetcher.Start();
+    }
 
     virtual int Getattr(const char* path, struct stat* stbuf);
     virtual int Opendir(const char* path, struct fuse_file_info* fileInfo);
@@ -32,7 +74,9 @@ public:
                      size_t size, off_t offset,
                      fuse_file_info *fileInfo) {
         try {
-            return FromHandle(fileInfo->fh)->Read(outBuffer, size, offset);
+            return (*FromHandle(fileInfo->fh))->Read(outBuffer, size, offset);
+        } catch (const Cancelled&) {
+            return -EINTR;
         } catch (const std::exception& exc) {
             return -EIO;
         }
@@ -43,21 +87,105 @@ public:
         delete FromHandle(fileInfo->fh);
         return 0;
     }
+
+    BlockCache::Statistics GetBlockCacheStatistics() const
+    {
+        return blockCache.GetStatistics();
+    }
 private:
     std::string GetFirstPathMatchInAnyShare(const char* pathToFind,
                                             struct stat* statBuf = NULL);
+    /// Returns up to numMatches paths of pathToFind in the shares.
+    /// @throws SimpleException if less than minMatches (or numMatches if 0) are found
     std::vector<std::string> GetFirstNumPathMatchesInAnyShare(
                            const char* pathToFind, unsigned int numMatches,
-                           struct stat* statBuf = NULL);
+                           struct stat* statBuf = NULL, unsigned int minMatches = 0);
+
+    /// Name of the share directory the path of a share file is in.
+    std::string ShareDirectory(const std::string& path) const;
+    /// Sorts the paths of share files by the median read latency of their
+    /// share directories, directories without reads first.
+    void SortByLatency(std::vector<std::string>& paths) const;
+    /// Seconds after which a read of one of the share files at paths is
+    /// hedged with a read of a spare share.
+    double HedgeDelay(const std::vector<std::string>& paths) const;
+
+    /// Decoder of an opened file together with the shares it uses, shared
+    /// by all opens of the file.
+    class OpenFileState {
+    public:
+        OpenFileState() : packedOffset(0), packedSize(-1) {}
 
-    uint64_t ToHandle(FileDecoder* decoder) const
+        boost::shared_ptr<FileDecoder> decoder;
+        /// The shares the decoder was opened with, spares are not checked.
+        std::vector<std::string> sharePaths;
+        std::vector<struct stat> shareStats;
+        /// Index of the decoded file if it is a pack, loaded on first use.
+        boost::shared_ptr<const Pack> pack;
+        /// Range of the decoded file that is read for a file in a pack, the
+        /// size is negative for the whole file.
+        off_t packedOffset;
+        off_t packedSize;
+
+        int Read(char* outBuffer, size_t size, off_t offset) const;
+        /// Checks that the paths still refer to the unchanged share files.
+        bool StillValid() const;
+    };
+    typedef boost::shared_ptr<OpenFileState> Handle;
+
+    Handle OpenDecoder(const char* path);
+    /// Opens the share file at path, timing its reads if share latencies are used.
+    boost::shared_ptr<AbstractFile> OpenShare(const std::string& path);
+
+    /// Opens the pack of the directory path with its index loaded, or
+    /// returns the one cached for the directory if its shares are unchanged.
+    /// @throws SimpleException if the directory has no valid pack
+    Handle OpenPack(const std::string& path);
+
+    /// Merges the contents of the directory path in all shares, returns
+    /// true if the listing was taken from a manifest.
+    bool TakeSnapshot(const char* path, DirectorySnapshot& snapshot);
+
+    /// Adds the files in the pack of the directory path, if it can be read.
+    void AddPacked(const char* path, DirectorySnapshot& snapshot);
+
+    /// Returns the manifest of the directory path from any share, an empty
+    /// pointer if no share has an up-to-date manifest.
+    boost::shared_ptr<const Manifest> GetManifest(const std::string& path);
+
+    /// Decoded size of the share file at path, statBuf is its lstat result.
+    off_t DecodedSize(const std::string& path, const struct stat& statBuf);
+    /// Puts the decoded size of the file at path into the size cache.
+    void PrefetchSize(const std::string& path);
+
+    uint64_t ToHandle(Handle* handle) const
     {
-        return reinterpret_cast<u_int64_t>(decoder);
+        return reinterpret_cast<u_int64_t>(handle);
     }
-    FileDecoder* FromHandle(uint64_t handle) const
+    Handle* FromHandle(uint64_t handle) const
     {
-        return reinterpret_cast<FileDecoder*>(handle);
+        return reinterpret_cast<Handle*>(handle);
     }
+
+    BlockCache blockCache;
+    OpenStateCache<std::string, OpenFileState> openFiles;
+    /// Opened packs with their index by directory, apart from openFiles so
+    /// that lookups of missing files do not depend on other opens.
+    OpenStateCache<std::string, OpenFileState> packs;
+    boost::scoped_ptr<NamespaceIndex> namespaceIndex;
+    SizeCache sizes;
+    ManifestCache manifests;
+    ShareLatency shareLatency;
+    boost::scoped_ptr<ShareReader> shareReader;
+    boost::mutex packMutex; // guards OpenFileState::pack
+    Prefetcher prefetcher; // last, its threads use the members above
+
+    /// Delay before hedging reads of share directories without known latency.
+    const static double defaultHedgeDelay;
+    /// Quantile of the latency of a share directory after which reads are hedged.
+    const static double hedgeQuantile;
+    const static size_t maxCachedManifests = 1024;
+    const static size_t maxPrefetchQueueSize = 65536;
 };
 
 } // namespace ZFecFS
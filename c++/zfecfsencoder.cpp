@@ -2,6 +2,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,22 +11,61 @@
 #include <stdint.h>
 
 #include <pthread.h>
+#include <time.h>
+
+#include <sstream>
+#include <algorithm>
+#include <map>
 
 #include <boost/make_shared.hpp>
 
 #include "utils.h"
 #include "decodedpath.h"
-#include "directory.h"
+#include "directfile.h"
 #include "fileencoder.h"
+#include "metadata.h"
 
 namespace ZFecFS {
 
+namespace {
+
+void MoveForward(struct timespec& newest, const struct timespec& time)
+{
+    if (time.tv_sec > newest.tv_sec || (time.tv_sec == newest.tv_sec && time.tv_nsec > newest.tv_nsec))
+        newest = time;
+}
+
+bool SameTime(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+ssize_t ReadEntry(int directoryHandle, const std::string& name, char* buffer, size_t size)
+{
+    const int handle = openat(directoryHandle, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (handle == -1)
+        return -1;
+    size_t sizeRead = 0;
+    while (sizeRead < size) {
+        const ssize_t result = pread(handle, buffer + sizeRead, size - sizeRead, sizeRead);
+        if (result <= 0)
+            break;
+        sizeRead += result;
+    }
+    close(handle);
+    return sizeRead;
+}
+
+} // anonymous namespace
 
 int ZFecFSEncoder::Getattr(const char* path, struct stat* stbuf)
 {
     try {
-        DecodedPath decodedPath = DecodedPath::DecodePath(path, GetSource());
-        if (decodedPath.indexGiven) {
+        DecodedPath decodedPath = Decode(path);
+        std::string contents;
+        if (GenerateFile(decodedPath, false, contents, *stbuf)) {
+            // contents are generated again on open
+        } else if (decodedPath.indexGiven) {
             if (lstat(decodedPath.path.c_str(), stbuf) == -1)
                 return -errno;
             if ((stbuf->st_mode & S_IFMT) == S_IFREG)
@@ -33,7 +73,9 @@ int ZFecFSEncoder::Getattr(const char* path, struct stat* stbuf)
         } else {
             memset(stbuf, 0, sizeof(struct stat));
             stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = numShares + 2;
+            stbuf->st_nlink = 2;
+            for (DecodedPath::ShareIndex shareIndex = 0; shareIndex < numShares; ++shareIndex)
+                stbuf->st_nlink += options.ServesShare(shareIndex) ? 1 : 0;
         }
     } catch (const std::exception& exc) {
         return -ENOENT;
@@ -47,11 +89,14 @@ int ZFecFSEncoder::Opendir(const char* path, fuse_file_info* fileInfo)
     fileInfo->keep_cache = 1;
     fileInfo->fh = 0;
     try {
-        DecodedPath decodedPath = DecodedPath::DecodePath(path, GetSource());
+        DecodedPath decodedPath = Decode(path);
         if (decodedPath.indexGiven) {
-            fileInfo->fh = reinterpret_cast<uint64_t>(new Directory(decodedPath.path));
-            if (fileInfo->fh == 0)
-                return -errno;
+            OpenDirectory* dir = new OpenDirectory(decodedPath.path);
+            if (options.packedFileSize > 0) {
+                struct timespec newest = {0, 0};
+                dir->pack = ListPack(*dir, newest);
+            }
+            fileInfo->fh = reinterpret_cast<uint64_t>(dir);
         }
     } catch (const std::exception& exc) {
         return -ENOENT;
@@ -63,33 +108,40 @@ int ZFecFSEncoder::Readdir(const char*, void* buffer, fuse_fill_dir_t filler,
                            off_t offset, fuse_file_info* fileInfo)
 {
     try {
-        struct stat st;
-        memset(&st, 0, sizeof(st));
-
         if (fileInfo->fh == 0) {
             filler(buffer, ".", NULL, 0);
             filler(buffer, "..", NULL, 0);
             for (DecodedPath::ShareIndex shareIndex = 0; shareIndex < numShares; ++shareIndex) {
+                if (!options.ServesShare(shareIndex))
+                    continue;
                 char name[3];
                 DecodedPath::EncodeShareIndex(shareIndex, &(name[0]));
                 // TODO provide stat
                 filler(buffer, name, NULL, 0);
             }
         } else {
-            Directory& dir = *reinterpret_cast<Directory*>(fileInfo->fh);
-            boost::lock_guard<boost::mutex> lock(dir.GetMutex());
-
-            if (offset != 0)
-                dir.Seek(offset);
-
-            for (struct dirent* entry = dir.Readdir(); entry != NULL; entry = dir.Readdir()) {
-                st.st_ino = entry->d_ino;
-                st.st_mode = entry->d_type << 12;
-                st.st_size = FileEncoder::Size(st.st_size, sharesRequired);
-
-                if (filler(buffer, entry->d_name, &st, dir.Telldir()) == 1)
-                    break;
+            const OpenDirectory& dir = *reinterpret_cast<OpenDirectory*>(fileInfo->fh);
+            struct stat st;
+            for (size_t position = offset; position < dir.entries.Size(); ++position) {
+                if (!dir.Stat(position, sharesRequired, st))
+                    continue; // removed since opendir
+                const char* name = dir.entries.Name(position);
+                if (options.manifests && strcmp(name, Manifest::fileName) == 0)
+                    continue;
+                if (options.packedFileSize > 0
+                        && (strcmp(name, Pack::fileName) == 0 || dir.pack.Find(name) != NULL))
+                    continue;
+                if (filler(buffer, name, &st, position + 1) == 1)
+                    return 0;
             }
+            memset(&st, 0, sizeof(st));
+            st.st_mode = S_IFREG | 0444;
+            if (options.manifests && offset <= off_t(dir.entries.Size())) {
+                if (filler(buffer, Manifest::fileName, &st, dir.entries.Size() + 1) == 1)
+                    return 0;
+            }
+            if (!dir.pack.Entries().empty() && offset <= off_t(dir.entries.Size() + 1))
+                filler(buffer, Pack::fileName, &st, dir.entries.Size() + 2);
         }
     } catch (const std::exception& exc) {
         return -ENOENT;
@@ -100,7 +152,7 @@ int ZFecFSEncoder::Readdir(const char*, void* buffer, fuse_fill_dir_t filler,
 int ZFecFSEncoder::Releasedir(const char*, fuse_file_info *fileInfo)
 {
     if (fileInfo->fh != 0) {
-        delete reinterpret_cast<Directory*>(fileInfo->fh);
+        delete reinterpret_cast<OpenDirectory*>(fileInfo->fh);
         fileInfo->fh = 0;
     }
     return 0;
@@ -108,19 +160,32 @@ int ZFecFSEncoder::Releasedir(const char*, fuse_file_info *fileInfo)
 
 int ZFecFSEncoder::Open(const char* path, fuse_file_info* fileInfo)
 {
-    fileInfo->keep_cache = 1;
+    if (options.directSourceReads)
+        fileInfo->direct_io = 1;
 
     try {
-        DecodedPath decodedPath = DecodedPath::DecodePath(path, GetSource());
+        DecodedPath decodedPath = Decode(path);
 
         if ((fileInfo->flags & O_ACCMODE) != O_RDONLY)
             return -EACCES;
 
         fileInfo->fh = 0;
+        std::string contents;
+        struct stat statBuf;
+        if (GenerateFile(decodedPath, true, contents, statBuf)) {
+            // the size can change between getattr and open
+            fileInfo->direct_io = 1;
+            OpenShare* share = new OpenShare();
+            share->file = boost::make_shared<MemoryFile>(contents);
+            fileInfo->fh = ToHandle(share);
+            return 0;
+        }
         try {
-            fileInfo->fh = ToHandle(new FileEncoder(boost::make_shared<File>(decodedPath.path),
-                                                    decodedPath.index,
-                                                    GetFecWrapper()));
+            OpenShare* share = CreateShare(decodedPath.path, decodedPath.index);
+            // the kernel only drops cached pages of the share if we tell it to
+            fileInfo->keep_cache = SourceUnchanged(share->sourceStat, decodedPath.index)
+                                   && !options.directSourceReads;
+            fileInfo->fh = ToHandle(share);
         } catch (const std::exception& exc) {
             return -errno;
         }
@@ -130,4 +195,451 @@ int ZFecFSEncoder::Open(const char* path, fuse_file_info* fileInfo)
     return 0;
 }
 
+ZFecFSEncoder::OpenDirectory::OpenDirectory(const std::string& path)
+{
+    handle = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (handle == -1)
+        throw SimpleException("Error opening directory.");
+    try {
+        entries.AddAll(handle);
+    } catch (...) {
+        close(handle);
+        throw;
+    }
+}
+
+ZFecFSEncoder::OpenDirectory::~OpenDirectory()
+{
+    close(handle);
+}
+
+bool ZFecFSEncoder::OpenDirectory::Stat(size_t entry, unsigned int sharesRequired,
+                                        struct stat& statBuf) const
+{
+    if (!StatSource(entry, statBuf))
+        return false;
+    if (S_ISREG(statBuf.st_mode))
+        statBuf.st_size = FileEncoder::Size(statBuf.st_size, sharesRequired);
+    return true;
+}
+
+bool ZFecFSEncoder::OpenDirectory::StatSource(size_t entry, struct stat& statBuf) const
+{
+    const char* name = entries.Name(entry);
+    struct statx statxBuf;
+    if (statx(handle, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              STATX_BASIC_STATS, &statxBuf) == -1)
+        return false;
+
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_dev = makedev(statxBuf.stx_dev_major, statxBuf.stx_dev_minor);
+    statBuf.st_ino = statxBuf.stx_ino;
+    statBuf.st_mode = statxBuf.stx_mode;
+    statBuf.st_nlink = statxBuf.stx_nlink;
+    statBuf.st_uid = statxBuf.stx_uid;
+    statBuf.st_gid = statxBuf.stx_gid;
+    statBuf.st_rdev = makedev(statxBuf.stx_rdev_major, statxBuf.stx_rdev_minor);
+    statBuf.st_size = statxBuf.stx_size;
+    statBuf.st_blksize = statxBuf.stx_blksize;
+    statBuf.st_blocks = statxBuf.stx_blocks;
+    statBuf.st_atim.tv_sec = statxBuf.stx_atime.tv_sec;
+    statBuf.st_atim.tv_nsec = statxBuf.stx_atime.tv_nsec;
+    statBuf.st_mtim.tv_sec = statxBuf.stx_mtime.tv_sec;
+    statBuf.st_mtim.tv_nsec = statxBuf.stx_mtime.tv_nsec;
+    statBuf.st_ctim.tv_sec = statxBuf.stx_ctime.tv_sec;
+    statBuf.st_ctim.tv_nsec = statxBuf.stx_ctime.tv_nsec;
+    return true;
+}
+
+DecodedPath ZFecFSEncoder::Decode(const char* path) const
+{
+    DecodedPath decodedPath = DecodedPath::DecodePath(path, GetSource());
+    if (decodedPath.indexGiven
+            && (decodedPath.index >= numShares || !options.ServesShare(decodedPath.index)))
+        throw SimpleException("Share not served.");
+    return decodedPath;
+}
+
+ZFecFSEncoder::OpenShare* ZFecFSEncoder::CreateShare(const std::string& sourcePath,
+                                                     DecodedPath::ShareIndex shareIndex)
+{
+    struct stat statBuf;
+    if (smallFiles.Enabled() && stat(sourcePath.c_str(), &statBuf) == 0 && smallFiles.Covers(statBuf)) {
+        SmallFileCache::SharesPtr shares = smallFiles.Lookup(statBuf);
+        boost::shared_ptr<SourceState> sourceState;
+        if (!shares) {
+            sourceState = OpenSource(sourcePath);
+            statBuf = sourceState->statBuf;
+            if (smallFiles.Covers(statBuf)) {
+                shares = SmallFileCache::Encode(*sourceState->file, statBuf.st_size, GetFecWrapper(), numShares);
+                if (shares)
+                    smallFiles.Insert(statBuf, shares);
+            }
+        }
+        if (shares) {
+            OpenShare* share = new OpenShare();
+            share->source = sourceState;
+            share->sourceStat = statBuf;
+            share->file = boost::make_shared<MemoryFile>((*shares)[shareIndex]);
+            return share;
+        }
+    }
+
+    boost::shared_ptr<SourceState> sourceState = OpenSource(sourcePath);
+    boost::shared_ptr<AbstractFile> cached;
+    if (parityCache && shareIndex >= sharesRequired)
+        cached = parityCache->Open(sourcePath, *sourceState->file, shareIndex);
+
+    OpenShare* share = new OpenShare();
+    share->source = sourceState;
+    share->sourceStat = sourceState->statBuf;
+    if (cached)
+        share->file = cached;
+    else
+        share->encoder = sourceState->GetEncoder(shareIndex, GetFecWrapper(), computePool);
+    return share;
+}
+
+bool ZFecFSEncoder::GenerateFile(const DecodedPath& path, bool withContents, std::string& contents,
+                                 struct stat& statBuf)
+{
+    if (!path.indexGiven)
+        return false;
+    const std::string::size_type slash = path.path.rfind('/');
+    if (slash == std::string::npos)
+        return false;
+    const std::string directory = path.path.substr(0, slash);
+    const std::string name = path.path.substr(slash + 1);
+
+    if (options.manifests && name == Manifest::fileName) {
+        contents = BuildManifest(directory, path.index, statBuf);
+        return true;
+    }
+    if (options.packedFileSize > 0 && name == Pack::fileName) {
+        contents = BuildPack(directory, path.index, withContents, statBuf);
+        return true;
+    }
+
+    const std::string::size_type suffixLength = strlen(BlockSums::fileSuffix);
+    if (blockSums.Enabled() && name.size() > suffixLength
+            && name.compare(name.size() - suffixLength, suffixLength, BlockSums::fileSuffix) == 0) {
+        const std::string sourcePath = path.path.substr(0, path.path.size() - suffixLength);
+        if (lstat(sourcePath.c_str(), &statBuf) == -1 || !S_ISREG(statBuf.st_mode))
+            return false;
+        if (withContents) {
+            boost::scoped_ptr<OpenShare> share(CreateShare(sourcePath, path.index));
+            statBuf = share->sourceStat;
+            contents = blockSums.Get(statBuf, path.index, FileEncoder::Size(statBuf.st_size, sharesRequired),
+                                     boost::bind(&OpenShare::Read, share.get(), boost::placeholders::_1,
+                                                 boost::placeholders::_2, boost::placeholders::_3));
+        }
+        statBuf.st_mode = S_IFREG | 0444;
+        statBuf.st_nlink = 1;
+        statBuf.st_size = blockSums.FileSize(FileEncoder::Size(statBuf.st_size, sharesRequired));
+        return true;
+    }
+
+    // the journal files only exist in the root of each share
+    const std::string::size_type prefixLength = strlen(ChangeJournal::changesFilePrefix);
+    std::string root = GetSource();
+    root.erase(root.find_last_not_of('/') + 1);
+    std::string parent = directory;
+    parent.erase(parent.find_last_not_of('/') + 1);
+    if (!journal || parent != root)
+        return false;
+    if (name == ChangeJournal::cursorFileName) {
+        std::ostringstream cursor;
+        cursor << journal->Cursor() << '\n';
+        contents = cursor.str();
+    } else if (name.compare(0, prefixLength, ChangeJournal::changesFilePrefix) == 0) {
+        std::istringstream s(name.substr(prefixLength));
+        uint64_t cursor;
+        s >> cursor;
+        if (s.fail() || !s.eof() || !journal->Changes(cursor, contents))
+            throw SimpleException("Invalid cursor.");
+    } else {
+        return false;
+    }
+    memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = S_IFREG | 0444;
+    statBuf.st_nlink = 1;
+    statBuf.st_size = contents.size();
+    clock_gettime(CLOCK_REALTIME, &statBuf.st_mtim);
+    statBuf.st_ctim = statBuf.st_atim = statBuf.st_mtim;
+    return true;
+}
+
+std::string ZFecFSEncoder::BuildManifest(const std::string& directory, DecodedPath::ShareIndex index,
+                                         struct stat& statBuf)
+{
+    OpenDirectory dir(directory);
+    if (fstat(dir.handle, &statBuf) == -1)
+        throw SimpleException("Error reading directory status.");
+
+    // dated to the newest change in the directory, so that rsync's quick
+    // check notices when it has to be copied again
+    struct timespec newest = statBuf.st_mtim;
+    std::vector<std::pair<const char*, struct stat> > entries;
+    entries.reserve(dir.entries.Size());
+    for (size_t i = 0; i < dir.entries.Size(); ++i) {
+        const char* name = dir.entries.Name(i);
+        struct stat entryStat;
+        if (IsDotDirectory(const_cast<char*>(name)) || strcmp(name, Manifest::fileName) == 0
+                || (options.packedFileSize > 0 && strcmp(name, Pack::fileName) == 0)
+                || !dir.StatSource(i, entryStat))
+            continue;
+        entries.push_back(std::make_pair(name, entryStat));
+        MoveForward(newest, entryStat.st_mtim);
+        MoveForward(newest, entryStat.st_ctim);
+    }
+
+    std::string data;
+    bool cached = false;
+    {
+        boost::lock_guard<boost::mutex> lock(manifestMutex);
+        for (std::list<CachedManifest>::iterator it = manifests.begin(); it != manifests.end(); ++it) {
+            if (it->device == statBuf.st_dev && it->inode == statBuf.st_ino && it->index == index) {
+                if (SameTime(it->mtime, statBuf.st_mtim) && SameTime(it->newest, newest)) {
+                    data = it->data;
+                    cached = true;
+                    manifests.splice(manifests.begin(), manifests, it);
+                } else {
+                    manifests.erase(it);
+                }
+                break;
+            }
+        }
+    }
+
+    if (!cached) {
+        Manifest manifest;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const struct stat& entryStat = entries[i].second;
+            std::string header;
+            if (S_ISREG(entryStat.st_mode)) {
+                const Metadata metadata(sharesRequired, index, entryStat.st_size);
+                header.assign(metadata.begin(), metadata.end());
+            }
+            manifest.Add(entries[i].first, entryStat, header);
+        }
+        manifest.Sort();
+        data = manifest.Serialize();
+
+        CachedManifest entry;
+        entry.device = statBuf.st_dev;
+        entry.inode = statBuf.st_ino;
+        entry.index = index;
+        entry.mtime = statBuf.st_mtim;
+        entry.newest = newest;
+        entry.data = data;
+        boost::lock_guard<boost::mutex> lock(manifestMutex);
+        manifests.push_front(entry);
+        if (manifests.size() > maxCachedManifests)
+            manifests.pop_back();
+    }
+
+    statBuf.st_mode = S_IFREG | 0444;
+    statBuf.st_nlink = 1;
+    statBuf.st_size = data.size();
+    statBuf.st_blocks = (data.size() + 511) / 512;
+    statBuf.st_mtim = statBuf.st_ctim = statBuf.st_atim = newest;
+    return data;
+}
+
+size_t ZFecFSEncoder::MaxPackBytes() const
+{
+    if (options.smallFileCacheSize == 0)
+        return maxPackBytes;
+    // at most a quarter of the cache, so that a pack does not evict all
+    // small files
+    const size_t shareBytes = options.smallFileCacheSize / 4 / numShares;
+    if (shareBytes <= Metadata::size)
+        return 0;
+    const size_t packBytes = (shareBytes - Metadata::size) * sharesRequired;
+    return packBytes < maxPackBytes ? packBytes : maxPackBytes;
+}
+
+Pack ZFecFSEncoder::ListPack(const OpenDirectory& dir, struct timespec& newest) const
+{
+    // by name, so that the same files are packed each time the directory is listed
+    std::map<std::string, struct stat> small;
+    for (size_t i = 0; i < dir.entries.Size(); ++i) {
+        const char* name = dir.entries.Name(i);
+        struct stat entryStat;
+        if (IsDotDirectory(const_cast<char*>(name)) || strcmp(name, Pack::fileName) == 0
+                || strcmp(name, Manifest::fileName) == 0 || !dir.StatSource(i, entryStat))
+            continue;
+        if (S_ISREG(entryStat.st_mode) && size_t(entryStat.st_size) <= options.packedFileSize)
+            small[name] = entryStat;
+    }
+
+    Pack pack;
+    const size_t maxBytes = MaxPackBytes();
+    size_t bytes = Pack::headerSize;
+    for (std::map<std::string, struct stat>::const_iterator it = small.begin(); it != small.end(); ++it) {
+        bytes += Pack::recordSize + it->first.size() + it->second.st_size;
+        if (bytes > maxBytes)
+            break;
+        pack.Add(it->first, it->second);
+        MoveForward(newest, it->second.st_mtim);
+        MoveForward(newest, it->second.st_ctim);
+    }
+    pack.Sort();
+    return pack;
+}
+
+std::string ZFecFSEncoder::BuildPack(const std::string& directory, DecodedPath::ShareIndex index,
+                                     bool withContents, struct stat& statBuf)
+{
+    OpenDirectory dir(directory);
+    struct stat dirStat;
+    if (fstat(dir.handle, &dirStat) == -1)
+        throw SimpleException("Error reading directory status.");
+    for (unsigned int attempt = 1; ; ++attempt) {
+        struct timespec newest = dirStat.st_mtim;
+        const Pack pack = ListPack(dir, newest);
+        if (pack.Entries().empty())
+            throw SimpleException("No files to pack.");
+
+        // dated to the newest change of the packed files like the manifest,
+        // and cached like a small file of the directory's inode
+        statBuf = dirStat;
+        statBuf.st_mode = S_IFREG | 0444;
+        statBuf.st_nlink = 1;
+        statBuf.st_size = pack.Size();
+        statBuf.st_mtim = statBuf.st_ctim = statBuf.st_atim = newest;
+        std::string contents;
+        if (withContents) {
+            SmallFileCache::SharesPtr shares = smallFiles.Lookup(statBuf);
+            if (!shares) {
+                std::string data;
+                try {
+                    data = pack.Serialize(boost::bind(&ReadEntry, dir.handle, boost::placeholders::_1,
+                                                      boost::placeholders::_2, boost::placeholders::_3));
+                } catch (const SimpleException&) {
+                    // a packed file changed since it was listed
+                    if (attempt == maxPackAttempts)
+                        throw;
+                    continue;
+                }
+                shares = SmallFileCache::Encode(MemoryFile(data), data.size(), GetFecWrapper(), numShares);
+                smallFiles.Insert(statBuf, shares);
+            }
+            contents = (*shares)[index];
+        }
+        statBuf.st_size = FileEncoder::Size(pack.Size(), sharesRequired);
+        statBuf.st_blocks = (statBuf.st_size + 511) / 512;
+        return contents;
+    }
+}
+
+boost::shared_ptr<ZFecFSEncoder::SourceState> ZFecFSEncoder::OpenSource(const std::string& path)
+{
+    struct stat statBuf;
+    if (openSources.Enabled() && stat(path.c_str(), &statBuf) == 0) {
+        boost::shared_ptr<SourceState> state
+                = openSources.Get(std::make_pair(statBuf.st_dev, statBuf.st_ino));
+        if (state && state->Matches(statBuf))
+            return state;
+    }
+
+    boost::shared_ptr<SourceState> state = boost::make_shared<SourceState>();
+    if (options.directSourceReads)
+        state->file = Schedule(boost::make_shared<DirectFile>(path));
+    else
+        state->file = OpenFile(path);
+    state->file->Stat(state->statBuf);
+    if (stripeCache)
+        state->file = boost::make_shared<StripeCachedFile>(state->file, *stripeCache, state->statBuf);
+    if (openSources.Enabled())
+        openSources.Put(std::make_pair(state->statBuf.st_dev, state->statBuf.st_ino), state, 1);
+    return state;
+}
+
+bool ZFecFSEncoder::SourceUnchanged(const struct stat& statBuf, DecodedPath::ShareIndex shareIndex)
+{
+    const ShareKey key(std::make_pair(statBuf.st_dev, statBuf.st_ino), shareIndex);
+    SourceStamp stamp;
+    stamp.size = statBuf.st_size;
+    stamp.mtime = statBuf.st_mtim;
+    stamp.ctime = statBuf.st_ctim;
+
+    boost::lock_guard<boost::mutex> lock(stampMutex);
+    std::map<ShareKey, SourceStamp>::iterator it = openedStamps.find(key);
+    if (it != openedStamps.end()) {
+        const bool unchanged = it->second.size == stamp.size && SameTime(it->second.mtime, stamp.mtime)
+                && SameTime(it->second.ctime, stamp.ctime);
+        it->second = stamp;
+        return unchanged;
+    }
+    // forgetting stamps only costs dropping cached pages once
+    if (openedStamps.size() >= maxOpenedStamps)
+        openedStamps.clear();
+    openedStamps[key] = stamp;
+    return false;
+}
+
+void ZFecFSEncoder::SourceChanged(const std::string& path, bool entryChanged)
+{
+    if (journal && !sourceWatcher->Complete())
+        journal->MarkIncomplete();
+    if (journal && GetSource() + path.substr(std::min<size_t>(1, path.size())) != journal->GetPath())
+        journal->Record(path);
+    if (path.empty()) {
+        // events were lost
+        openSources.Clear();
+        boost::lock_guard<boost::mutex> lock(stampMutex);
+        openedStamps.clear();
+        return;
+    }
+
+    struct stat statBuf;
+    if (stat((GetSource() + path.substr(1)).c_str(), &statBuf) == 0) {
+        const std::pair<dev_t, ino_t> source(statBuf.st_dev, statBuf.st_ino);
+        openSources.Remove(source);
+        // also changes that keep size and times, the next open of any
+        // share must not keep the cached pages
+        boost::lock_guard<boost::mutex> lock(stampMutex);
+        openedStamps.erase(openedStamps.lower_bound(ShareKey(source, 0)),
+                           openedStamps.lower_bound(ShareKey(source, numShares)));
+    }
+
+    if (invalidator == NULL)
+        return;
+    const std::string::size_type slash = path.rfind('/');
+    for (DecodedPath::ShareIndex shareIndex = 0; shareIndex < numShares; ++shareIndex) {
+        char name[3];
+        DecodedPath::EncodeShareIndex(shareIndex, &(name[0]));
+        const std::string sharePath = std::string("/") + name + path;
+        invalidator->InvalidateContents(sharePath);
+        if (entryChanged)
+            invalidator->InvalidateEntry(std::string("/") + name + path.substr(0, slash),
+                                         path.substr(slash + 1));
+    }
+}
+
+bool ZFecFSEncoder::SourceState::Matches(const struct stat& other) const
+{
+    return statBuf.st_size == other.st_size
+            && statBuf.st_mtim.tv_sec == other.st_mtim.tv_sec
+            && statBuf.st_mtim.tv_nsec == other.st_mtim.tv_nsec
+            && statBuf.st_ctim.tv_sec == other.st_ctim.tv_sec
+            && statBuf.st_ctim.tv_nsec == other.st_ctim.tv_nsec;
+}
+
+boost::shared_ptr<FileEncoder> ZFecFSEncoder::SourceState::GetEncoder(DecodedPath::ShareIndex shareIndex,
+                                                                      const FecWrapper& fecWrapper,
+                                                                      ComputePool& computePool)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (encoders.size() <= shareIndex)
+        encoders.resize(shareIndex + 1);
+    if (!encoders[shareIndex]) {
+        encoders[shareIndex] = boost::make_shared<FileEncoder>(file, shareIndex, fecWrapper,
+                                                              statBuf.st_size);
+        encoders[shareIndex]->UseComputePool(computePool);
+    }
+    return encoders[shareIndex];
+}
+
 } // namespace ZFecFS
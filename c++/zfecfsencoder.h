@@ -6,9 +6,29 @@
 #include <errno.h>
 
 #include <exception>
+#include <list>
+#include <map>
+#include <vector>
+#include <utility>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "zfecfs.h"
 #include "fileencoder.h"
+#include "paritycache.h"
+#include "openstatecache.h"
+#include "directorysnapshot.h"
+#include "decodedpath.h"
+#include "manifest.h"
+#include "sourcewatcher.h"
+#include "changejournal.h"
+#include "blocksums.h"
+#include "stripecache.h"
+#include "smallfilecache.h"
+#include "pack.h"
+#include "cancellation.h"
 
 namespace ZFecFS {
 
@@ -18,9 +38,41 @@ class ZFecFSEncoder : public ZFecFS
 public:
     ZFecFSEncoder(unsigned int sharesRequired,
                   unsigned int numShares,
-                  const std::string &source)
-    : ZFecFS(sharesRequired, numShares, source)
-    {}
+                  const std::string &source,
+                  const Options& options)
+    : ZFecFS(sharesRequired, numShares, source, options)
+    , openSources(options.openCacheFiles, options.openCacheIdleTime)
+    , blockSums(options.blockSumsBlockSize, maxBlockSumsBytes)
+    , smallFiles(options.smallFileSize, options.smallFileCacheSize)
+    {
+        if (options.stripeCacheSize > 0)
+            stripeCache.reset(new StripeCache(StripeCache::DefaultName(), options.stripeCacheSize));
+        if (!options.parityCacheDirectory.empty())
+            parityCache.reset(new ParityCache(options.parityCacheDirectory, source,
+                                              options.parityScanInterval,
+                                              numShares, fecWrapper, ioScheduler.get()));
+        if (!options.journalPath.empty()) {
+            journal.reset(new ChangeJournal(options.journalPath));
+            // changes while we were not running are unknown
+            journal->Record(std::string());
+        }
+        if (options.watchSource || journal)
+            sourceWatcher.reset(new SourceWatcher(source, boost::bind(&ZFecFSEncoder::SourceChanged, this,
+                                                                      boost::placeholders::_1,
+                                                                      boost::placeholders::_2)));
+        if (journal && !sourceWatcher->Complete())
+            journal->MarkIncomplete();
+    }
+
+    virtual void Start()
+    {
+        ZFecFS::Start();
+        openSources.Start();
+        if (parityCache)
+            parityCache->Start();
+        if (sourceWatcher)
+            sourceWatcher->Start();
+    }
 
     virtual int Getattr(const char* path, struct stat* stbuf);
     virtual int Opendir(const char* path, struct fuse_file_info* fileInfo);
@@ -34,6 +86,8 @@ public:
     {
         try {
             return FromHandle(fileInfo->fh)->Read(outBuffer, size, offset);
+        } catch (const Cancelled&) {
+            return -EINTR;
         } catch (const std::exception& exc) {
             return -EIO;
         }
@@ -45,14 +99,146 @@ public:
         return 0;
     }
 private:
-    uint64_t ToHandle(FileEncoder* encoder) const
+    /// Opened source file, shared by all opens of its shares.
+    class SourceState {
+    public:
+        boost::shared_ptr<AbstractFile> file;
+        struct stat statBuf;
+
+        bool Matches(const struct stat& other) const;
+        boost::shared_ptr<FileEncoder> GetEncoder(DecodedPath::ShareIndex shareIndex,
+                                                  const FecWrapper& fecWrapper,
+                                                  ComputePool& computePool);
+    private:
+        boost::mutex mutex;
+        std::vector<boost::shared_ptr<FileEncoder> > encoders;
+    };
+
+    /// A share opened for reading, either encoded on the fly, read from
+    /// the parity cache or served from the small file cache.
+    class OpenShare {
+    public:
+        boost::shared_ptr<SourceState> source; // not set for small files served from memory
+        struct stat sourceStat;
+        boost::shared_ptr<FileEncoder> encoder;
+        boost::shared_ptr<AbstractFile> file;
+
+        int Read(char* outBuffer, size_t size, off_t offset)
+        {
+            if (encoder)
+                return encoder->Read(outBuffer, size, offset);
+            else
+                return file->Read(outBuffer, size, offset);
+        }
+    };
+
+    /// A directory of a share view, listed when it is opened. The handle is
+    /// used to stat the entries without resolving their full paths.
+    class OpenDirectory : boost::noncopyable {
+    public:
+        explicit OpenDirectory(const std::string& path);
+        ~OpenDirectory();
+
+        /// Fills statBuf like Getattr would for the entry.
+        bool Stat(size_t entry, unsigned int sharesRequired, struct stat& statBuf) const;
+        /// Fills statBuf with the attributes of the source file.
+        bool StatSource(size_t entry, struct stat& statBuf) const;
+
+        int handle;
+        DirectorySnapshot entries;
+        Pack pack; // the small files served in the pack file instead
+    };
+
+    uint64_t ToHandle(OpenShare* share) const
     {
-        return reinterpret_cast<uint64_t>(encoder);
+        return reinterpret_cast<uint64_t>(share);
     }
-    FileEncoder* FromHandle(uint64_t handle) const
+    OpenShare* FromHandle(uint64_t handle) const
     {
-        return reinterpret_cast<FileEncoder*>(handle);
+        return reinterpret_cast<OpenShare*>(handle);
     }
+
+    /// Decodes path, only accepting the shares this process serves.
+    /// @throws SimpleException if path is not valid
+    DecodedPath Decode(const char* path) const;
+
+    /// Opens the source file, or returns its state if it is still open
+    /// and was not modified since.
+    boost::shared_ptr<SourceState> OpenSource(const std::string& path);
+    /// Records the stamp of the source file described by statBuf for the
+    /// given share, returns whether it is the same as when the share was
+    /// opened the last time.
+    bool SourceUnchanged(const struct stat& statBuf, DecodedPath::ShareIndex shareIndex);
+    /// Drops what is cached about the source file at path (relative to the
+    /// source), called by the source watcher.
+    void SourceChanged(const std::string& path, bool entryChanged);
+
+    /// Opens a share of the source file, encoded on the fly, from the
+    /// parity cache or from the small file cache.
+    OpenShare* CreateShare(const std::string& sourcePath, DecodedPath::ShareIndex shareIndex);
+    /// Returns false if path is not a generated file (manifest, change
+    /// journal or block sums), otherwise fills statBuf and, if withContents
+    /// is set or needed for the size anyway, contents.
+    bool GenerateFile(const DecodedPath& path, bool withContents, std::string& contents,
+                      struct stat& statBuf);
+    /// Lists the source directory for the given share, statBuf is set to
+    /// the attributes of the manifest file. Reuses the last manifests built
+    /// as long as the directory and the newest change in it are the same.
+    std::string BuildManifest(const std::string& directory, DecodedPath::ShareIndex index,
+                              struct stat& statBuf);
+
+    /// Bytes a pack may have, so that its encoded shares fit into the
+    /// small file cache.
+    size_t MaxPackBytes() const;
+    /// Collects the small files of dir that go into its pack, newest is
+    /// moved forward to their latest modification or change.
+    Pack ListPack(const OpenDirectory& dir, struct timespec& newest) const;
+    /// Builds the pack of the source directory for the given share, the
+    /// contents only if withContents is set. statBuf is set to the
+    /// attributes of the pack file. The directory is listed again if a
+    /// packed file changes while it is read.
+    /// @throws SimpleException if the directory has no small files or they
+    /// keep changing
+    std::string BuildPack(const std::string& directory, DecodedPath::ShareIndex index, bool withContents,
+                          struct stat& statBuf);
+
+    boost::scoped_ptr<StripeCache> stripeCache;
+    boost::scoped_ptr<ParityCache> parityCache;
+    OpenStateCache<std::pair<dev_t, ino_t>, SourceState> openSources;
+    BlockSums blockSums;
+    SmallFileCache smallFiles;
+    /// A manifest built for one share of a directory, which was modified
+    /// at mtime and had its newest change (of any entry) at newest.
+    class CachedManifest {
+    public:
+        dev_t device;
+        ino_t inode;
+        DecodedPath::ShareIndex index;
+        struct timespec mtime;
+        struct timespec newest;
+        std::string data;
+    };
+    /// Size, modification and change time of a source file.
+    class SourceStamp {
+    public:
+        off_t size;
+        struct timespec mtime;
+        struct timespec ctime;
+    };
+    typedef std::pair<std::pair<dev_t, ino_t>, DecodedPath::ShareIndex> ShareKey;
+    boost::mutex stampMutex;
+    std::map<ShareKey, SourceStamp> openedStamps; // of the last open of each share
+    boost::mutex manifestMutex;
+    std::list<CachedManifest> manifests; // most recently used first
+    boost::scoped_ptr<ChangeJournal> journal;
+    boost::scoped_ptr<SourceWatcher> sourceWatcher; // last, its thread uses the members above
+
+    const static size_t maxBlockSumsBytes = 64 << 20;
+    const static size_t maxCachedManifests = 16;
+    const static size_t maxOpenedStamps = 1 << 16;
+    /// Files beyond this many bytes of a pack are not packed.
+    const static size_t maxPackBytes = 64 << 20;
+    const static unsigned int maxPackAttempts = 3;
 };
 
 